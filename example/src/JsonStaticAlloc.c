@@ -9,10 +9,11 @@
    Code implementing the 'AllocatorIntf' should normally follow the "C
    object oriented" design as outlined in the following tutorial:
    https://realtimelogic.com/ba/doc/?url=C/introduction.html#oo_c
-   However, we have simplified the following code since we do not need
-   any objects, except for the data contained in an instance of
-   AllocatorIntf. All functions below take AllocatorIntf, which should
-   normally be the super class, as the first argument.
+   Each allocator below extends AllocatorIntf with its buffer, and
+   the AllocatorIntf callbacks cast the super class to the allocator
+   type. The buffers are in the objects and not in static variables
+   since the multi-threaded event loop (MS_WORKERS) gives each thread
+   its own allocators.
 
    Why three allocators?
 
@@ -60,23 +61,16 @@ doNothingOnFree(AllocatorIntf* super, void* memblock)
  **************************| JParser Allocator |*****************************
  ****************************************************************************/
 
-/* No strings can be longer than this size. Try to keep JSON messages
- * including strings as short as possible, including the object member
- * names. The minimum size allocated by JParser is 256 bytes.
- */
-#define MAX_STRING_LEN 256
-
 /*
   Called when the one and only string buffer must grow.
 */
 static void*
-JParserAlloc_realloc(AllocatorIntf* o, void* memblock, size_t* size)
+JParserAlloc_realloc(AllocatorIntf* super, void* memblock, size_t* size)
 {
-   static U8 buf[MAX_STRING_LEN];
-   (void)o;
-   baAssert(memblock == 0 || memblock == buf);
+   JParserAlloc* o = (JParserAlloc*)super;
+   baAssert(memblock == 0 || memblock == o->buf);
    if(*size <= MAX_STRING_LEN)
-      return buf;
+      return o->buf;
    xprintf(("MAX_STRING_LEN too small\n"));
    return 0;
 }
@@ -88,10 +82,10 @@ JParserAlloc_malloc(AllocatorIntf* o, size_t* size)
 }
 
 void
-JParserAlloc_constructor(AllocatorIntf* o)
+JParserAlloc_constructor(JParserAlloc* o)
 {
    AllocatorIntf_constructor(
-      o, JParserAlloc_malloc,JParserAlloc_realloc,doNothingOnFree);
+      &o->super, JParserAlloc_malloc,JParserAlloc_realloc,doNothingOnFree);
 }
 
 
@@ -102,20 +96,13 @@ JParserAlloc_constructor(AllocatorIntf* o)
  The allocator used by JParserValFact when creating JVal nodes.
 */
 
-/* Maximum number of JVal nodes. Small microcontrollers should try to
-   keep JSON messages small.
-*/
-#define MAX_JVAL_NODES 15
-static U32 vAlloxIx;
-
 static void*
-vAlloc_malloc(AllocatorIntf* o, size_t* size)
+vAlloc_malloc(AllocatorIntf* super, size_t* size)
 {
-   static JVal buf[MAX_JVAL_NODES];
-   (void)o;
+   VAlloc* o = (VAlloc*)super;
    baAssert(*size == sizeof(JVal));
-   if(vAlloxIx < MAX_JVAL_NODES)
-      return buf+(vAlloxIx++);
+   if(o->ix < MAX_JVAL_NODES)
+      return o->buf+(o->ix++);
    xprintf(("MAX_JVAL_NODES too small\n"));
    return 0;
 }
@@ -126,11 +113,11 @@ vAlloc_malloc(AllocatorIntf* o, size_t* size)
    #define VAlloc_reset VAlloc_constructor
  */
 void
-VAlloc_constructor(AllocatorIntf* o)
+VAlloc_constructor(VAlloc* o)
 {
-   vAlloxIx=0;
+   o->ix=0;
    /* JParserValFact does not use realloc */
-   AllocatorIntf_constructor(o,vAlloc_malloc,0,doNothingOnFree);
+   AllocatorIntf_constructor(&o->super,vAlloc_malloc,0,doNothingOnFree);
 }
 
 
@@ -141,23 +128,14 @@ VAlloc_constructor(AllocatorIntf* o)
  strings, including object member names.
 */
 
-/* The maximum length of all strings combined. Small microcontrollers
-   should avoid using too many strings and object member names. You
-   will use less memory if you send JSON arrays instead of JSON
-   objects since objects include member names.
- */
-#define MAX_JSON_STRINGS_COMBINED 512
-static U32 dAlloxIx;
-
 static void*
-DAlloc_malloc(AllocatorIntf* o, size_t* size)
+DAlloc_malloc(AllocatorIntf* super, size_t* size)
 {
-   static char buf[MAX_JSON_STRINGS_COMBINED];
-   (void)o;
-   if((dAlloxIx + *size) < MAX_JSON_STRINGS_COMBINED)
+   DAlloc* o = (DAlloc*)super;
+   if((o->ix + *size) < MAX_JSON_STRINGS_COMBINED)
    {
-      char* mem = buf+dAlloxIx;
-      dAlloxIx += *size;
+      char* mem = o->buf+o->ix;
+      o->ix += *size;
       return mem;
    }
    xprintf(("MAX_JSON_STRINGS_COMBINED too small\n"));
@@ -169,9 +147,9 @@ DAlloc_malloc(AllocatorIntf* o, size_t* size)
    #define DAlloc_reset DAlloc_constructor
  */
 void
-DAlloc_constructor(AllocatorIntf* o)
+DAlloc_constructor(DAlloc* o)
 {
-   dAlloxIx=0;
+   o->ix=0;
    /* JParserValFact does not use realloc */
-   AllocatorIntf_constructor(o,DAlloc_malloc,0,doNothingOnFree);
+   AllocatorIntf_constructor(&o->super,DAlloc_malloc,0,doNothingOnFree);
 }
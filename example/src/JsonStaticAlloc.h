@@ -1,9 +1,65 @@
+#ifndef _JsonStaticAlloc_h
+#define _JsonStaticAlloc_h
+
 #include <AllocatorIntf.h>
+#include <JDecoder.h>
+
+/* No strings can be longer than this size. Try to keep JSON messages
+ * including strings as short as possible, including the object member
+ * names. The minimum size allocated by JParser is 256 bytes.
+ */
+#ifndef MAX_STRING_LEN
+#define MAX_STRING_LEN 256
+#endif
+
+/* Maximum number of JVal nodes. Small microcontrollers should try to
+   keep JSON messages small.
+*/
+#ifndef MAX_JVAL_NODES
+#define MAX_JVAL_NODES 15
+#endif
+
+/* The maximum length of all strings combined. Small microcontrollers
+   should avoid using too many strings and object member names. You
+   will use less memory if you send JSON arrays instead of JSON
+   objects since objects include member names.
+ */
+#ifndef MAX_JSON_STRINGS_COMBINED
+#define MAX_JSON_STRINGS_COMBINED 512
+#endif
+
+typedef struct {
+   AllocatorIntf super;
+   U8 buf[MAX_STRING_LEN];
+} JParserAlloc;
 
-void JParserAlloc_constructor(AllocatorIntf* o);
-void VAlloc_constructor(AllocatorIntf* o);
-void DAlloc_constructor(AllocatorIntf* o);
+typedef struct {
+   AllocatorIntf super;
+   U32 ix;
+   JVal buf[MAX_JVAL_NODES];
+} VAlloc;
+
+typedef struct {
+   AllocatorIntf super;
+   U32 ix;
+   char buf[MAX_JSON_STRINGS_COMBINED];
+} DAlloc;
+
+/* The three allocators used by one JParser and JParserValFact
+   pair. Each thread parsing JSON must have its own instance.
+*/
+typedef struct JsonStaticAlloc {
+   JParserAlloc jpa; /* JParser Alloc */
+   VAlloc va; /* JVal Node Allocator */
+   DAlloc da; /* JVal String Allocator */
+} JsonStaticAlloc;
+
+void JParserAlloc_constructor(JParserAlloc* o);
+void VAlloc_constructor(VAlloc* o);
+void DAlloc_constructor(DAlloc* o);
 
 #define JParserAlloc_reset JParserAlloc_constructor
 #define VAlloc_reset VAlloc_constructor
 #define DAlloc_reset DAlloc_constructor
+
+#endif
@@ -53,6 +53,17 @@
 #include "certificates/device_RSA_2048.h"
 #endif
 
+/* Multi-connection mode: serve many browsers concurrently using the
+   epoll based Minnow Server event loop. The event loop is enabled by
+   default on Linux. Define NO_MS_EVLOOP to use the one connection at a
+   time accept loop used on all other platforms.
+*/
+#if defined(__linux__) && !defined(NO_MS_EVLOOP)
+#define MS_EVLOOP
+#include <MSEvLoop.h>
+#include <MSRing.h>
+#endif
+
 
 /* IoT mode: include the optional SMQ client if 'USE_SMQ' is defined */
 #ifdef USE_SMQ
@@ -82,9 +93,9 @@
 #define USE_STATIC_ALLOC
 #ifdef USE_STATIC_ALLOC
 #include "JsonStaticAlloc.h"
-static AllocatorIntf jpa; /* JParser Alloc */
-static AllocatorIntf va; /* JVal Node Allocator */
-static AllocatorIntf da; /* JVal String Allocator */
+#else
+/* Not used by RecData_constructor when using dynamic allocation */
+typedef struct JsonStaticAlloc JsonStaticAlloc;
 #endif
 
 
@@ -94,6 +105,7 @@ static AllocatorIntf da; /* JVal String Allocator */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 /* Part of example code for managing LEDs.
    The header file can be found in the SMQ example.
@@ -124,7 +136,9 @@ static AllocatorIntf da; /* JVal String Allocator */
 
 /* We need a send and receive buffer for the Minnow Server (MS) when
    using the standard (non secure version). The SharkSSL send/receive
-   buffers are used in secure mode.
+   buffers are used in secure mode. The event loop uses msBuf for
+   the IoT (SMQ) connection only and the workers' buffers for the
+   WebSocket connections.
  */
 struct{
    U8 rec[1500];
@@ -132,10 +146,56 @@ struct{
 } msBuf;
 #endif
 
+#ifdef MS_EVLOOP
+/* Number of event loop threads (Ref-W) */
+#ifndef MS_WORKERS
+#define MS_WORKERS 1
+#endif
+#if MS_WORKERS > 1
+#include <pthread.h>
+#ifdef USE_SMQ
+#error IoT mode (USE_SMQ) requires MS_WORKERS=1
+#endif
+#endif
+/* Max number of concurrent HTTP and WebSocket connections per
+ * worker */
+#ifndef MAX_CONNECTIONS
+#define MAX_CONNECTIONS 64
+#endif
+/* Per connection transmit queue: a slow client does not block the
+ * others. The queue is not used in secure mode.
+ */
+#ifndef TXQ_SIZE
+#define TXQ_SIZE 4096
+#endif
+/* The per connection buffers in the slab. The SharkSSL buffers are
+ * used in secure mode.
+ */
+#ifdef MS_SEC
+#define CON_REC_SIZE 0
+#define CON_SEND_SIZE 0
+#else
+#define CON_REC_SIZE sizeof(msBuf.rec)
+#define CON_SEND_SIZE sizeof(msBuf.send)
+#endif
+#endif
+
 
  /* Fetch the SPA. See index.c for details. */
 extern int fetchPage(void* hndl, MST* mst, U8* path);
 
+/* Define MS_DOCROOT as a directory, such as "../../www", to serve the
+   files in the directory instead of the SPA in index.c. Edit the web
+   application without recompiling the server.
+*/
+#ifdef MS_DOCROOT
+#include <MSDocRoot.h>
+#define setFetchPage(wph, docRoot) \
+   (wph).fetchPage = msDocRootFetchPage, (wph).fetchPageHndl = docRoot
+#else
+#define setFetchPage(wph, docRoot) (wph).fetchPage = fetchPage
+#endif
+
 
 
 /****************************************************************************
@@ -391,19 +451,21 @@ typedef struct {
    JErr err;
    JEncoder encoder;
    BaBool committed; /* Send: If a complete JSON message assembled */
+   BaBool fragmented; /* WebSocket: If the first fragment was sent */
+   BaBool nonBlocking; /* WebSocket: Drop message if queue is full */
 } SendData;
 
 
-/* Send a complete JSON message over WebSockets.
+/* Send a JSON message over WebSockets.
 
    This is the BufPrint flush function that gets called when the
    BufPrint buffer is flushed, either when the buffer is full or when
-   actively flushed, however, this code is designed to only accept a
-   full JSON message, thus an indirect flush is not accepted. The flag
-   "committed" helps us check if we are performing an active flush in
-   SendData_commit. The buffer used by BufPrint is either the Minnow
-   Server buffer or the SMQ buffer. The buffer is too small if the
-   flush callback is called and if the flag "committed" is false.
+   actively flushed. The flag "committed" helps us check if we are
+   performing an active flush in SendData_commit. The buffer used by
+   BufPrint is the Minnow Server buffer. A JSON message larger than
+   the buffer is sent as a fragmented WebSocket message: the full
+   buffer is sent as a fragment each time the flush callback is called
+   and if the flag "committed" is false.
 
    The JEncoder object (used for encoding JSON) requires a BufPrint
    instance.
@@ -419,10 +481,23 @@ SendData_wsSendJSON(BufPrint* bp, int sizeRequired)
    /* From SendData_constructor >  BufPrint_setBuf */
    ms = (MS*)BufPrint_getUserData(bp);
    if( ! o->committed )
-   {
-      xprintf(("ERR: WebSocket send buffer too small\n"));
-      baAssert(0);/* This is a 'design' error */
-      return -1;
+   {  /* Buffer full: send a fragment. The buffer size is > 128 */
+      int size;
+      int rc = o->fragmented ?
+         MS_continue(ms, bp->cursor) :
+         MS_beginMessage(ms, WSOP_Text, bp->cursor);
+      o->fragmented=TRUE;
+      if(rc < 0)
+      {
+         xprintf(("WebSocket connection closed on send\n"));
+         return -1;
+      }
+      /* Prepare the frame header for the next fragment: SharkSSL
+         encrypts the send buffer in place (MS_SEC).
+      */
+      BufPrint_setBuf(bp, (char*)MS_prepSend(ms, TRUE, &size), size);
+      bp->cursor=0;
+      return 0;
    }
 
    /* Minnow Server (MS) in large mode. Pad with spaces if size less than
@@ -431,7 +506,9 @@ SendData_wsSendJSON(BufPrint* bp, int sizeRequired)
     */
    while(bp->cursor < 128)
       bp->buf[bp->cursor++] = ' '; /* cursor is current bufsize */
-   if(MS_sendText(ms, bp->cursor) < 0)
+   if((o->fragmented ? MS_endMessage(ms, bp->cursor) :
+       o->nonBlocking ? MS_sendNB(ms, WSOP_Text, bp->cursor) :
+       MS_sendText(ms, bp->cursor)) < 0)
    {
       xprintf(("WebSocket connection closed on send\n"));
       return -1;
@@ -482,6 +559,44 @@ SendData_smqSendJSON(BufPrint* bp, int sizeRequired)
 }
 #endif
 
+#ifdef MS_EVLOOP
+/* Similar to SendData_wsSendJSON, but sends the data to all
+   connections in an MSGroup (Ref-bc). The JSON message is encoded
+   once, and the frame is sent to all members by MS_broadcast.
+ */
+static int
+SendData_bcSendJSON(BufPrint* bp, int sizeRequired)
+{
+   SendData* o = (SendData*)bp; /* (Ref-bp) */
+   (void)sizeRequired; /* not used */
+   if( ! o->committed )
+   {
+      xprintf(("Broadcast buffer too small\n"));
+      baAssert(0);/* This is a 'design' error */
+      return -1;
+   }
+   /* From SendData_bcConstructor >  BufPrint_constructor */
+   MS_broadcast((MSGroup*)BufPrint_getUserData(bp), WSOP_Text,
+                bp->buf, bp->cursor);
+   return 0;
+}
+
+/* Construct a SendData object for sending a JSON message to all
+   connections in 'group'. The message is encoded in 'buf'.
+*/
+static void
+SendData_bcConstructor(SendData* o, MSGroup* group, char* buf, int size)
+{
+   BufPrint_constructor(&o->super, group, SendData_bcSendJSON);
+   BufPrint_setBuf(&o->super, buf, size);
+   JErr_constructor(&o->err);
+   JEncoder_constructor(&o->encoder, &o->err, &o->super);
+   o->committed=FALSE;
+   o->fragmented=FALSE;
+   o->nonBlocking=TRUE;
+}
+#endif
+
 /* Construct the SendData container object used for sending formatted JSON.
    We use a BufPrint instance as the output buffer for JEncoder (Ref-bp).
    https://realtimelogic.com/ba/doc/en/C/reference/html/structBufPrint.html
@@ -519,6 +634,8 @@ SendData_constructor(SendData* o, ConnData* cd)
    JErr_constructor(&o->err);
    JEncoder_constructor(&o->encoder, &o->err, &o->super);
    o->committed=FALSE;
+   o->fragmented=FALSE;
+   o->nonBlocking=FALSE;
 }
 
 /* Called when we are done creating a JSON message.
@@ -631,18 +748,36 @@ manageSetLED(ConnData* cd, JErr* e, JVal* v)
 
 /* 
    ["settemp", number]
+   The message is dropped if the connection's transmit queue is full
+   since the next reading replaces it.
  */
 static int
 sendSetTemp(ConnData* cd, int temp)
 {
    SendData sd;
    SendData_constructor(&sd, cd);
+   sd.nonBlocking=TRUE;
    beginMessage(&sd, "settemp");
    JEncoder_setInt(&sd.encoder, temp);
    return endMessage(&sd);
 }
 
 
+#ifdef MS_EVLOOP
+/* Send settemp to all connections in 'group' (Ref-bc) */
+static int
+broadcastSetTemp(MSGroup* group, int temp)
+{
+   SendData sd;
+   char buf[256];
+   SendData_bcConstructor(&sd, group, buf, sizeof(buf));
+   beginMessage(&sd, "settemp");
+   JEncoder_setInt(&sd.encoder, temp);
+   return endMessage(&sd);
+}
+#endif
+
+
 /*
   ["devname", ["the-name"]
  */
@@ -675,6 +810,7 @@ sendUploadAck(ConnData* cd, S32 messages)
 /* The idle function, which simulates events in the system, is called
  * when not receiving data.
  */
+#if !defined(MS_EVLOOP) || defined(USE_SMQ)
 static int
 eventSimulator(ConnData* cd)
 {
@@ -689,6 +825,7 @@ eventSimulator(ConnData* cd)
    x = getTemp();
    return x != temperature ? temperature=x,sendSetTemp(cd, x) : 0;
 }
+#endif
 
 /****************************  Application: AJAX *****************************/
 
@@ -843,6 +980,9 @@ typedef struct {
       logic for preventing relay attacks */
    U8 nonce[12];
    U8 binMsg; /* Holds the binary message type 'BinMsg' (enum BinMsg) */
+#ifdef USE_STATIC_ALLOC
+   JsonStaticAlloc* alloc; /* Reset for each JSON message */
+#endif
 } RecData;
 
 
@@ -850,26 +990,30 @@ typedef struct {
   Construct the RecData object used when receiving JSON messages and
   sending response data.
 
-  Notice how we use the static allocators if USE_STATIC_ALLOC is
-  set. See JsonStaticAlloc.c for details.
+  Notice how we use the static allocators in 'alloc' if
+  USE_STATIC_ALLOC is set. See JsonStaticAlloc.c for details. The
+  RecData objects using the same allocators must be used by one
+  thread.
 
   https://realtimelogic.com/ba/doc/en/C/reference/html/structJParserValFact.html
   https://realtimelogic.com/ba/doc/en/C/reference/html/structJParser.html
  */
 static void
-RecData_constructor(RecData* o)
+RecData_constructor(RecData* o, JsonStaticAlloc* alloc)
 {
    memset(o, 0, sizeof(RecData));
 #ifdef USE_STATIC_ALLOC
    {
-      JParserAlloc_constructor(&jpa);
-      VAlloc_constructor(&va);
-      DAlloc_constructor(&da);
-      JParserValFact_constructor(&o->pv, &va, &da);
+      o->alloc=alloc;
+      JParserAlloc_constructor(&alloc->jpa);
+      VAlloc_constructor(&alloc->va);
+      DAlloc_constructor(&alloc->da);
+      JParserValFact_constructor(&o->pv, &alloc->va.super, &alloc->da.super);
       JParser_constructor(&o->parser, (JParserIntf*)&o->pv, o->maxMembN,
-                          sizeof(o->maxMembN), &jpa,0);
+                          sizeof(o->maxMembN), &alloc->jpa.super,0);
    }
 #else
+   (void)alloc;
    /* Use dynamic allocation */
    JParserValFact_constructor(&o->pv, AllocatorIntf_getDefault(),
                               AllocatorIntf_getDefault());
@@ -878,8 +1022,11 @@ RecData_constructor(RecData* o)
 #endif
 }
 
-#if 0
-/* Not used since we keep RecData as long as program runs */
+#ifdef MS_EVLOOP
+/* Only used in multi-connection mode, where one RecData object is
+   constructed for each WebSocket connection. The single connection
+   mode keeps RecData as long as the program runs.
+*/
 static void
 RecData_destructor(RecData* o)
 {
@@ -1110,9 +1257,9 @@ RecData_parse(RecData* o,ConnData* cd,U8* data,int len,BaBool eom)
    /* For each new JSON message received, reset the internal static buffer
     * index pointer for the basic allocators.
     */
-   JParserAlloc_reset(&jpa);
-   VAlloc_reset(&va);
-   DAlloc_reset(&da);
+   JParserAlloc_reset(&o->alloc->jpa);
+   VAlloc_reset(&o->alloc->va);
+   DAlloc_reset(&o->alloc->da);
 #endif
    status = JParser_parse(&o->parser, data, len);
    if(status)
@@ -1133,6 +1280,26 @@ RecData_parse(RecData* o,ConnData* cd,U8* data,int len,BaBool eom)
 }
 
 
+/*
+  Manage the WebSocket frame data 'msg' with 'len' bytes returned by
+  MS_read. Text frames contain JSON and binary frames contain
+  firmware upload data.
+*/
+static int
+RecData_manageWsFrame(RecData* rd, ConnData* cd, U8* msg, int len)
+{
+   MS* ms=cd->u.ms;
+   BaBool eom = (ms->rs.msgState & WSMSG_END) ? TRUE : FALSE;
+   if(ms->rs.opCode == WSOP_Text)
+   {  /* All text frames should contain JSON */
+      return RecData_parse(rd,cd,msg,len,eom);
+   }
+   /* Manage binary WebSocket frames */
+   return RecData_manageBinFrame(rd,cd,msg,len,eom);
+}
+
+
+#ifndef MS_EVLOOP
 /*
   This function gets called when the Minnow Server's listen socket is
   activated i.e. when socket 'accept' returns a new socket.
@@ -1155,22 +1322,8 @@ RecData_runServer(RecData* rd, ConnData* cd, WssProtocolHandshake* wph)
       {
          if(rc) /* incomming data from browser */
          {
-            if(ms->rs.frameHeader[0] == WSOP_Text)
-            {  /* All text frames should contain JSON */
-               if(RecData_parse(
-                     rd,cd,msg,rc,ms->rs.frameLen-ms->rs.bytesRead==0))
-               {
-                  break; /* err */
-               }
-            }
-            else /* Manage binary WebSocket frames */
-            {
-               if(RecData_manageBinFrame(
-                     rd,cd,msg,rc,ms->rs.frameLen-ms->rs.bytesRead==0))
-               {
-                  break; /* err */
-               }
-            }
+            if(RecData_manageWsFrame(rd,cd,msg,rc))
+               break; /* err */
          }
          else /* timeout (Ref-D) */
          {
@@ -1183,6 +1336,408 @@ RecData_runServer(RecData* rd, ConnData* cd, WssProtocolHandshake* wph)
    }
 }
 
+#else /* MS_EVLOOP */
+
+/*
+  Multi-connection mode: the application state for one WebSocket
+  connection. Element N in Worker:appCons belongs to connection N in
+  Worker:slab (Ref-Ix).
+*/
+typedef struct {
+   ConnData cd;
+   RecData rd;
+   BaBool tempPending; /* settemp dropped: transmit queue full */
+   BaBool subscribed; /* In tempGroup */
+   BaBool bcFailed; /* MS_broadcast could not send settemp */
+} AppCon;
+
+/* The device events are queued in a ring buffer for each worker when
+ * the device code pushes the events or when the device is polled by
+ * one worker on behalf of the others.
+ */
+#if defined(DEVICE_PUSH) || MS_WORKERS > 1
+#define DEVICE_RING
+#endif
+
+#ifdef DEVICE_RING
+/* An event pushed by the device code */
+typedef struct {
+   U16 type; /* DEVEV_LED or DEVEV_TEMP */
+   U16 id; /* LED ID */
+   int value; /* LED on/off or temperature */
+} DeviceEvent;
+
+#define DEVEV_LED 1
+#define DEVEV_TEMP 2
+
+#ifndef DEVICE_RING_SIZE
+#define DEVICE_RING_SIZE 256 /* Must be a power of two */
+#endif
+#endif
+
+#ifndef DEVICE_PUSH
+/* The simulated host device does not push events and is instead
+ * polled every DEVICE_POLL_TMO milliseconds while tempGroup has
+ * members. The event loop sleeps when no browser is connected. When
+ * using more than one worker, the first worker polls the device all
+ * the time and pushes the events to all workers.
+ */
+#ifndef DEVICE_POLL_TMO
+#define DEVICE_POLL_TMO 50
+#endif
+#endif
+
+/*
+  One event loop thread (Ref-W). The MS_WORKERS workers share the
+  server port using one listen socket each (MSEvLoop_bind), and the
+  kernel distributes the connections among the workers. A worker owns
+  its connections, buffers, JSON allocators, and SharkSsl object. The
+  only data shared with other threads are the ring buffers, where the
+  device code is the producer and the worker the consumer.
+*/
+typedef struct {
+   MSEvLoop loop; /* First member: see Worker_get */
+   /* The MSCon objects and their receive and send buffers */
+   MSEVLOOP_SLAB(slab, MAX_CONNECTIONS, CON_REC_SIZE, CON_SEND_SIZE);
+   AppCon appCons[MAX_CONNECTIONS];
+#ifdef MS_SEC
+   SharkSsl sharkSslServer;
+#else
+   U8 txqBuf[MAX_CONNECTIONS][TXQ_SIZE];
+#endif
+   /* The authenticated connections receiving settemp (Ref-bc) */
+   MSGroup tempGroup;
+   MS* tempGroupList[MAX_CONNECTIONS];
+   int lastTemp; /* The last temperature sent to the browsers */
+#ifdef USE_STATIC_ALLOC
+   JsonStaticAlloc jsonAlloc;
+#endif
+#ifdef MS_DOCROOT
+   MSDocFile docFiles[32];
+   MSDocRoot docRoot;
+#endif
+#ifdef DEVICE_RING
+   DeviceEvent ringBuf[DEVICE_RING_SIZE];
+   MSRing ring;
+#endif
+#ifndef DEVICE_PUSH
+   MSTimer deviceTimer;
+#endif
+   SOCKET listenSock;
+#if MS_WORKERS > 1
+   pthread_t thread;
+#endif
+} Worker;
+
+static Worker workers[MS_WORKERS];
+
+#define Worker_get(loop) ((Worker*)(loop))
+#ifdef MS_SEC
+#define Worker_txqSize 0
+#else
+#define Worker_txqSize TXQ_SIZE
+#endif
+#ifdef USE_STATIC_ALLOC
+#define Worker_getJsonAlloc(o) (&(o)->jsonAlloc)
+#else
+#define Worker_getJsonAlloc(o) 0
+#endif
+
+#ifdef DEVICE_RING
+static int deviceWorkers; /* Set by mainTask */
+
+static void
+devicePush(DeviceEvent* ev)
+{
+   int i;
+   for(i=0 ; i < deviceWorkers ; i++)
+   {
+      /* The event is dropped if the ring is full */
+      if(MSRing_push(&workers[i].ring, ev))
+         MSEvLoop_notify(&workers[i].loop, 1);
+   }
+}
+
+/* Device push: the device driver, the sensor sampling thread, or the
+ * deferred part of an interrupt handler calls these functions when an
+ * LED changes state or a temperature is sampled. The events are
+ * queued in each worker's lock-free ring and the event loops wake up
+ * at once and send setled and settemp to the browsers. The rings
+ * support one producer thread. Define DEVICE_PUSH when the device
+ * code calls these functions.
+ */
+void
+deviceLedEvent(int ledId, int on)
+{
+   DeviceEvent ev;
+   ev.type=DEVEV_LED;
+   ev.id=(U16)ledId;
+   ev.value=on;
+   devicePush(&ev);
+}
+
+void
+deviceTempEvent(int temp)
+{
+   DeviceEvent ev;
+   ev.type=DEVEV_TEMP;
+   ev.id=0;
+   ev.value=temp;
+   devicePush(&ev);
+}
+#endif
+
+/* Find the AppCon for an MSCon (Ref-Ix) */
+#define AppCon_get(loop, con) \
+   (Worker_get(loop)->appCons + MSEvLoop_conIndex(loop, con))
+
+
+/* MSEvLoop callback: called when HTTP(S) was upgraded to a WebSocket
+   connection. Same as the initial part of RecData_runServer.
+*/
+static int
+AppCon_open(MSEvLoop* loop, MSCon* con)
+{
+   AppCon* o = AppCon_get(loop, con);
+   RecData_constructor(&o->rd, Worker_getJsonAlloc(Worker_get(loop)));
+   ConnData_setWS(&o->cd, &con->ms);
+   o->tempPending=FALSE;
+   o->subscribed=FALSE;
+   o->bcFailed=FALSE;
+   /* We send the nonce to the browser so the user can
+    * safely authenticate.
+    */
+   return sendDeviceName(&o->cd) || RecData_sendNonce(&o->rd, &o->cd);
+}
+
+
+/* MSEvLoop callback: incomming data from browser */
+static int
+AppCon_data(MSEvLoop* loop, MSCon* con, U8* msg, int len)
+{
+   AppCon* o = AppCon_get(loop, con);
+   if(len && RecData_manageWsFrame(&o->rd, &o->cd, msg, len))
+      return -1;
+   if(o->rd.authenticated && !o->subscribed)
+   {
+      Worker* w = Worker_get(loop);
+      MSGroup_add(&w->tempGroup, &con->ms);
+      o->subscribed=TRUE;
+#if !defined(DEVICE_PUSH) && MS_WORKERS == 1
+      if(!MSTimer_isActive(&w->deviceTimer))
+         MSEvLoop_startTimer(loop, &w->deviceTimer, DEVICE_POLL_TMO);
+#endif
+   }
+   return 0;
+}
+
+
+/* MSEvLoop callback: WebSocket connection closing */
+static void
+AppCon_close(MSEvLoop* loop, MSCon* con, int status)
+{
+   AppCon* o = AppCon_get(loop, con);
+   if(o->subscribed)
+   {
+      MSGroup_remove(&Worker_get(loop)->tempGroup, &con->ms);
+      o->subscribed=FALSE;
+   }
+   RecData_destructor(&o->rd);
+   o->rd.authenticated=FALSE;
+   xprintf(("Closing WS connection: ecode = %d\n",status));
+}
+
+
+/* MSEvLoop callback: the transmit queue drained after a settemp
+   message was dropped. Send the latest reading.
+*/
+static void
+AppCon_writable(MSEvLoop* loop, MSCon* con)
+{
+   AppCon* o = AppCon_get(loop, con);
+   if(o->tempPending && o->rd.authenticated)
+   {
+      o->tempPending=FALSE;
+      if(sendSetTemp(&o->cd, Worker_get(loop)->lastTemp))
+         MSEvLoop_close(loop, con, 0);
+   }
+}
+
+
+/* MSGroup callback: MS_broadcast could not send settemp to 'ms'. The
+   connection is closed by AppCon_deviceEvent when the broadcast
+   returns, since the group cannot change during the broadcast.
+*/
+static void
+AppCon_broadcastError(MSGroup* group, MS* ms, int status)
+{
+   MSEvLoop* loop = (MSEvLoop*)group->onErrorArg;
+   MSCon* con = (MSCon*)((U8*)ms - offsetof(MSCon, ms));
+   (void)status;
+   AppCon_get(loop, con)->bcFailed=TRUE;
+}
+
+
+/* Send a device event to all authenticated connections in the
+   worker. The settemp message is encoded once and broadcasted.
+*/
+static void
+AppCon_deviceEvent(MSEvLoop* loop, int ledEvent, int ledId, int on, int temp)
+{
+   int i;
+   Worker* w = Worker_get(loop);
+   if(!ledEvent && temp == w->lastTemp)
+      return;
+   if(temp != w->lastTemp)
+      broadcastSetTemp(&w->tempGroup, temp);
+   for(i = 0 ; i < MAX_CONNECTIONS ; i++)
+   {
+      AppCon* o = w->appCons+i;
+      MSCon* con;
+      if(!o->subscribed)
+         continue;
+      con = MSEvLoop_getCon(loop, i);
+      if(o->bcFailed || (ledEvent && sendSetLED(&o->cd, ledId, on)))
+         MSEvLoop_close(loop, con, 0); /* on sock error */
+      else if(MSTxQ_isBlocked(&con->txq))
+         o->tempPending=TRUE; /* Send when writable */
+   }
+   w->lastTemp=temp;
+}
+
+
+#ifdef DEVICE_RING
+/* MSEvLoop callback: drain the events pushed by the device code. Only
+   the latest temperature in the batch is sent.
+*/
+static void
+AppCon_deviceNotify(MSEvLoop* loop, U32 events)
+{
+   DeviceEvent ev[32];
+   U32 i,n;
+   Worker* w = Worker_get(loop);
+   int temp=w->lastTemp;
+   (void)events;
+   while( (n=MSRing_pop(&w->ring, ev, 32)) != 0 )
+   {
+      for(i=0 ; i < n ; i++)
+      {
+         if(ev[i].type == DEVEV_LED)
+            AppCon_deviceEvent(loop, TRUE, ev[i].id, ev[i].value, w->lastTemp);
+         else
+            temp=ev[i].value;
+      }
+   }
+   AppCon_deviceEvent(loop, FALSE, 0, 0, temp);
+}
+#endif
+
+#ifndef DEVICE_PUSH
+/* Multi-connection version of eventSimulator: poll the simulated
+   device once.
+*/
+static void
+AppCon_eventSimulator(MSEvLoop* loop)
+{
+   int ledId, on;
+   int ledEvent = setLedFromDevice(&ledId,&on);
+#if MS_WORKERS > 1
+   /* Only the first worker polls */
+   static int temperature=0;
+   int temp = getTemp();
+   (void)loop;
+   if(ledEvent)
+      deviceLedEvent(ledId, on);
+   if(temp != temperature)
+   {
+      deviceTempEvent(temp);
+      temperature=temp;
+   }
+#else
+   AppCon_deviceEvent(loop, ledEvent, ledId, on, getTemp());
+#endif
+}
+
+/* MSTimer callback for deviceTimer */
+static void
+AppCon_deviceTimeout(MSEvLoop* loop, MSTimer* t)
+{
+   AppCon_eventSimulator(loop);
+   if(MS_WORKERS > 1 || MSGroup_getLen(&Worker_get(loop)->tempGroup))
+      MSEvLoop_startTimer(loop, t, DEVICE_POLL_TMO);
+}
+#endif
+
+
+/* Create the worker's event loop. The listen socket must be open. */
+static int
+Worker_constructor(Worker* o)
+{
+   MSEvLoop* loop = &o->loop;
+   if(MSEvLoop_constructor(loop, &o->listenSock, o->slab, MAX_CONNECTIONS,
+                           CON_REC_SIZE, CON_SEND_SIZE))
+      return -1;
+#ifdef MS_SEC
+   SharkSsl_constructor(&o->sharkSslServer,
+                        SharkSsl_Server,
+                        1,   /* SSL cache size */
+                        2000,  /* inBuf size */
+                        3000); /*outBuf size is fixed and must fit server cert*/
+   /* At least one server certificate is required */
+   SharkSsl_addCertificate(&o->sharkSslServer, sharkSSL_RTL_device);
+   MSEvLoop_setSharkSsl(loop, &o->sharkSslServer);
+#else
+   MSEvLoop_setTxQueue(loop, (U8*)o->txqBuf, TXQ_SIZE,
+                       TXQ_SIZE*3/4, TXQ_SIZE/4);
+#endif
+#ifdef MS_DOCROOT
+   MSDocRoot_constructor(&o->docRoot, MS_DOCROOT, o->docFiles, 32);
+   /* The file is sent using blocking calls: limit the loop's stall */
+   o->docRoot.maxSize = 256*1024;
+#endif
+   setFetchPage(loop->wph, &o->docRoot);
+   loop->wph.keepAliveTmo = 5; /* HTTP keep-alive idle timeout (seconds) */
+#ifdef MS_DEFLATE
+   loop->wph.deflateWindowBits = 15; /* Enable permessage-deflate */
+#endif
+   loop->onOpen = AppCon_open;
+   loop->onData = AppCon_data;
+   loop->onClose = AppCon_close;
+   loop->onWritable = AppCon_writable;
+   loop->pingInterval = 30; /* Seconds */
+   MSGroup_constructor(&o->tempGroup, o->tempGroupList, MAX_CONNECTIONS);
+   o->tempGroup.onError = AppCon_broadcastError;
+   o->tempGroup.onErrorArg = loop;
+#ifdef DEVICE_RING
+   MSRing_constructor(&o->ring, o->ringBuf, sizeof(DeviceEvent),
+                      DEVICE_RING_SIZE);
+   loop->onNotify = AppCon_deviceNotify;
+#endif
+#ifndef DEVICE_PUSH
+   MSTimer_constructor(&o->deviceTimer, AppCon_deviceTimeout);
+#endif
+   return 0;
+}
+
+
+#if MS_WORKERS > 1
+/* The thread running worker 2 to MS_WORKERS. The first worker runs in
+ * mainTask.
+ */
+static void*
+Worker_thread(void* arg)
+{
+   Worker* o = (Worker*)arg;
+   while(MSEvLoop_run(&o->loop, INFINITE_TMO) >= 0)
+      ;
+   /* 'accept' failed: the other workers continue */
+   MSEvLoop_destructor(&o->loop);
+   se_close(&o->listenSock);
+   return 0;
+}
+#endif
+#endif /* MS_EVLOOP */
+
 
 /* Called when in IoT mode and after an IoT connection has been established */
 #ifdef USE_SMQ
@@ -1332,6 +1887,38 @@ revert2WsCon(SharkSsl* sharkSsl, RecData* rd, ConnData* cd, MS* ms)
    rd->authenticated=FALSE;
 }
 
+
+#ifdef MS_EVLOOP
+/* Activate and run the IoT connection when the Minnow Server has been
+ * inactive for SMQ_IDLE_TMO milliseconds. The SMQ socket is not
+ * managed by the event loop and is polled by the timer.
+ */
+#define SMQ_IDLE_TMO 3000
+#define SMQ_POLL_TMO 50
+
+typedef struct {
+   MSTimer timer; /* First member: see SmqTimer_timeout */
+   SharkSsl* sharkSsl;
+   RecData* rd;
+   ConnData* cd;
+} SmqTimer;
+
+static void
+SmqTimer_timeout(MSEvLoop* loop, MSTimer* t)
+{
+   SmqTimer* o = (SmqTimer*)t;
+   if( (ConnData_WebSocketMode(o->cd) &&
+        RecData_connectSMQ(o->rd,o->cd,o->sharkSsl)) ||
+       RecData_runSMQ(o->rd, o->cd))
+   { /* If we cannot connect or SMQ connection goes down */
+      revert2WsCon(o->sharkSsl,o->rd,o->cd,0);
+      MSEvLoop_startTimer(loop, t, SMQ_IDLE_TMO);
+   }
+   else
+      MSEvLoop_startTimer(loop, t, SMQ_POLL_TMO);
+}
+#endif
+
 #else /* if SMQ */
 #define revert2WsCon(sharkSsl, rd, cd, ms) /* Do nothing */
 #endif
@@ -1342,12 +1929,19 @@ revert2WsCon(SharkSsl* sharkSsl, RecData* rd, ConnData* cd, MS* ms)
 #define ALTERNATIVE_PORTNO 8079
 #endif
 
+/* The workers share the port (Ref-W) */
+#if defined(MS_EVLOOP) && MS_WORKERS > 1
+#define bindServerSock MSEvLoop_bind
+#else
+#define bindServerSock se_bind
+#endif
+
 /* Attempt to open the default server listening port 80 (secure mode
  * 443) or use an alternative port number if the default port is in
- * use.
+ * use. The port number is returned in 'portPtr'.
  */
 static int
-openServerSock(SOCKET* sock)
+openServerSock(SOCKET* sock, U16* portPtr)
 {
    int status;
    U16 port;
@@ -1356,17 +1950,18 @@ openServerSock(SOCKET* sock)
 #else
    port=80;
 #endif
-   status = se_bind(sock, port);
+   status = bindServerSock(sock, port);
    if(status)
    {
       port= ALTERNATIVE_PORTNO;
       while(status == -3 && ++port < (ALTERNATIVE_PORTNO+10))
-         status = se_bind(sock, port);
+         status = bindServerSock(sock, port);
    }
    if(!status)
    {
       xprintf(("WebSocket server listening on %d\n", (int)port));
    }
+   *portPtr=port;
    return status;
 }
 
@@ -1382,7 +1977,7 @@ openServerSock(SOCKET* sock)
 void
 mainTask(SeCtx* ctx)
 {
-#ifdef MS_SEC
+#if defined(MS_SEC) && !defined(MS_EVLOOP)
    static SharkSsl sharkSslServer; /* For the Minnow Server when in TLS mode */
 #endif
 #ifdef USE_SMQ
@@ -1393,33 +1988,111 @@ mainTask(SeCtx* ctx)
     */
    static SharkSsl sharkSslClient;
 #endif
+#ifdef MS_EVLOOP
+   /* The WebSocket connections are in the workers; cd and rd are
+    * used by the IoT (SMQ) connection only. The first worker runs in
+    * this thread.
+    */
+   MSEvLoop* loop = &workers[0].loop;
+   SOCKET* listenSockPtr = &workers[0].listenSock;
+   int i;
+#else
    static WssProtocolHandshake wph={0};
+   static MS ms; /* The Minnow Server */
+   static SOCKET sock;
+   SOCKET* sockPtr = &sock;
+   static SOCKET listenSock;
+   SOCKET* listenSockPtr = &listenSock;
+#ifdef MS_DOCROOT
+   static MSDocFile docFiles[32];
+   static MSDocRoot docRoot;
+#endif
+#endif
    static ConnData cd;
    static RecData rd;
-   static MS ms; /* The Minnow Server */
+#ifdef USE_STATIC_ALLOC
+   static JsonStaticAlloc jsonAlloc;
+#endif
 #ifdef USE_SMQ
+#ifdef MS_EVLOOP
+   static SmqTimer smqTimer;
+#else
    static int timeoutCounter=0;
 #endif
-   static SOCKET listenSock;
-   static SOCKET sock;
-   SOCKET* listenSockPtr = &listenSock;
-   SOCKET* sockPtr = &sock;
+#endif
+   U16 port;
 
    (void)ctx; /* Not used */
 
-   RecData_constructor(&rd);
+#ifdef USE_STATIC_ALLOC
+   RecData_constructor(&rd, &jsonAlloc);
+#else
+   RecData_constructor(&rd, 0);
+#endif
+#ifdef MS_DOCROOT
+   xprintf(("Serving the files in %s\n", MS_DOCROOT));
+#endif
+#ifdef MS_EVLOOP
+   ConnData_setWS(&cd, 0); /* Set default setup: SMQ not active */
+#else
    ConnData_setWS(&cd, &ms); /* Set default setup */
    MS_constructor(&ms);
+   SOCKET_constructor(sockPtr, ctx);
+#ifdef MS_DOCROOT
+   MSDocRoot_constructor(&docRoot, MS_DOCROOT, docFiles, 32);
+#endif
+   setFetchPage(wph, &docRoot);
+   /* wph.keepAliveTmo is not set: this mode serves one connection at a
+      time and an idle persistent connection would delay the browser's
+      other connections, such as the WebSocket connection.
+   */
+#ifdef MS_DEFLATE
+   wph.deflateWindowBits = 15; /* Enable permessage-deflate */
+#endif
+#endif
 
    SOCKET_constructor(listenSockPtr, ctx);
-   SOCKET_constructor(sockPtr, ctx);
 
-   wph.fetchPage = fetchPage;
-   if(openServerSock(listenSockPtr))
+   if(openServerSock(listenSockPtr, &port))
    {
       return;
    }
 
+#ifdef MS_EVLOOP
+   for(i=0 ; i < MS_WORKERS ; i++)
+   {
+      Worker* w = workers+i;
+      if(i) /* The first listen socket is open */
+      {
+         SOCKET_constructor(&w->listenSock, ctx);
+         if(bindServerSock(&w->listenSock, port))
+         {
+            xprintf(("Cannot open the listen socket for worker %d\n", i));
+            return;
+         }
+      }
+      if(Worker_constructor(w))
+      {
+         xprintf(("Cannot create the event loop\n"));
+         se_close(&w->listenSock);
+         return;
+      }
+   }
+#ifdef DEVICE_RING
+   deviceWorkers = MS_WORKERS;
+#endif
+   /* All connection memory is preallocated */
+   xprintf(("Memory per connection: %d bytes "
+            "(MSCon %d, buffers %d, transmit queue %d, AppCon %d)\n",
+            (int)(MSEvLoop_slotSize(CON_REC_SIZE, CON_SEND_SIZE) +
+                  Worker_txqSize + sizeof(AppCon)),
+            (int)MSEVLOOP_ALIGN(sizeof(MSCon)),
+            (int)MSEVLOOP_ALIGN(CON_REC_SIZE+CON_SEND_SIZE),
+            (int)Worker_txqSize, (int)sizeof(AppCon)));
+   xprintf(("Memory per worker: %d bytes for %d connections\n",
+            (int)sizeof(Worker), MAX_CONNECTIONS));
+#endif
+
 #ifdef MS_SEC
 #ifdef USE_SMQ
    SharkSsl_constructor(&sharkSslClient,
@@ -1432,6 +2105,12 @@ mainTask(SeCtx* ctx)
    */
    SharkSsl_setCAList(&sharkSslClient, sharkSslCAList);
 #endif
+#ifdef MS_EVLOOP
+   /* The workers' SharkSsl objects are created by Worker_constructor.
+      It is very important to seed the SharkSSL RNG generator.
+   */
+   sharkssl_entropy(baGetUnixTime() ^ (ptrdiff_t)workers);
+#else
    SharkSsl_constructor(&sharkSslServer,
                         SharkSsl_Server,
                         1,   /* SSL cache size */
@@ -1444,7 +2123,57 @@ mainTask(SeCtx* ctx)
    /* It is very important to seed the SharkSSL RNG generator */
    sharkssl_entropy(baGetUnixTime() ^ (ptrdiff_t)&sharkSslServer);
 #endif
+#endif
 
+#ifdef MS_EVLOOP
+#if MS_WORKERS > 1
+   for(i=1 ; i < MS_WORKERS ; i++)
+   {
+      if(pthread_create(&workers[i].thread, 0, Worker_thread, workers+i))
+      {
+         xprintf(("Cannot create the thread for worker %d\n", i));
+         MSEvLoop_destructor(&workers[i].loop);
+         se_close(&workers[i].listenSock);
+      }
+   }
+   xprintf(("Running %d workers\n", MS_WORKERS));
+#ifndef DEVICE_PUSH
+   MSEvLoop_startTimer(loop, &workers[0].deviceTimer, DEVICE_POLL_TMO);
+#endif
+#endif
+#ifdef USE_SMQ
+   MSTimer_constructor(&smqTimer.timer, SmqTimer_timeout);
+   smqTimer.sharkSsl=&sharkSslClient;
+   smqTimer.rd=&rd;
+   smqTimer.cd=&cd;
+   MSEvLoop_startTimer(loop, &smqTimer.timer, SMQ_IDLE_TMO);
+#endif
+   for(;;)
+   {
+      /* Sleep until a socket event or the next timer deadline */
+      int accepted = MSEvLoop_run(loop, INFINITE_TMO);
+      if(accepted < 0)
+      {
+         /* We get here if 'accept' fails.
+            This is probably where you reboot.
+         */
+         MSEvLoop_destructor(loop);
+         se_close(listenSockPtr);
+         return; /* Must do system reboot */
+      }
+#ifdef USE_SMQ
+      if(accepted || MSEvLoop_getConCount(loop))
+      {
+         /* If SMQ connection active: terminate immediately. */
+         if( ! ConnData_WebSocketMode(&cd) )
+            revert2WsCon(&sharkSslClient,&rd,&cd,0);
+         MSEvLoop_stopTimer(loop, &smqTimer.timer);
+      }
+      else if( ! MSTimer_isActive(&smqTimer.timer) )
+         MSEvLoop_startTimer(loop, &smqTimer.timer, SMQ_IDLE_TMO);
+#endif
+   }
+#else /* MS_EVLOOP */
    for(;;)
    {
       switch(se_accept(&listenSockPtr, 50, &sockPtr))
@@ -1470,6 +2199,7 @@ mainTask(SeCtx* ctx)
             RecData_runServer(&rd, &cd, &wph);
 #endif
             se_close(sockPtr);
+            MS_destructor(&ms);
 #ifdef USE_SMQ
             timeoutCounter=0;
 #endif
@@ -1502,4 +2232,5 @@ mainTask(SeCtx* ctx)
             return; /* Must do system reboot */
       }
    }
+#endif /* MS_EVLOOP */
 }
@@ -0,0 +1,233 @@
+/*
+ *     ____             _________                __                _
+ *    / __ \___  ____ _/ /_  __(_)___ ___  ___  / /   ____  ____ _(_)____
+ *   / /_/ / _ \/ __ `/ / / / / / __ `__ \/ _ \/ /   / __ \/ __ `/ / ___/
+ *  / _, _/  __/ /_/ / / / / / / / / / / /  __/ /___/ /_/ / /_/ / / /__
+ * /_/ |_|\___/\__,_/_/ /_/ /_/_/ /_/ /_/\___/_____/\____/\__, /_/\___/
+ *                                                       /____/
+ *
+ *                 SharkSSL Embedded SSL/TLS Stack
+ ****************************************************************************
+ *   PROGRAM MODULE
+ *
+ *   $Id$
+ *
+ *   COPYRIGHT:  Real Time Logic LLC, 2013 - 2020
+ *
+ *   This software is copyrighted by and is the sole property of Real
+ *   Time Logic LLC.  All rights, title, ownership, or other interests in
+ *   the software remain the property of Real Time Logic LLC.  This
+ *   software may only be used in accordance with the terms and
+ *   conditions stipulated in the corresponding license agreement under
+ *   which the software has been supplied.  Any unauthorized use,
+ *   duplication, transmission, distribution, or disclosure of this
+ *   software is expressly forbidden.
+ *
+ *   This Copyright notice may not be removed or modified without prior
+ *   written consent of Real Time Logic LLC.
+ *
+ *   Real Time Logic LLC. reserves the right to modify this software
+ *   without notice.
+ *
+ *               http://sharkssl.com
+ ****************************************************************************
+ *
+ *  permessage-deflate benchmark: sends the reference example's
+ *  ledinfo, setled, and settemp messages using MS_write and reads them
+ *  back using MS_read over a local socket pair, with compression off
+ *  and with permessage-deflate negotiated using several window sizes,
+ *  with and without context takeover. The tool acts as the client: it
+ *  receives each frame sent by the server, masks it, and sends it back.
+ *  It prints the average message and frame size, the compression
+ *  ratio, and the CPU time per message for MS_write and MS_read. The
+ *  CPU time includes the socket calls; the difference from the
+ *  uncompressed run is the cost of deflate and inflate.
+ *
+ *  The tool includes MSLib.c to set up the compression state without
+ *  an HTTP handshake.
+ *
+ *  Build: make deflatebench (requires zlib)
+ *
+ *  Usage: deflatebench [messages]
+ */
+
+#ifndef MS_DEFLATE
+#define MS_DEFLATE
+#endif
+#include "MSLib.c"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef struct {
+   int bits; /* Window bits, zero for no compression */
+   int flags; /* MS_PMD_SERVER_NCT | MS_PMD_CLIENT_NCT */
+} PmdConfig;
+
+static const PmdConfig configs[]={
+   {0, 0},
+   {15, 0},
+   {15, MS_PMD_SERVER_NCT|MS_PMD_CLIENT_NCT},
+   {10, 0},
+   {10, MS_PMD_SERVER_NCT|MS_PMD_CLIENT_NCT},
+   {9, 0}
+};
+
+static const char* const msgNames[]={"ledinfo", "setled", "settemp"};
+
+static U8 recBuf[1500];
+static U8 sendBuf[1500];
+static U8 frame[1500];
+
+
+/* Creates message 'type', number 'i', as sent by the reference example */
+static int
+makeMessage(char* buf, int type, int i)
+{
+   static const char* const tf[]={"false", "true"};
+   if(type == 0)
+      return sprintf(buf, "[\"ledinfo\",{\"leds\":["
+                     "{\"id\":1,\"color\":\"red\",\"name\":\"LED1\",\"on\":%s},"
+                     "{\"id\":2,\"color\":\"yellow\",\"name\":\"LED2\",\"on\":%s},"
+                     "{\"id\":3,\"color\":\"green\",\"name\":\"LED3\",\"on\":%s},"
+                     "{\"id\":4,\"color\":\"blue\",\"name\":\"LED4\",\"on\":%s}"
+                     "]}]", tf[i&1], tf[(i>>1)&1], tf[(i>>2)&1], tf[(i>>3)&1]);
+   if(type == 1)
+      return sprintf(buf, "[\"setled\",{\"id\":%d,\"on\":%s}]",
+                     1+(i&3), tf[(i>>2)&1]);
+   return sprintf(buf, "[\"settemp\",%d]", 200+i%50);
+}
+
+
+static int
+readAll(int fd, U8* buf, int len)
+{
+   while(len)
+   {
+      ssize_t n=read(fd, buf, len);
+      if(n <= 0)
+         return -1;
+      buf+=n;
+      len-=(int)n;
+   }
+   return 0;
+}
+
+
+/* Receives one server frame on 'fd' and sends it back as a masked
+ * client frame. Returns the server frame size or -1.
+ */
+static int
+echoFrame(int fd, U8* fin)
+{
+   int hlen=2, len, n;
+   if(readAll(fd, frame, 2))
+      return -1;
+   len=frame[1] & 0x7F;
+   if(len == 126)
+   {
+      if(readAll(fd, frame+2, 2))
+         return -1;
+      len=(frame[2] << 8) | frame[3];
+      hlen=4;
+   }
+   else if(len == 127 || hlen+4+len > (int)sizeof(frame))
+      return -1;
+   if(readAll(fd, frame+hlen+4, len))
+      return -1;
+   *fin=frame[0] & WSOP_FIN;
+   frame[1] |= 0x80; /* Mask bit; an all zero key leaves the data as is */
+   memset(frame+hlen, 0, 4);
+   n=hlen+4+len;
+   if(write(fd, frame, n) != n)
+      return -1;
+   return hlen+len;
+}
+
+
+static double
+cpuTime(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static int
+runConfig(const PmdConfig* cfg, int type, int messages)
+{
+   char msg[512];
+   U8* buf;
+   SOCKET sock;
+   MS ms;
+   int fds[2], i, len, wireLen;
+   long msgBytes=0, wireBytes=0;
+   double t, writeTime=0, readTime=0;
+   U8 fin;
+   if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+      return -1;
+   sock.hndl=fds[0];
+   MS_constructor(&ms);
+   MS_setSocket(&ms, &sock, recBuf, sizeof(recBuf),
+                sendBuf, sizeof(sendBuf));
+   if(cfg->bits && msPmdInit(&ms, cfg->bits, cfg->bits, cfg->flags))
+      return -1;
+   for(i=0 ; i < messages ; i++)
+   {
+      len=makeMessage(msg, type, i);
+      t=cpuTime();
+      if(MS_write(&ms, WSOP_Text, msg, len))
+         return -1;
+      writeTime+=cpuTime()-t;
+      do
+      {
+         if( (wireLen=echoFrame(fds[1], &fin)) < 0 )
+            return -1;
+         wireBytes+=wireLen;
+      } while(!fin);
+      t=cpuTime();
+      if(MS_read(&ms, &buf, 1000) != len || memcmp(buf, msg, len))
+         return -1;
+      readTime+=cpuTime()-t;
+      msgBytes+=len;
+   }
+   if(cfg->bits)
+      sprintf(msg, "%d bits%s", cfg->bits,
+              cfg->flags ? ", no takeover" : "");
+   else
+      strcpy(msg, "uncompressed");
+   printf("%-8s %-22s %4ld B, frame %4ld B (%3.0f%%), "
+          "MS_write %.2f us, MS_read %.2f us\n",
+          msgNames[type], msg, msgBytes/messages, wireBytes/messages,
+          100.0*wireBytes/msgBytes, writeTime/messages*1e6,
+          readTime/messages*1e6);
+   MS_destructor(&ms);
+   close(fds[0]);
+   close(fds[1]);
+   return 0;
+}
+
+
+int
+main(int argc, char** argv)
+{
+   int messages = argc > 1 ? atoi(argv[1]) : 100000;
+   int type, i;
+   if(messages <= 0)
+      messages=1;
+   for(type=0 ; type < 3 ; type++)
+   {
+      for(i=0 ; i < (int)(sizeof(configs)/sizeof(configs[0])) ; i++)
+      {
+         if(runConfig(configs+i, type, messages))
+         {
+            printf("%s: failed\n", msgNames[type]);
+            return 1;
+         }
+      }
+   }
+   return 0;
+}
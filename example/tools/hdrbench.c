@@ -0,0 +1,285 @@
+/*
+ *     ____             _________                __                _
+ *    / __ \___  ____ _/ /_  __(_)___ ___  ___  / /   ____  ____ _(_)____
+ *   / /_/ / _ \/ __ `/ / / / / / __ `__ \/ _ \/ /   / __ \/ __ `/ / ___/
+ *  / _, _/  __/ /_/ / / / / / / / / / / /  __/ /___/ /_/ / /_/ / / /__
+ * /_/ |_|\___/\__,_/_/ /_/ /_/_/ /_/ /_/\___/_____/\____/\__, /_/\___/
+ *                                                       /____/
+ *
+ *                 SharkSSL Embedded SSL/TLS Stack
+ ****************************************************************************
+ *   PROGRAM MODULE
+ *
+ *   $Id$
+ *
+ *   COPYRIGHT:  Real Time Logic LLC, 2013 - 2020
+ *
+ *   This software is copyrighted by and is the sole property of Real
+ *   Time Logic LLC.  All rights, title, ownership, or other interests in
+ *   the software remain the property of Real Time Logic LLC.  This
+ *   software may only be used in accordance with the terms and
+ *   conditions stipulated in the corresponding license agreement under
+ *   which the software has been supplied.  Any unauthorized use,
+ *   duplication, transmission, distribution, or disclosure of this
+ *   software is expressly forbidden.
+ *
+ *   This Copyright notice may not be removed or modified without prior
+ *   written consent of Real Time Logic LLC.
+ *
+ *   Real Time Logic LLC. reserves the right to modify this software
+ *   without notice.
+ *
+ *               http://sharkssl.com
+ ****************************************************************************
+ *
+ *  HTTP request header tokenizer benchmark: measures the time
+ *  msHttpReqTokenize in MSLib.c takes to split and classify the
+ *  WebSocket upgrade request sent by Chrome, Firefox, and Safari, when
+ *  the header is received in one read and when it is received in 64
+ *  byte reads. The time is compared with the msstrstrn based scan the
+ *  tokenizer replaced, which searched for the end of the header after
+ *  each read, split the lines, and searched for the known header names
+ *  in each line. The tool also checks that both find the same
+ *  Sec-WebSocket-Key, Origin, and User-Agent values.
+ *
+ *  The tokenizer is a static function, thus the tool includes MSLib.c.
+ *
+ *  Build: make hdrbench
+ *
+ *  Usage: hdrbench
+ */
+
+#include "MSLib.c"
+#include <stdio.h>
+#include <time.h>
+
+static const char* const requests[]={
+   "GET /ws HTTP/1.1\r\n"
+   "Host: 192.168.1.100\r\n"
+   "Connection: Upgrade\r\n"
+   "Pragma: no-cache\r\n"
+   "Cache-Control: no-cache\r\n"
+   "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) "
+   "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 "
+   "Safari/537.36\r\n"
+   "Upgrade: websocket\r\n"
+   "Origin: http://192.168.1.100\r\n"
+   "Sec-WebSocket-Version: 13\r\n"
+   "Accept-Encoding: gzip, deflate\r\n"
+   "Accept-Language: en-US,en;q=0.9\r\n"
+   "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+   "Sec-WebSocket-Extensions: permessage-deflate; "
+   "client_max_window_bits\r\n"
+   "\r\n",
+
+   "GET /ws HTTP/1.1\r\n"
+   "Host: 192.168.1.100\r\n"
+   "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:121.0) "
+   "Gecko/20100101 Firefox/121.0\r\n"
+   "Accept: */*\r\n"
+   "Accept-Language: en-US,en;q=0.5\r\n"
+   "Accept-Encoding: gzip, deflate\r\n"
+   "Sec-WebSocket-Version: 13\r\n"
+   "Origin: http://192.168.1.100\r\n"
+   "Sec-WebSocket-Extensions: permessage-deflate\r\n"
+   "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+   "DNT: 1\r\n"
+   "Connection: keep-alive, Upgrade\r\n"
+   "Sec-Fetch-Dest: empty\r\n"
+   "Sec-Fetch-Mode: websocket\r\n"
+   "Sec-Fetch-Site: same-origin\r\n"
+   "Pragma: no-cache\r\n"
+   "Cache-Control: no-cache\r\n"
+   "Upgrade: websocket\r\n"
+   "\r\n",
+
+   "GET /ws HTTP/1.1\r\n"
+   "Host: 192.168.1.100\r\n"
+   "Sec-WebSocket-Version: 13\r\n"
+   "Upgrade: websocket\r\n"
+   "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+   "Connection: Upgrade\r\n"
+   "Sec-WebSocket-Extensions: permessage-deflate\r\n"
+   "Origin: http://192.168.1.100\r\n"
+   "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) "
+   "AppleWebKit/605.1.15 (KHTML, like Gecko) Version/17.2 "
+   "Safari/605.1.15\r\n"
+   "Pragma: no-cache\r\n"
+   "Cache-Control: no-cache\r\n"
+   "\r\n"
+};
+
+static const char* const browsers[]={"Chrome", "Firefox", "Safari"};
+
+#define ITERATIONS 200000
+
+typedef struct {
+   U8* key;
+   U8* origin;
+   U8* userAgent;
+} ScanResult;
+
+static U8 hdrBuf[1500];
+
+
+/* Splits a "key: value" line, as the replaced code did */
+static U8*
+getKeyVal(U8* key)
+{
+   U8* val = key;
+   while(*val && *val != ':') val++;
+   *val++=0;
+   while(*val && *val == ' ') val++;
+   return *val ? val : 0;
+}
+
+
+/* The header scan msHttpReqTokenize replaced. The end of the header
+ * is searched for in all data received so far after each read.
+ */
+static int
+msstrstrnScan(const U8* req, int len, int chunk, ScanResult* res)
+{
+   U8* hKeys[MAX_HTTP_H_SIZE];
+   U8* hVals[MAX_HTTP_H_SIZE];
+   U8* request=0;
+   U8 *ptr, *end=0;
+   int hIx=0, i, rlen;
+   for(rlen=0 ; !end && rlen < len ; )
+   {
+      int n = len-rlen < chunk ? len-rlen : chunk;
+      memcpy(hdrBuf+rlen, req+rlen, n);
+      rlen+=n;
+      end=msstrstrn(hdrBuf, rlen, (const U8*)"\r\n\r\n");
+   }
+   if(!end)
+      return -1;
+   end+=4;
+   for(ptr=hdrBuf ; ptr < end ; )
+   {
+      U8* next=msstrstrn(ptr, (int)(end-ptr), (const U8*)"\r\n");
+      if(!next)
+         break;
+      *next=0;
+      if(request)
+      {
+         if(hIx == MAX_HTTP_H_SIZE)
+            return -1;
+         hKeys[hIx]=ptr;
+         hVals[hIx]=getKeyVal(ptr);
+         hIx++;
+      }
+      else
+         request=ptr;
+      ptr=next+2;
+   }
+   memset(res, 0, sizeof(ScanResult));
+   for(i=0 ; i < hIx ; i++)
+   {
+      ptr=hKeys[i];
+      switch(*ptr)
+      {
+         case 'O':
+         case 'o':
+            if(!res->origin && msstrstrn(ptr,100,(const U8*)"Origin"))
+               res->origin=hVals[i];
+            break;
+         case 's':
+         case 'S':
+            if(!res->key &&
+               msstrstrn(ptr,100,(const U8*)"sec-WebSocket-Key"))
+               res->key=hVals[i];
+            break;
+         case 'u':
+         case 'U':
+            if(msstrstrn(ptr,100,(const U8*)"User-Agent"))
+               res->userAgent=hVals[i];
+      }
+   }
+   return 0;
+}
+
+
+/* Feeds the request to the tokenizer 'chunk' bytes at a time */
+static int
+tokenizerScan(const U8* req, int len, int chunk, ScanResult* res)
+{
+   WssProtocolHandshake wph;
+   int rc=0, rlen;
+   msHttpReqReset(&wph);
+   for(rlen=0 ; !rc && rlen < len ; )
+   {
+      int n = len-rlen < chunk ? len-rlen : chunk;
+      memcpy(hdrBuf+rlen, req+rlen, n);
+      rlen+=n;
+      rc=msHttpReqTokenize(&wph, hdrBuf, rlen);
+   }
+   if(rc <= 0)
+      return -1;
+   res->key=msHttpHdrVal(&wph, MSH_SEC_WEBSOCKET_KEY);
+   res->origin=msHttpHdrVal(&wph, MSH_ORIGIN);
+   res->userAgent=msHttpHdrVal(&wph, MSH_USER_AGENT);
+   return 0;
+}
+
+
+static int
+sameVal(const U8* a, const U8* b)
+{
+   return a && b && !strcmp((const char*)a, (const char*)b);
+}
+
+
+static double
+now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+int
+main(void)
+{
+   static const int chunks[]={1500, 64};
+   int r, c, i;
+   for(r=0 ; r < 3 ; r++)
+   {
+      const U8* req=(const U8*)requests[r];
+      int len=(int)strlen(requests[r]);
+      for(c=0 ; c < 2 ; c++)
+      {
+         ScanResult oldRes, newRes;
+         U8 key[64], origin[64], userAgent[200];
+         double t0, t1, t2;
+         if(msstrstrnScan(req, len, chunks[c], &oldRes))
+         {
+            printf("%s: msstrstrn scan failed\n", browsers[r]);
+            return 1;
+         }
+         strcpy((char*)key, (char*)oldRes.key);
+         strcpy((char*)origin, (char*)oldRes.origin);
+         strcpy((char*)userAgent, (char*)oldRes.userAgent);
+         if(tokenizerScan(req, len, chunks[c], &newRes) ||
+            !sameVal(key, newRes.key) || !sameVal(origin, newRes.origin) ||
+            !sameVal(userAgent, newRes.userAgent))
+         {
+            printf("%s: tokenizer result differs\n", browsers[r]);
+            return 1;
+         }
+         t0=now();
+         for(i=0 ; i < ITERATIONS ; i++)
+            msstrstrnScan(req, len, chunks[c], &oldRes);
+         t1=now();
+         for(i=0 ; i < ITERATIONS ; i++)
+            tokenizerScan(req, len, chunks[c], &newRes);
+         t2=now();
+         printf("%-7s %3d B, %-12s tokenizer %4.0f ns, "
+                "msstrstrn scan %5.0f ns\n",
+                browsers[r], len, c ? "64 B reads:" : "one read:",
+                (t2-t1)/ITERATIONS*1e9, (t1-t0)/ITERATIONS*1e9);
+      }
+   }
+   return 0;
+}
@@ -0,0 +1,902 @@
+/*
+ *     ____             _________                __                _
+ *    / __ \___  ____ _/ /_  __(_)___ ___  ___  / /   ____  ____ _(_)____
+ *   / /_/ / _ \/ __ `/ / / / / / __ `__ \/ _ \/ /   / __ \/ __ `/ / ___/
+ *  / _, _/  __/ /_/ / / / / / / / / / / /  __/ /___/ /_/ / /_/ / / /__
+ * /_/ |_|\___/\__,_/_/ /_/ /_/_/ /_/ /_/\___/_____/\____/\__, /_/\___/
+ *                                                       /____/
+ *
+ *                 SharkSSL Embedded SSL/TLS Stack
+ ****************************************************************************
+ *   PROGRAM MODULE
+ *
+ *   $Id$
+ *
+ *   COPYRIGHT:  Real Time Logic LLC, 2013 - 2020
+ *
+ *   This software is copyrighted by and is the sole property of Real
+ *   Time Logic LLC.  All rights, title, ownership, or other interests in
+ *   the software remain the property of Real Time Logic LLC.  This
+ *   software may only be used in accordance with the terms and
+ *   conditions stipulated in the corresponding license agreement under
+ *   which the software has been supplied.  Any unauthorized use,
+ *   duplication, transmission, distribution, or disclosure of this
+ *   software is expressly forbidden.
+ *
+ *   This Copyright notice may not be removed or modified without prior
+ *   written consent of Real Time Logic LLC.
+ *
+ *   Real Time Logic LLC. reserves the right to modify this software
+ *   without notice.
+ *
+ *               http://sharkssl.com
+ ****************************************************************************
+ *
+ *  HTML amalgamator: host tool converting a Single Page App directory
+ *  such as 'www' to a C file with a Minnow Server route table.
+ *
+ *  The tool inlines the style sheets and scripts referenced by
+ *  index.html, minifies the HTML, CSS, and JavaScript, gzip compresses
+ *  each asset at the maximum compression level, and emits the assets
+ *  with their content type, ETag, and a perfect hash route table (see
+ *  MSRouteTable in MSLib.h). The output only depends on the input
+ *  files, thus the generated file can be kept in version control.
+ *
+ *  When built with brotli, a brotli encoded variant is also emitted
+ *  for each asset where brotli is smaller than gzip. The server sends
+ *  the variant to browsers accepting brotli (MSAsset:alt).
+ *
+ *  Build: cc -O2 -o htmlamalg htmlamalg.c -lz
+ *  Build with zopfli: add -DUSE_ZOPFLI and -lzopfli
+ *  Build with brotli: add -DUSE_BROTLI and -lbrotlienc
+ *
+ *  Usage: htmlamalg [-s] [-n] [-w bits] www-dir output.c
+ *    -s  do not inline; emit each file as a separate asset
+ *    -n  do not minify
+ *    -w  gzip window bits, 9 to 15 (default). A smaller window
+ *        reduces the memory the server needs for decompressing an
+ *        asset for clients not accepting gzip: see MS_GZIP_WINDOW_BITS
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef USE_ZOPFLI
+#include <zopfli.h>
+#endif
+#ifdef USE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+typedef unsigned char U8;
+
+/* Files larger than this value are not read */
+#define MAX_FILE_SIZE (16*1024*1024)
+
+/* Max number of files in the www directory */
+#define MAX_FILES 1024
+
+/* Seed search start value: the FNV-1a 32 bit offset basis */
+#define FNV_SEED 2166136261U
+
+/* The end of a persistent connection response header. Must be
+ * identical to httpEORKeepAlive in MSLib.c.
+ */
+#define HTTP_EOR_KEEP_ALIVE \
+   "\r\nConnection: keep-alive\r\nServer: SharkSSL WebSocket Server\r\n\r\n"
+
+
+/* A growing byte buffer */
+typedef struct {
+   U8* data;
+   size_t len;
+   size_t size;
+} Buf;
+
+/* An encoded representation of a file */
+typedef struct {
+   Buf data; /* The sent data */
+   const char* encoding; /* "gzip", "br", or NULL if not encoded */
+   Buf hdr; /* Pre-built response header, see MSAsset:resp */
+   size_t hdrLen; /* MSAsset:hdrLen */
+   unsigned long long hash; /* FNV-1a 64 bit hash of 'data' */
+} Variant;
+
+/* A file in the www directory */
+typedef struct {
+   char* path; /* Relative path using '/' as separator */
+   Buf content; /* Content, possibly minified and inlined */
+   Variant v; /* gzip, or the content if gzip does not reduce the size */
+   Variant br; /* Brotli, if smaller than gzip */
+   int inlined; /* Set if inlined in index.html */
+} Asset;
+
+static Asset assets[MAX_FILES];
+static int assetsLen;
+static int minify=1;
+static int gzipWindowBits=15;
+
+
+static void
+fatal(const char* msg, const char* arg)
+{
+   fprintf(stderr, "htmlamalg: %s%s%s\n", msg, arg ? ": " : "", arg ? arg : "");
+   exit(1);
+}
+
+
+static void
+Buf_append(Buf* o, const void* data, size_t len)
+{
+   if(o->len + len > o->size)
+   {
+      o->size = (o->len + len) * 2 + 256;
+      if( (o->data = (U8*)realloc(o->data, o->size)) == 0 )
+         fatal("out of memory", 0);
+   }
+   memcpy(o->data + o->len, data, len);
+   o->len += len;
+}
+
+#define Buf_appendStr(o, str) Buf_append(o, str, strlen(str))
+
+
+static void
+Buf_read(Buf* o, const char* name)
+{
+   FILE* fp;
+   long len;
+   memset(o, 0, sizeof(Buf));
+   if( (fp=fopen(name, "rb")) == 0 )
+      fatal("cannot open", name);
+   fseek(fp, 0, SEEK_END);
+   len=ftell(fp);
+   fseek(fp, 0, SEEK_SET);
+   if(len < 0 || len > MAX_FILE_SIZE)
+      fatal("file too big", name);
+   o->size=(size_t)len+1;
+   if( (o->data = (U8*)malloc(o->size)) == 0 )
+      fatal("out of memory", 0);
+   if(fread(o->data, 1, (size_t)len, fp) != (size_t)len)
+      fatal("cannot read", name);
+   o->len=(size_t)len;
+   fclose(fp);
+}
+
+
+/************************** Directory scanning ****************************/
+
+static void
+scanDir(const char* root, const char* rel)
+{
+   char name[2048];
+   DIR* dir;
+   struct dirent* e;
+   snprintf(name, sizeof(name), "%s%s%s", root, *rel ? "/" : "", rel);
+   if( (dir=opendir(name)) == 0 )
+      fatal("cannot open directory", name);
+   while( (e=readdir(dir)) != 0 )
+   {
+      char path[1024];
+      struct stat st;
+      if(e->d_name[0] == '.')
+         continue; /* Skip '.', '..', and hidden files */
+      snprintf(path, sizeof(path), "%s%s%s", rel, *rel ? "/" : "", e->d_name);
+      snprintf(name, sizeof(name), "%s/%s", root, path);
+      if(stat(name, &st))
+         fatal("cannot stat", name);
+      if(S_ISDIR(st.st_mode))
+         scanDir(root, path);
+      else if(S_ISREG(st.st_mode))
+      {
+         if(assetsLen == MAX_FILES)
+            fatal("too many files", 0);
+         assets[assetsLen].path=strdup(path);
+         Buf_read(&assets[assetsLen].content, name);
+         assetsLen++;
+      }
+   }
+   closedir(dir);
+}
+
+
+static int
+cmpAsset(const void* a, const void* b)
+{
+   return strcmp(((const Asset*)a)->path, ((const Asset*)b)->path);
+}
+
+
+static Asset*
+findAsset(const char* path)
+{
+   int i;
+   if(!strncmp(path, "./", 2))
+      path+=2;
+   for(i=0 ; i < assetsLen ; i++)
+   {
+      if(!strcmp(assets[i].path, path))
+         return assets+i;
+   }
+   return 0;
+}
+
+
+/******************************** Minifiers *******************************/
+
+/* CSS: remove comments and collapse white space */
+static void
+minifyCss(Buf* o)
+{
+   Buf out={0};
+   size_t i=0;
+   U8 quote=0;
+   int space=0;
+   while(i < o->len)
+   {
+      U8 c=o->data[i];
+      if(quote)
+      {
+         if(c == '\\' && i+1 < o->len)
+         {
+            Buf_append(&out, o->data+i, 2);
+            i+=2;
+            continue;
+         }
+         if(c == quote)
+            quote=0;
+      }
+      else if(c == '/' && i+1 < o->len && o->data[i+1] == '*')
+      {
+         for(i+=2 ; i+1 < o->len && (o->data[i] != '*' || o->data[i+1] != '/');)
+            i++;
+         i+=2;
+         continue;
+      }
+      else if(isspace(c))
+      {
+         space=1;
+         i++;
+         continue;
+      }
+      else
+      {
+         if(c == '"' || c == '\'')
+            quote=c;
+         if(space && out.len && !strchr("{};,", out.data[out.len-1]) &&
+            !strchr("{};", c))
+         {
+            Buf_append(&out, " ", 1);
+         }
+      }
+      space=0;
+      Buf_append(&out, &c, 1);
+      i++;
+   }
+   free(o->data);
+   *o=out;
+}
+
+
+/* JavaScript and HTML: remove indentation, empty lines, and lines
+ * starting with '//' (JavaScript). Template literals and lines ending
+ * with a backslash are kept as is. This conservative minifier does
+ * not need a JavaScript parser and keeps the line structure, thus
+ * automatic semicolon insertion is not affected.
+ */
+static void
+minifyLines(Buf* o, int js)
+{
+   Buf out={0};
+   size_t i=0;
+   int template=0; /* Inside `...` */
+   int keep=0; /* Keep the next line's indentation */
+   while(i < o->len)
+   {
+      size_t start=i,end;
+      U8 quote=0;
+      int comment=0;
+      while(i < o->len && o->data[i] != '\n') i++;
+      end=i;
+      if(i < o->len) i++; /* Skip '\n' */
+      if(!template && !keep)
+      {
+         while(start < end && (o->data[start] == ' ' || o->data[start] == '\t'))
+            start++;
+         if(start == end || (o->data[start] == '\r' && start+1 == end))
+            continue; /* Empty line */
+         if(js && end-start >= 2 && o->data[start] == '/' && o->data[start+1] == '/')
+            continue; /* Comment line */
+      }
+      Buf_append(&out, o->data+start, i-start);
+      if(js)
+      {  /* Track template literals, ignoring quotes in strings/comments */
+         size_t j;
+         for(j=start ; j < end && !comment ; j++)
+         {
+            U8 c=o->data[j];
+            if(c == '\\')
+               j++;
+            else if(template)
+            {
+               if(c == '`')
+                  template=0;
+            }
+            else if(quote)
+            {
+               if(c == quote)
+                  quote=0;
+            }
+            else if(c == '"' || c == '\'')
+               quote=c;
+            else if(c == '`')
+               template=1;
+            else if(c == '/' && j+1 < end && o->data[j+1] == '/')
+               comment=1;
+         }
+         keep = end > start && o->data[end-1 - (o->data[end-1] == '\r')] == '\\';
+      }
+   }
+   free(o->data);
+   *o=out;
+}
+
+
+/* HTML: remove comments, except conditional comments, and indentation */
+static void
+minifyHtml(Buf* o)
+{
+   Buf out={0};
+   size_t i=0;
+   while(i < o->len)
+   {
+      if(o->len-i > 4 && !memcmp(o->data+i, "<!--", 4) &&
+         o->data[i+4] != '[')
+      {
+         U8* e;
+         for(e=o->data+i+4 ; e+3 <= o->data+o->len && memcmp(e, "-->", 3); e++)
+            ;
+         i = (size_t)(e+3 - o->data);
+         continue;
+      }
+      Buf_append(&out, o->data+i, 1);
+      i++;
+   }
+   free(o->data);
+   *o=out;
+   minifyLines(o, 0);
+}
+
+
+/******************************** Inlining ********************************/
+
+/* Case insensitive search for 'str' in data[start..len) */
+static U8*
+findStr(const Buf* o, size_t start, const char* str)
+{
+   size_t n=strlen(str);
+   size_t i;
+   for(i=start ; i+n <= o->len ; i++)
+   {
+      size_t j;
+      for(j=0 ; j < n && tolower(o->data[i+j]) == str[j] ; j++)
+         ;
+      if(j == n)
+         return o->data+i;
+   }
+   return 0;
+}
+
+
+/* Returns the value of attribute 'name' in the tag [tag,end) */
+static char*
+getAttr(U8* tag, U8* end, const char* name, char* val, size_t size)
+{
+   size_t n=strlen(name);
+   U8* ptr;
+   for(ptr=tag ; ptr+n+2 < end ; ptr++)
+   {
+      if(isspace(ptr[-1]) && !strncasecmp((char*)ptr, name, n) &&
+         ptr[n] == '=' && (ptr[n+1] == '"' || ptr[n+1] == '\''))
+      {
+         U8 q=ptr[n+1];
+         size_t i=0;
+         for(ptr+=n+2 ; ptr < end && *ptr != q && i+1 < size ; ptr++)
+            val[i++]=(char)*ptr;
+         val[i]=0;
+         return val;
+      }
+   }
+   return 0;
+}
+
+
+/* Returns the local asset for URL 'url', or NULL if not local or if
+ * 'closeTag' is in the content, i.e. if the asset cannot be inlined.
+ */
+static Asset*
+inlineAsset(const char* url, const char* closeTag)
+{
+   Asset* a;
+   if(strstr(url, "//") || strchr(url, '?') || strchr(url, '#'))
+      return 0;
+   if( (a=findAsset(url[0] == '/' ? url+1 : url)) == 0 ||
+       findStr(&a->content, 0, closeTag) )
+   {
+      return 0;
+   }
+   return a;
+}
+
+
+/* Replace the <link rel="stylesheet"> and <script src> tags with the
+ * referenced local files.
+ */
+static void
+inlineHtml(Asset* html)
+{
+   Buf out={0};
+   Buf* in=&html->content;
+   size_t i=0;
+   for(;;)
+   {
+      U8* link=findStr(in, i, "<link");
+      U8* script=findStr(in, i, "<script");
+      U8* tag = link && (!script || link < script) ? link : script;
+      U8* end;
+      char url[512];
+      char rel[64];
+      Asset* a=0;
+      if(!tag)
+         break;
+      end=(U8*)memchr(tag, '>', in->data+in->len-tag);
+      if(!end)
+         break;
+      end++;
+      if(tag == link)
+      {
+         if(getAttr(tag, end, "rel", rel, sizeof(rel)) &&
+            !strcasecmp(rel, "stylesheet") &&
+            getAttr(tag, end, "href", url, sizeof(url)) &&
+            (a=inlineAsset(url, "</style")) != 0)
+         {
+            Buf_append(&out, in->data+i, tag-(in->data+i));
+            Buf_appendStr(&out, "<style>");
+            Buf_append(&out, a->content.data, a->content.len);
+            Buf_appendStr(&out, "</style>");
+         }
+      }
+      else if(getAttr(tag, end, "src", url, sizeof(url)))
+      {
+         U8* close=findStr(in, end-in->data, "</script>");
+         if(close && close == end && (a=inlineAsset(url, "</script")) != 0)
+         {
+            Buf_append(&out, in->data+i, tag-(in->data+i));
+            Buf_appendStr(&out, "<script>");
+            Buf_append(&out, a->content.data, a->content.len);
+            Buf_appendStr(&out, "</script>");
+            end=close+9;
+         }
+      }
+      if(a)
+         a->inlined=1;
+      else
+         Buf_append(&out, in->data+i, end-(in->data+i));
+      i=(size_t)(end-in->data);
+   }
+   Buf_append(&out, in->data+i, in->len-i);
+   free(in->data);
+   *in=out;
+}
+
+
+/****************************** Compression *******************************/
+
+static void
+gzipAsset(Asset* a)
+{
+   Buf gz={0};
+#ifdef USE_ZOPFLI
+   ZopfliOptions opt;
+   unsigned char* out=0;
+   size_t outLen=0;
+   ZopfliInitOptions(&opt);
+   ZopfliCompress(&opt, ZOPFLI_FORMAT_GZIP, a->content.data, a->content.len,
+                  &out, &outLen);
+   gz.data=out;
+   gz.len=gz.size=outLen;
+#else
+   z_stream z;
+   gz_header h;
+   memset(&z, 0, sizeof(z));
+   memset(&h, 0, sizeof(h));
+   h.os=3; /* Same on all hosts: reproducible output */
+   /* +16: gzip format, mtime 0 */
+   if(deflateInit2(&z, 9, Z_DEFLATED, gzipWindowBits+16, 9,
+                   Z_DEFAULT_STRATEGY) != Z_OK ||
+      deflateSetHeader(&z, &h) != Z_OK)
+   {
+      fatal("deflateInit2 failed", 0);
+   }
+   gz.size=deflateBound(&z, (uLong)a->content.len) + 64;
+   if( (gz.data = (U8*)malloc(gz.size)) == 0 )
+      fatal("out of memory", 0);
+   z.next_in=a->content.data;
+   z.avail_in=(uInt)a->content.len;
+   z.next_out=gz.data;
+   z.avail_out=(uInt)gz.size;
+   if(deflate(&z, Z_FINISH) != Z_STREAM_END)
+      fatal("deflate failed", a->path);
+   gz.len=z.total_out;
+   deflateEnd(&z);
+#endif
+   /* Already compressed formats such as PNG do not benefit */
+   if(gz.len + gz.len/16 >= a->content.len)
+   {
+      free(gz.data);
+      a->v.data=a->content;
+   }
+   else
+   {
+      a->v.data=gz;
+      a->v.encoding="gzip";
+   }
+}
+
+
+#ifdef USE_BROTLI
+static void
+brotliAsset(Asset* a)
+{
+   Buf br={0};
+   br.size=BrotliEncoderMaxCompressedSize(a->content.len);
+   if( (br.data = (U8*)malloc(br.size)) == 0 )
+      fatal("out of memory", 0);
+   br.len=br.size;
+   if(!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW,
+                             BROTLI_MODE_GENERIC, a->content.len,
+                             a->content.data, &br.len, br.data))
+   {
+      fatal("brotli failed", a->path);
+   }
+   if(br.len >= a->v.data.len)
+      free(br.data);
+   else
+   {
+      a->br.data=br;
+      a->br.encoding="br";
+   }
+}
+#endif
+
+
+static unsigned long long
+fnv1a64(const U8* data, size_t len)
+{
+   unsigned long long h=0xCBF29CE484222325ULL;
+   while(len--)
+   {
+      h ^= *data++;
+      h *= 0x100000001B3ULL;
+   }
+   return h;
+}
+
+
+/* Same as msRouteHash in MSLib.c */
+static unsigned int
+routeHash(const char* path, unsigned int seed)
+{
+   unsigned int h=seed;
+   while(*path)
+   {
+      h ^= (U8)*path++;
+      h *= 16777619U;
+   }
+   return h;
+}
+
+
+static const char*
+contentType(const char* path)
+{
+   static const char* const types[]={
+      ".html", "text/html; charset=UTF-8",
+      ".htm", "text/html; charset=UTF-8",
+      ".css", "text/css",
+      ".js", "application/javascript",
+      ".json", "application/json",
+      ".svg", "image/svg+xml",
+      ".png", "image/png",
+      ".jpg", "image/jpeg",
+      ".jpeg", "image/jpeg",
+      ".gif", "image/gif",
+      ".ico", "image/x-icon",
+      ".woff", "font/woff",
+      ".woff2", "font/woff2",
+      ".txt", "text/plain; charset=UTF-8",
+      0
+   };
+   const char* ext=strrchr(path, '.');
+   int i;
+   if(ext)
+   {
+      for(i=0 ; types[i] ; i+=2)
+      {
+         if(!strcasecmp(ext, types[i]))
+            return types[i+1];
+      }
+   }
+   return "application/octet-stream";
+}
+
+
+/* Build the 200 OK response header using the same format as
+ * msRouteFetchPage in MSLib.c.
+ */
+static void
+buildHeader(const Asset* a, Variant* v)
+{
+   char buf[512];
+   v->hash=fnv1a64(v->data.data, v->data.len);
+   snprintf(buf, sizeof(buf),
+            "HTTP/1.0 200 OK\r\nContent-Length: %lu\r\nContent-Type: %s%s%s"
+            "\r\nETag: \"%016llx\"\r\nCache-Control: no-cache"
+            "\r\nAccept-Ranges: bytes%s",
+            (unsigned long)v->data.len, contentType(a->path),
+            v->encoding ? "\r\nContent-Encoding: " : "",
+            v->encoding ? v->encoding : "", v->hash,
+            v->encoding ? "\r\nVary: Accept-Encoding" : "");
+   Buf_appendStr(&v->hdr, buf);
+   v->hdrLen=v->hdr.len;
+   Buf_appendStr(&v->hdr, HTTP_EOR_KEEP_ALIVE);
+}
+
+
+/********************************* Output *********************************/
+
+/* A route: an asset served at path 'path' */
+typedef struct {
+   const char* path;
+   int asset;
+} Route;
+
+
+static void
+emitBytes(FILE* fp, const Buf* b, int more)
+{
+   size_t i;
+   for(i=0 ; i < b->len ; i++)
+      fprintf(fp, "%s0x%02X%s", i % 16 ? "" : "\n   ", b->data[i],
+              i+1 < b->len || more ? "," : "");
+}
+
+
+/* Emit the response header followed by the data */
+static void
+emitArray(FILE* fp, int ix, const char* suffix, const Variant* v)
+{
+   const U8* ptr;
+   fprintf(fp, "/* ");
+   for(ptr=v->hdr.data ; ptr < v->hdr.data+v->hdr.len-4 ; ptr++)
+   {
+      if(*ptr == '\n')
+         fprintf(fp, "\n   ");
+      else if(*ptr != '\r')
+         fputc(*ptr, fp);
+   }
+   fprintf(fp, "\n */\nstatic const U8 asset%d%s[] = {", ix, suffix);
+   emitBytes(fp, &v->hdr, 1);
+   emitBytes(fp, &v->data, 0);
+   fprintf(fp, "\n};\n\n");
+}
+
+
+/* Emit the MSAsset initializer for variant 'v' of asset 'ix' */
+static void
+emitAsset(FILE* fp, const char* path, int ix, const char* suffix,
+          const Variant* v, const char* alt, int more)
+{
+   const Asset* a=assets+ix;
+   unsigned long hlen=(unsigned long)v->hdr.len;
+   fprintf(fp, "   {\"%s%s\", asset%d%s+%lu, sizeof(asset%d%s)-%lu, \"%s\",\n"
+           "    %s%s%s, \"\\\"%016llx\\\"\", \"no-cache\", asset%d%s, %lu, %s}%s\n",
+           path[0] == '/' ? "" : "/", path, ix, suffix, hlen, ix, suffix, hlen,
+           contentType(a->path), v->encoding ? "\"" : "",
+           v->encoding ? v->encoding : "0", v->encoding ? "\"" : "",
+           v->hash, ix, suffix, (unsigned long)v->hdrLen, alt,
+           more ? "," : "");
+}
+
+
+static void
+emit(const char* name, const char* wwwDir)
+{
+   static Route routes[MAX_FILES+1];
+   static int slots[4*MAX_FILES];
+   int i,j,n=0,size=2;
+   int brLen=0;
+   unsigned int seed;
+   FILE* fp;
+   for(i=0 ; i < assetsLen ; i++)
+   {
+      Asset* a=assets+i;
+      if(a->inlined)
+         continue;
+      if(a->br.encoding)
+         brLen++;
+      if(!strcmp(a->path, "index.html"))
+      {
+         routes[n].path="/";
+         routes[n++].asset=i;
+      }
+      routes[n].path=a->path;
+      routes[n++].asset=i;
+   }
+   /* Load factor below 0.5 */
+   while(size < 2*n) size*=2;
+   for(seed=FNV_SEED ; ; seed++)
+   {
+      for(j=0 ; j < size ; j++) slots[j]=-1;
+      for(i=0 ; i < n ; i++)
+      {
+         char path[1024];
+         snprintf(path, sizeof(path), "%s%s",
+                  routes[i].path[0] == '/' ? "" : "/", routes[i].path);
+         j=(int)(routeHash(path, seed) & (unsigned)(size-1));
+         if(slots[j] >= 0)
+            break;
+         slots[j]=i;
+      }
+      if(i == n)
+         break; /* Perfect hash */
+      if(seed - FNV_SEED > 1000000)
+      {  /* Increase the table size */
+         size*=2;
+         seed=FNV_SEED-1;
+      }
+   }
+   if( (fp=fopen(name, "w")) == 0 )
+      fatal("cannot create", name);
+   fprintf(fp, "/* Autogenerated by htmlamalg from the '%s' directory.\n"
+           "   Do not edit. Regenerate with: make packwww\n */\n"
+           "#include <MSLib.h>\n\n", wwwDir);
+   for(i=0 ; i < assetsLen ; i++)
+   {
+      Asset* a=assets+i;
+      if(a->inlined)
+         continue;
+      fprintf(fp, "/* /%s: %lu bytes%s%s */\n", a->path,
+              (unsigned long)a->content.len, a->v.encoding ? ", " : "",
+              a->v.encoding ? a->v.encoding : "");
+      emitArray(fp, i, "", &a->v);
+      if(a->br.encoding)
+         emitArray(fp, i, "br", &a->br);
+   }
+   if(brLen)
+   {  /* Alternatives, not in the route table */
+      fprintf(fp, "static const MSAsset brAssets[] = {\n");
+      for(i=0,j=0 ; i < assetsLen ; i++)
+      {
+         if(!assets[i].inlined && assets[i].br.encoding)
+            emitAsset(fp, assets[i].path, i, "br", &assets[i].br, "0",
+                      ++j < brLen);
+      }
+      fprintf(fp, "};\n\n");
+   }
+   fprintf(fp, "static const MSAsset assets[] = {\n");
+   for(i=0 ; i < n ; i++)
+   {
+      char alt[32];
+      int ix=routes[i].asset;
+      strcpy(alt, "0");
+      if(assets[ix].br.encoding)
+      {
+         int k;
+         for(j=0,k=0 ; j < ix ; j++)
+            k += !assets[j].inlined && assets[j].br.encoding;
+         snprintf(alt, sizeof(alt), "brAssets+%d", k);
+      }
+      emitAsset(fp, routes[i].path, ix, "", &assets[ix].v, alt, i+1 < n);
+   }
+   fprintf(fp, "};\n\n/* Perfect hash: msRouteHash(path, %uU) & %d */\n"
+           "static const MSAsset* routeSlots[%d] = {", seed, size-1, size);
+   for(j=0 ; j < size ; j++)
+   {
+      fprintf(fp, "%s", j % 4 ? " " : "\n   ");
+      if(slots[j] < 0)
+         fprintf(fp, "0");
+      else
+         fprintf(fp, "assets+%d", slots[j]);
+      fprintf(fp, "%s", j+1 < size ? "," : "");
+   }
+   fprintf(fp, "\n};\n\n"
+           "static MSRouteTable routes={routeSlots, %uU, %d, %d};\n\n"
+           "int\nfetchPage(void* hndl, MST* mst, U8* path)\n{\n"
+           "   (void)hndl;\n"
+           "   return msRouteFetchPage(&routes, mst, path);\n}\n",
+           seed, size, n);
+   if(fclose(fp))
+      fatal("cannot write", name);
+}
+
+
+int
+main(int argc, char* argv[])
+{
+   int i,separate=0;
+   size_t total=0,sent=0;
+   Asset* index;
+   for(i=1 ; i < argc && argv[i][0] == '-' ; i++)
+   {
+      if(!strcmp(argv[i], "-s"))
+         separate=1;
+      else if(!strcmp(argv[i], "-n"))
+         minify=0;
+      else if(!strcmp(argv[i], "-w") && i+1 < argc)
+      {
+         gzipWindowBits=atoi(argv[++i]);
+         if(gzipWindowBits < 9 || gzipWindowBits > 15)
+            argc=0;
+#ifdef USE_ZOPFLI
+         fatal("-w is not supported by zopfli", 0);
+#endif
+      }
+      else
+         argc=0;
+   }
+   if(argc - i != 2)
+   {
+      fprintf(stderr, "Usage: htmlamalg [-s] [-n] [-w bits] www-dir output.c\n"
+              "  -s  do not inline; emit each file as a separate asset\n"
+              "  -n  do not minify\n"
+              "  -w  gzip window bits, 9 to 15 (default)\n");
+      return 1;
+   }
+   scanDir(argv[i], "");
+   qsort(assets, assetsLen, sizeof(Asset), cmpAsset);
+   for(i=0 ; i < assetsLen && minify ; i++)
+   {
+      const char* ext=strrchr(assets[i].path, '.');
+      if(!ext) continue;
+      if(!strcasecmp(ext, ".css"))
+         minifyCss(&assets[i].content);
+      else if(!strcasecmp(ext, ".js") && !strstr(assets[i].path, ".min.js"))
+         minifyLines(&assets[i].content, 1);
+      else if(!strcasecmp(ext, ".html") || !strcasecmp(ext, ".htm"))
+         minifyHtml(&assets[i].content);
+   }
+   if( (index=findAsset("index.html")) == 0 )
+      fatal("index.html not found in", argv[argc-2]);
+   if(!separate)
+      inlineHtml(index);
+   for(i=0 ; i < assetsLen ; i++)
+   {
+      Asset* a=assets+i;
+      if(a->inlined)
+         continue;
+      gzipAsset(a);
+      buildHeader(a, &a->v);
+#ifdef USE_BROTLI
+      if(a->v.encoding)
+         brotliAsset(a);
+#endif
+      if(a->br.encoding)
+         buildHeader(a, &a->br);
+      total+=a->content.len;
+      sent+=a->v.data.len;
+      printf("%-28s %8lu -> %8lu", a->path, (unsigned long)a->content.len,
+             (unsigned long)a->v.data.len);
+      if(a->br.encoding)
+         printf(", br %lu", (unsigned long)a->br.data.len);
+      printf("\n");
+   }
+   printf("Total: %lu -> %lu bytes\n", (unsigned long)total,
+          (unsigned long)sent);
+   emit(argv[argc-1], argv[argc-2]);
+   return 0;
+}
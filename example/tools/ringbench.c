@@ -0,0 +1,191 @@
+/*
+ *     ____             _________                __                _
+ *    / __ \___  ____ _/ /_  __(_)___ ___  ___  / /   ____  ____ _(_)____
+ *   / /_/ / _ \/ __ `/ / / / / / __ `__ \/ _ \/ /   / __ \/ __ `/ / ___/
+ *  / _, _/  __/ /_/ / / / / / / / / / / /  __/ /___/ /_/ / /_/ / / /__
+ * /_/ |_|\___/\__,_/_/ /_/ /_/_/ /_/ /_/\___/_____/\____/\__, /_/\___/
+ *                                                       /____/
+ *
+ *                 SharkSSL Embedded SSL/TLS Stack
+ ****************************************************************************
+ *   PROGRAM MODULE
+ *
+ *   $Id$
+ *
+ *   COPYRIGHT:  Real Time Logic LLC, 2013 - 2020
+ *
+ *   This software is copyrighted by and is the sole property of Real
+ *   Time Logic LLC.  All rights, title, ownership, or other interests in
+ *   the software remain the property of Real Time Logic LLC.  This
+ *   software may only be used in accordance with the terms and
+ *   conditions stipulated in the corresponding license agreement under
+ *   which the software has been supplied.  Any unauthorized use,
+ *   duplication, transmission, distribution, or disclosure of this
+ *   software is expressly forbidden.
+ *
+ *   This Copyright notice may not be removed or modified without prior
+ *   written consent of Real Time Logic LLC.
+ *
+ *   Real Time Logic LLC. reserves the right to modify this software
+ *   without notice.
+ *
+ *               http://sharkssl.com
+ ****************************************************************************
+ *
+ *
+ *  MSRing benchmark: one producer thread pushes N sensor events into
+ *  an MSRing and the consumer (the main thread) pops them in batches
+ *  of 32, as AppCon_deviceNotify does. The tool prints the sustained
+ *  events/s, the number of events received out of order, and the
+ *  number of malloc calls made while the benchmark runs. The -m
+ *  option runs the same test using a mutex protected ring for
+ *  comparison.
+ *
+ *  The producer and consumer yield the CPU when the ring is full or
+ *  empty, thus the tool also runs on a single CPU host, where the two
+ *  threads are time sliced.
+ *
+ *  Build: make ringbench (Linux, GNU ld: malloc is counted using
+ *  -Wl,--wrap=malloc)
+ *
+ *  Usage: ringbench [-m] [events]
+ */
+
+#define _GNU_SOURCE
+#include "MSRing.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+   U16 type;
+   U16 id;
+   S32 value;
+} SensorEvent;
+
+#define RING_SIZE 1024
+#define BATCH 32
+
+static SensorEvent ringBuf[RING_SIZE];
+static MSRing ring;
+static U32 events = 20000000;
+static int useMutex;
+
+/* The mutex protected ring used with -m */
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static U32 mHead, mTail;
+
+static volatile long mallocCalls;
+
+void* __real_malloc(size_t size);
+
+/* Linked with -Wl,--wrap=malloc */
+void*
+__wrap_malloc(size_t size)
+{
+   mallocCalls++;
+   return __real_malloc(size);
+}
+
+
+static BaBool
+mutexPush(const SensorEvent* ev)
+{
+   BaBool ok=FALSE;
+   pthread_mutex_lock(&mutex);
+   if(mTail - mHead < RING_SIZE)
+   {
+      ringBuf[mTail++ & (RING_SIZE-1)] = *ev;
+      ok=TRUE;
+   }
+   pthread_mutex_unlock(&mutex);
+   return ok;
+}
+
+
+static U32
+mutexPop(SensorEvent* ev, U32 max)
+{
+   U32 n=0;
+   pthread_mutex_lock(&mutex);
+   while(mHead != mTail && n < max)
+      ev[n++] = ringBuf[mHead++ & (RING_SIZE-1)];
+   pthread_mutex_unlock(&mutex);
+   return n;
+}
+
+
+static void*
+producer(void* arg)
+{
+   U32 i;
+   SensorEvent ev;
+   (void)arg;
+   ev.type=1;
+   for(i=0 ; i < events ; i++)
+   {
+      ev.id=(U16)i;
+      ev.value=(S32)i;
+      while( ! (useMutex ? mutexPush(&ev) : MSRing_push(&ring, &ev)) )
+         sched_yield(); /* Full */
+   }
+   return 0;
+}
+
+
+static double
+now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+int
+main(int argc, char** argv)
+{
+   pthread_t thread;
+   SensorEvent ev[BATCH];
+   U32 received=0, n, i;
+   long mallocStart;
+   int errors=0;
+   double t;
+   for(i=1 ; i < (U32)argc ; i++)
+   {
+      if( ! strcmp(argv[i], "-m") )
+         useMutex=1;
+      else
+         events=(U32)strtoul(argv[i], 0, 10);
+   }
+   MSRing_constructor(&ring, ringBuf, sizeof(SensorEvent), RING_SIZE);
+   if(pthread_create(&thread, 0, producer, 0))
+   {
+      fprintf(stderr, "Cannot create the producer thread\n");
+      return 1;
+   }
+   mallocStart=mallocCalls;
+   t=now();
+   while(received < events)
+   {
+      n = useMutex ? mutexPop(ev, BATCH) : MSRing_pop(&ring, ev, BATCH);
+      for(i=0 ; i < n ; i++)
+      {
+         if(ev[i].value != (S32)(received+i))
+            errors++;
+      }
+      received+=n;
+      if(!n)
+         sched_yield(); /* Empty */
+   }
+   t=now()-t;
+   pthread_join(thread, 0);
+   printf("%s: %u events in %.2f s, %.1f M events/s, "
+          "order errors %d, malloc calls %ld\n",
+          useMutex ? "mutex ring" : "MSRing", (unsigned)events, t,
+          events/t/1e6, errors, mallocCalls-mallocStart);
+   return errors ? 1 : 0;
+}
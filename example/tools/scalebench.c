@@ -0,0 +1,298 @@
+/*
+ *     ____             _________                __                _
+ *    / __ \___  ____ _/ /_  __(_)___ ___  ___  / /   ____  ____ _(_)____
+ *   / /_/ / _ \/ __ `/ / / / / / __ `__ \/ _ \/ /   / __ \/ __ `/ / ___/
+ *  / _, _/  __/ /_/ / / / / / / / / / / /  __/ /___/ /_/ / /_/ / / /__
+ * /_/ |_|\___/\__,_/_/ /_/ /_/_/ /_/ /_/\___/_____/\____/\__, /_/\___/
+ *                                                       /____/
+ *
+ *                 SharkSSL Embedded SSL/TLS Stack
+ ****************************************************************************
+ *   PROGRAM MODULE
+ *
+ *   $Id$
+ *
+ *   COPYRIGHT:  Real Time Logic LLC, 2013 - 2020
+ *
+ *   This software is copyrighted by and is the sole property of Real
+ *   Time Logic LLC.  All rights, title, ownership, or other interests in
+ *   the software remain the property of Real Time Logic LLC.  This
+ *   software may only be used in accordance with the terms and
+ *   conditions stipulated in the corresponding license agreement under
+ *   which the software has been supplied.  Any unauthorized use,
+ *   duplication, transmission, distribution, or disclosure of this
+ *   software is expressly forbidden.
+ *
+ *   This Copyright notice may not be removed or modified without prior
+ *   written consent of Real Time Logic LLC.
+ *
+ *   Real Time Logic LLC. reserves the right to modify this software
+ *   without notice.
+ *
+ *               http://sharkssl.com
+ ****************************************************************************
+ *
+ *  MSEvLoop worker scaling benchmark: runs 1, 2, 4, ... up to N
+ *  MSEvLoop worker threads sharing the server port with SO_REUSEPORT,
+ *  as the reference example does when built with WORKERS=N, and
+ *  measures the number of connections/s and messages/s the workers
+ *  handle:
+ *    connections/s  the clients open a connection, send an HTTP GET
+ *                   request with "Connection: close", and read the
+ *                   response until the server closes the connection.
+ *    messages/s     each client opens one WebSocket connection and
+ *                   sends a message the server echoes, waiting for
+ *                   the echo before sending the next message.
+ *
+ *  The server runs in a child process and the client threads in the
+ *  parent process, thus the clients and the workers share the CPUs.
+ *  The results show how the workers scale only if the number of CPUs
+ *  is at least the number of workers plus the number of CPUs the
+ *  clients need; the tool prints the number of CPUs online. Use
+ *  taskset to place the tool on a subset of the CPUs.
+ *
+ *  Build: make scalebench (Linux)
+ *
+ *  Usage: scalebench [-w max workers] [-c client threads] [-s seconds]
+ *                    [-p port]
+ */
+
+#include "MSEvLoop.h"
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_CONS 256
+#define BUF_SIZE 1500
+#define MAX_CLIENTS 256
+
+typedef struct {
+   MSEvLoop loop;
+   SOCKET listenSock;
+   void* slab;
+   pthread_t thread;
+} Worker;
+
+static U16 port=9440;
+static int clientThreads=32;
+static int seconds=3;
+static volatile int stop;
+static long counts[MAX_CLIENTS];
+
+
+/************************* The server (child process) ***********************/
+
+static int
+fetchPage(void* hndl, MST* mst, U8* path)
+{
+   static const char page[]="<html><body>Minnow</body></html>";
+   (void)hndl;
+   (void)path;
+   return MST_write(mst, (U8*)page, sizeof(page)-1) < 0 ? -1 : 1;
+}
+
+
+/* Echo the message */
+static int
+onData(MSEvLoop* loop, MSCon* con, U8* data, int len)
+{
+   (void)loop;
+   return len && MS_write(&con->ms, WSOP_Text, data, len) < 0 ? -1 : 0;
+}
+
+
+static void*
+runWorker(void* arg)
+{
+   Worker* w=(Worker*)arg;
+   for(;;)
+      MSEvLoop_run(&w->loop, INFINITE_TMO);
+   return 0;
+}
+
+
+static void
+runServer(int workers)
+{
+   Worker* w=(Worker*)calloc(workers, sizeof(Worker));
+   int i;
+   for(i=0 ; i < workers ; i++)
+   {
+      SOCKET_constructor(&w[i].listenSock, 0);
+      w[i].slab=malloc(MAX_CONS*MSEvLoop_slotSize(BUF_SIZE, BUF_SIZE));
+      if(!w[i].slab || MSEvLoop_bind(&w[i].listenSock, port) ||
+         MSEvLoop_constructor(&w[i].loop, &w[i].listenSock, w[i].slab,
+                              MAX_CONS, BUF_SIZE, BUF_SIZE))
+      {
+         fprintf(stderr, "Cannot start worker %d\n", i);
+         exit(1);
+      }
+      w[i].loop.wph.fetchPage=fetchPage;
+      w[i].loop.onData=onData;
+   }
+   for(i=1 ; i < workers ; i++)
+      pthread_create(&w[i].thread, 0, runWorker, w+i);
+   runWorker(w);
+}
+
+
+/************************* The clients (parent process) *********************/
+
+static int
+dial(void)
+{
+   struct sockaddr_in addr;
+   int one=1;
+   int fd=socket(AF_INET, SOCK_STREAM, 0);
+   if(fd < 0)
+      return -1;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family=AF_INET;
+   addr.sin_port=htons(port);
+   addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+   if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)))
+   {
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+
+static void*
+connClient(void* arg)
+{
+   static const char req[]=
+      "GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+   long id=(long)arg;
+   char buf[4096];
+   while(!stop)
+   {
+      int fd=dial();
+      if(fd < 0)
+         continue;
+      if(write(fd, req, sizeof(req)-1) == sizeof(req)-1)
+      {
+         while(read(fd, buf, sizeof(buf)) > 0);
+         counts[id]++;
+      }
+      close(fd);
+   }
+   return 0;
+}
+
+
+static void*
+msgClient(void* arg)
+{
+   static const char req[]=
+      "GET / HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+      "Connection: Upgrade\r\n"
+      "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+      "Sec-WebSocket-Version: 13\r\n\r\n";
+   /* "hello", masked with 01 02 03 04 */
+   static const U8 frame[]={0x81,0x85,1,2,3,4,'h'^1,'e'^2,'l'^3,'l'^4,'o'^1};
+   long id=(long)arg;
+   char buf[512];
+   int n=0, fd=dial();
+   if(fd < 0)
+      return 0;
+   if(write(fd, req, sizeof(req)-1) != sizeof(req)-1)
+      goto L_close;
+   while(n < 4 || memcmp(buf+n-4, "\r\n\r\n", 4))
+   {
+      if(n == sizeof(buf) || read(fd, buf+n, 1) != 1)
+         goto L_close;
+      n++;
+   }
+   while(!stop)
+   {
+      int got;
+      if(write(fd, frame, sizeof(frame)) != sizeof(frame))
+         break;
+      for(got=0 ; got < 7 ; got+=n) /* The 7 byte echo frame */
+      {
+         if( (n=(int)read(fd, buf, 7-got)) <= 0 )
+            goto L_close;
+      }
+      counts[id]++;
+   }
+  L_close:
+   close(fd);
+   return 0;
+}
+
+
+/* Returns the number of operations per second */
+static long
+runClients(void* (*client)(void*))
+{
+   pthread_t threads[MAX_CLIENTS];
+   long i, total=0;
+   stop=0;
+   memset(counts, 0, sizeof(counts));
+   for(i=0 ; i < clientThreads ; i++)
+      pthread_create(threads+i, 0, client, (void*)i);
+   sleep(seconds);
+   stop=1;
+   for(i=0 ; i < clientThreads ; i++)
+   {
+      pthread_join(threads[i], 0);
+      total+=counts[i];
+   }
+   return total/seconds;
+}
+
+
+int
+main(int argc, char** argv)
+{
+   int maxWorkers=16, workers, i;
+   signal(SIGPIPE, SIG_IGN);
+   for(i=1 ; i+1 < argc ; i+=2)
+   {
+      int val=atoi(argv[i+1]);
+      if( ! strcmp(argv[i], "-w") )
+         maxWorkers=val;
+      else if( ! strcmp(argv[i], "-c") )
+         clientThreads = val > MAX_CLIENTS ? MAX_CLIENTS : val;
+      else if( ! strcmp(argv[i], "-s") )
+         seconds=val;
+      else if( ! strcmp(argv[i], "-p") )
+         port=(U16)val;
+   }
+   if(maxWorkers < 1 || clientThreads < 1 || seconds < 1)
+   {
+      fprintf(stderr, "Invalid argument\n");
+      return 1;
+   }
+   printf("CPUs online: %ld, client threads: %d\n",
+          sysconf(_SC_NPROCESSORS_ONLN), clientThreads);
+   for(workers=1 ; workers <= maxWorkers ; workers*=2)
+   {
+      long conns, msgs;
+      pid_t pid;
+      fflush(stdout);
+      if( (pid=fork()) == 0 )
+         runServer(workers);
+      if(pid < 0)
+         return 1;
+      usleep(200000); /* Wait for the workers to bind */
+      conns=runClients(connClient);
+      msgs=runClients(msgClient);
+      kill(pid, SIGKILL);
+      waitpid(pid, 0, 0);
+      printf("%2d workers: %7ld connections/s, %8ld messages/s\n",
+             workers, conns, msgs);
+   }
+   return 0;
+}
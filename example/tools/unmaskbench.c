@@ -0,0 +1,133 @@
+/*
+ *     ____             _________                __                _
+ *    / __ \___  ____ _/ /_  __(_)___ ___  ___  / /   ____  ____ _(_)____
+ *   / /_/ / _ \/ __ `/ / / / / / __ `__ \/ _ \/ /   / __ \/ __ `/ / ___/
+ *  / _, _/  __/ /_/ / / / / / / / / / / /  __/ /___/ /_/ / /_/ / / /__
+ * /_/ |_|\___/\__,_/_/ /_/ /_/_/ /_/ /_/\___/_____/\____/\__, /_/\___/
+ *                                                       /____/
+ *
+ *                 SharkSSL Embedded SSL/TLS Stack
+ ****************************************************************************
+ *   PROGRAM MODULE
+ *
+ *   $Id$
+ *
+ *   COPYRIGHT:  Real Time Logic LLC, 2013 - 2020
+ *
+ *   This software is copyrighted by and is the sole property of Real
+ *   Time Logic LLC.  All rights, title, ownership, or other interests in
+ *   the software remain the property of Real Time Logic LLC.  This
+ *   software may only be used in accordance with the terms and
+ *   conditions stipulated in the corresponding license agreement under
+ *   which the software has been supplied.  Any unauthorized use,
+ *   duplication, transmission, distribution, or disclosure of this
+ *   software is expressly forbidden.
+ *
+ *   This Copyright notice may not be removed or modified without prior
+ *   written consent of Real Time Logic LLC.
+ *
+ *   Real Time Logic LLC. reserves the right to modify this software
+ *   without notice.
+ *
+ *               http://sharkssl.com
+ ****************************************************************************
+ *
+ *
+ *  WebSocket unmask benchmark: verifies the msUnmask kernel in
+ *  MSLib.c against a byte at a time reference loop using random
+ *  offsets, lengths, and mask phases, and prints the throughput of
+ *  the kernel and the byte loop for 1400 byte and 64 KB payloads.
+ *
+ *  The kernel is selected when MSLib.c is compiled, thus the tool
+ *  includes MSLib.c and is built once for each variant:
+ *    -DMS_NO_SIMD      portable machine word kernel
+ *    (default flags)   SSE2 on x86-64, NEON on ARM with NEON
+ *    -march=native     AVX2 if the build machine supports it
+ *
+ *  Build: make unmaskbench (builds and runs all three variants)
+ *
+ *  Usage: unmaskbench
+ */
+
+#include "MSLib.c"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(MS_UNMASK_AVX2)
+#define KERNEL "AVX2"
+#elif defined(MS_UNMASK_SSE2)
+#define KERNEL "SSE2"
+#elif defined(MS_UNMASK_NEON)
+#define KERNEL "NEON"
+#else
+#define KERNEL "word"
+#endif
+
+#define BUF_SIZE (65536+64)
+
+static U8 data[BUF_SIZE];
+static U8 ref[BUF_SIZE];
+
+
+/* The byte at a time loop msUnmask replaced */
+static void
+byteUnmask(U8* d, int len, const U8* mask, int ix)
+{
+   int i;
+   for(i=0 ; i < len ; i++)
+      d[i] ^= mask[(i+ix) & 3];
+}
+
+
+static double
+now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+int
+main(void)
+{
+   static const int sizes[]={1400, 65536};
+   const U8 mask[4]={0x12,0x34,0x56,0x78};
+   int i, j;
+   srand(1);
+   for(i=0 ; i < 20000 ; i++)
+   {
+      int off=rand()%64, len=rand()%3000, ix=rand()%100;
+      for(j=0 ; j < off+len ; j++)
+         data[j]=ref[j]=(U8)rand();
+      msUnmask(data+off, len, mask, ix);
+      byteUnmask(ref+off, len, mask, ix);
+      if(memcmp(data, ref, off+len))
+      {
+         printf("%s: mismatch, offset %d, length %d, phase %d\n",
+                KERNEL, off, len, ix);
+         return 1;
+      }
+   }
+   for(i=0 ; i < 2 ; i++)
+   {
+      int len=sizes[i];
+      int iters=(int)(2e9/len);
+      double t0, t1, t2;
+      t0=now();
+      for(j=0 ; j < iters ; j++)
+         msUnmask(data+1, len, mask, j);
+      t1=now();
+      for(j=0 ; j < iters/8 ; j++)
+      {
+         byteUnmask(ref+1, len, mask, j);
+         __asm__ volatile("" : : "r"(ref) : "memory"); /* Not vectorized */
+      }
+      t2=now();
+      printf("%s: %5d B: kernel %.1f GB/s, byte loop %.1f GB/s\n",
+             KERNEL, len, (double)len*iters/(t1-t0)/1e9,
+             (double)len*(iters/8)/(t2-t1)/1e9);
+   }
+   return 0;
+}
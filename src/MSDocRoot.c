@@ -0,0 +1,324 @@
+/**
+ *     ____             _________                __                _
+ *    / __ \___  ____ _/ /_  __(_)___ ___  ___  / /   ____  ____ _(_)____
+ *   / /_/ / _ \/ __ `/ / / / / / __ `__ \/ _ \/ /   / __ \/ __ `/ / ___/
+ *  / _, _/  __/ /_/ / / / / / / / / / / /  __/ /___/ /_/ / /_/ / / /__
+ * /_/ |_|\___/\__,_/_/ /_/ /_/_/ /_/ /_/\___/_____/\____/\__, /_/\___/
+ *                                                       /____/
+ *
+ *                 SharkSSL Embedded SSL/TLS Stack
+ ****************************************************************************
+ *   PROGRAM MODULE
+ *
+ *   $Id$
+ *
+ *   COPYRIGHT:  Real Time Logic LLC, 2013 - 2020
+ *
+ *   This software is copyrighted by and is the sole property of Real
+ *   Time Logic LLC.  All rights, title, ownership, or other interests in
+ *   the software remain the property of Real Time Logic LLC.  This
+ *   software may only be used in accordance with the terms and
+ *   conditions stipulated in the corresponding license agreement under
+ *   which the software has been supplied.  Any unauthorized use,
+ *   duplication, transmission, distribution, or disclosure of this
+ *   software is expressly forbidden.
+ *
+ *   This Copyright notice may not be removed or modified without prior
+ *   written consent of Real Time Logic LLC.
+ *
+ *   Real Time Logic LLC. reserves the right to modify this software
+ *   without notice.
+ *
+ *               http://sharkssl.com
+ ****************************************************************************
+*/
+
+#if defined(__linux__) || defined(__APPLE__)
+
+#include "MSDocRoot.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+
+static const char* const msDocTypes[]={
+   ".html", "text/html; charset=UTF-8",
+   ".htm", "text/html; charset=UTF-8",
+   ".css", "text/css",
+   ".js", "application/javascript",
+   ".json", "application/json",
+   ".svg", "image/svg+xml",
+   ".png", "image/png",
+   ".jpg", "image/jpeg",
+   ".jpeg", "image/jpeg",
+   ".gif", "image/gif",
+   ".ico", "image/x-icon",
+   ".woff", "font/woff",
+   ".woff2", "font/woff2",
+   ".txt", "text/plain; charset=UTF-8",
+   0
+};
+
+
+static const char*
+MSDocRoot_contentType(const char* path)
+{
+   const char* ext=strrchr(path, '.');
+   int i;
+   if(ext && !strchr(ext, '/'))
+   {
+      for(i=0 ; msDocTypes[i] ; i+=2)
+      {
+         if(!strcmp(ext, msDocTypes[i]))
+            return msDocTypes[i+1];
+      }
+   }
+   return "application/octet-stream";
+}
+
+
+/* Add 'n' as a hex number to 'dest' */
+static char*
+msDocHex(char* dest, U32 n)
+{
+   int shift=28;
+   while(shift && !(n >> shift)) shift-=4;
+   for( ; shift >= 0 ; shift-=4)
+      *dest++ = "0123456789abcdef"[(n >> shift) & 15];
+   return dest;
+}
+
+
+static void
+MSDocFile_close(MSDocFile* f)
+{
+   if(f->fd >= 0)
+      close(f->fd);
+   f->fd=-1;
+}
+
+
+void
+MSDocRoot_constructor(MSDocRoot* o, const char* root,
+                      MSDocFile* files, U16 filesLen)
+{
+   U16 i;
+   memset(o, 0, sizeof(MSDocRoot));
+   memset(files, 0, sizeof(MSDocFile)*filesLen);
+   for(i=0 ; i < filesLen ; i++)
+      files[i].fd=-1;
+   o->root=root;
+   o->files=files;
+   o->filesLen=filesLen;
+   o->cacheControl="no-cache";
+   o->statTmo=1;
+}
+
+
+void
+MSDocRoot_destructor(MSDocRoot* o)
+{
+   U16 i;
+   for(i=0 ; i < o->filesLen ; i++)
+   {
+      MSDocFile_close(o->files+i);
+      o->files[i].path[0]=0;
+   }
+}
+
+
+/* Returns the cache entry for file 'path' + 'suffix'. The entry's fd
+ * is -1 if the file does not exist. Returns NULL if the name is too
+ * long.
+ */
+static MSDocFile*
+MSDocRoot_open(MSDocRoot* o, const char* path, const char* suffix)
+{
+   char name[MSDOC_MAX_PATH];
+   char fullName[512];
+   struct stat st;
+   MSDocFile* f=0;
+   U32 now=baGetUnixTime();
+   int i;
+   int plen=(int)strlen(path);
+   int slen=(int)strlen(suffix);
+   int rlen=(int)strlen(o->root);
+   if(plen+slen >= MSDOC_MAX_PATH || rlen+plen+slen >= (int)sizeof(fullName))
+      return 0;
+   memcpy(name, path, plen);
+   strcpy(name+plen, suffix);
+   for(i=0 ; i < o->filesLen ; i++)
+   {
+      if(!strcmp(o->files[i].path, name))
+      {
+         f=o->files+i;
+         if(now - f->checked < o->statTmo)
+         {
+            f->lastUse=++o->useCounter;
+            return f;
+         }
+         break;
+      }
+   }
+   if(!f)
+   {  /* Use a free entry or replace the least recently used entry */
+      f=o->files;
+      for(i=0 ; i < o->filesLen && f->path[0] ; i++)
+      {
+         if(!o->files[i].path[0] || o->files[i].lastUse < f->lastUse)
+            f=o->files+i;
+      }
+      MSDocFile_close(f);
+      strcpy(f->path, name);
+   }
+   f->checked=now;
+   f->lastUse=++o->useCounter;
+   memcpy(fullName, o->root, rlen);
+   strcpy(fullName+rlen, name);
+   if(stat(fullName, &st) || !S_ISREG(st.st_mode))
+   {
+      MSDocFile_close(f);
+      return f;
+   }
+   if(f->fd >= 0 && f->size == (U32)st.st_size &&
+      f->mtime == (U32)st.st_mtime && f->ino == (U32)st.st_ino)
+   {
+      return f; /* Not modified */
+   }
+   MSDocFile_close(f);
+   if( (f->fd=open(fullName, O_RDONLY|O_CLOEXEC)) >= 0 )
+   {
+      char* ptr=f->etag;
+      f->size=(U32)st.st_size;
+      f->mtime=(U32)st.st_mtime;
+      f->ino=(U32)st.st_ino;
+      *ptr++='"';
+      ptr=msDocHex(ptr, f->mtime);
+      *ptr++='-';
+      ptr=msDocHex(ptr, f->size);
+      *ptr++='-';
+      ptr=msDocHex(ptr, f->ino);
+      *ptr++='"';
+      *ptr=0;
+   }
+   return f;
+}
+
+
+/* Send the header in the send buffer followed by 'len' bytes at
+ * 'offset' in file 'fd'.
+ */
+static int
+MSDocRoot_send(MST* mst, int fd, int hlen, U32 offset, U32 len)
+{
+   U8* buf;
+   int n=hlen;
+#ifdef __linux__
+   if(!mst->isSecure)
+   {
+      off_t off=(off_t)offset;
+      /* The header, and data queued by MSTxQ, must be sent first */
+      if(MST_write(mst, 0, hlen) < 0 || MST_drain(mst))
+         return MS_ERR_WRITE;
+      while(len)
+      {
+         ssize_t sent=sendfile(mst->sock->hndl, fd, &off, len);
+         if(sent <= 0)
+         {
+            if(sent < 0 && errno == EINTR)
+               continue;
+            return MS_ERR_WRITE; /* Socket error or file truncated */
+         }
+         len-=(U32)sent;
+      }
+      return 0;
+   }
+#endif
+   /* Copy the file through the send buffer */
+   buf=MST_getSendBufPtr(mst);
+   while(len)
+   {
+      int size=MST_getSendBufSize(mst)-n;
+      ssize_t rd=pread(fd, buf+n, len < (U32)size ? len : (U32)size,
+                       (off_t)offset);
+      if(rd <= 0)
+      {
+         if(rd < 0 && errno == EINTR)
+            continue;
+         return MS_ERR_WRITE;
+      }
+      n+=(int)rd;
+      offset+=(U32)rd;
+      len-=(U32)rd;
+      if(MST_write(mst, 0, n) < 0)
+         return MS_ERR_WRITE;
+      n=0;
+      buf=MST_getSendBufPtr(mst);
+   }
+   return n && MST_write(mst, 0, n) < 0 ? MS_ERR_WRITE : 0;
+}
+
+
+int
+msDocRootFetchPage(void* hndl, MST* mst, U8* path)
+{
+   MSDocRoot* o=(MSDocRoot*)hndl;
+   char name[MSDOC_MAX_PATH];
+   MSDocFile* f=0;
+   MSAsset a;
+   U32 offset,len;
+   int i,hlen;
+   if(*path != '/')
+      return 0;
+   /* Copy the path without the query string */
+   for(i=0 ; path[i] && path[i] != '?' ; i++)
+   {
+      if(i >= MSDOC_MAX_PATH-11) /* Room for "index.html" */
+         return 0;
+      if(path[i] == '/' && path[i+1] == '.')
+         return 0; /* "..", ".", and hidden files */
+      name[i]=(char)path[i];
+   }
+   if(name[i-1] == '/')
+   {
+      strcpy(name+i, "index.html");
+      i+=10;
+   }
+   else
+      name[i]=0;
+   memset(&a, 0, sizeof(MSAsset));
+   if(MST_acceptEncoding(mst, "br") &&
+      (f=MSDocRoot_open(o, name, ".br")) != 0 && f->fd >= 0)
+   {
+      a.encoding="br";
+   }
+   else if(MST_acceptEncoding(mst, "gzip") &&
+           (f=MSDocRoot_open(o, name, ".gz")) != 0 && f->fd >= 0)
+   {
+      a.encoding="gzip";
+   }
+   else if( (f=MSDocRoot_open(o, name, "")) == 0 || f->fd < 0 )
+      return 0; /* Not found */
+   if(o->maxSize && f->size > o->maxSize)
+   {
+      xprintf(("%s: larger than MSDocRoot:maxSize\n", name));
+      return 0;
+   }
+   a.path=name;
+   a.len=f->size;
+   a.contentType=MSDocRoot_contentType(name);
+   a.etag=f->etag;
+   a.cacheControl=o->cacheControl;
+   hlen=MST_respAsset(mst, &a, (const U8*)"\r\nVary: Accept-Encoding",
+                      &offset, &len);
+   if(hlen < 0)
+      return hlen;
+   return MSDocRoot_send(mst, f->fd, hlen, offset, len) ? MS_ERR_WRITE : 1;
+}
+
+#endif /* __linux__ || __APPLE__ */
@@ -0,0 +1,168 @@
+/*
+ *     ____             _________                __                _
+ *    / __ \___  ____ _/ /_  __(_)___ ___  ___  / /   ____  ____ _(_)____
+ *   / /_/ / _ \/ __ `/ / / / / / __ `__ \/ _ \/ /   / __ \/ __ `/ / ___/
+ *  / _, _/  __/ /_/ / / / / / / / / / / /  __/ /___/ /_/ / /_/ / / /__
+ * /_/ |_|\___/\__,_/_/ /_/ /_/_/ /_/ /_/\___/_____/\____/\__, /_/\___/
+ *                                                       /____/
+ *
+ *                 SharkSSL Embedded SSL/TLS Stack
+ ****************************************************************************
+ *			      HEADER
+ *
+ *   $Id$
+ *
+ *   COPYRIGHT:  Real Time Logic LLC, 2013 - 2020
+ *
+ *   This software is copyrighted by and is the sole property of Real
+ *   Time Logic LLC.  All rights, title, ownership, or other interests in
+ *   the software remain the property of Real Time Logic LLC.  This
+ *   software may only be used in accordance with the terms and
+ *   conditions stipulated in the corresponding license agreement under
+ *   which the software has been supplied.  Any unauthorized use,
+ *   duplication, transmission, distribution, or disclosure of this
+ *   software is expressly forbidden.
+ *
+ *   This Copyright notice may not be removed or modified without prior
+ *   written consent of Real Time Logic LLC.
+ *
+ *   Real Time Logic LLC. reserves the right to modify this software
+ *   without notice.
+ *
+ *               http://sharkssl.com
+ ****************************************************************************
+ *
+ *
+ *  Minnow Server: static files in a document root directory (POSIX)
+ */
+
+#ifndef _MSDocRoot_h
+#define _MSDocRoot_h
+
+#include "MSLib.h"
+
+/** @addtogroup MSLib
+@{
+*/
+
+/** @defgroup MSDocRoot Document Root
+    @ingroup MSLib
+
+    \brief Serve the files in a directory.
+
+    The #MSRouteTable serves assets compiled into the firmware. The
+    document root instead maps a request path such as "/css/style.css"
+    to a file in a directory, thus the web application can be updated
+    without rebuilding the server. Set WssProtocolHandshake#fetchPage
+    to #msDocRootFetchPage and WssProtocolHandshake#fetchPageHndl to
+    the #MSDocRoot instance.
+
+    Open files and their stat results are kept in a cache of
+    #MSDocFile entries. A file found in the cache is checked for
+    changes at most once every MSDocRoot#statTmo seconds.
+
+    A precompressed file "name.br" or "name.gz" next to the file
+    "name" is sent, with the matching Content-Encoding, to clients
+    accepting the encoding. The uncompressed file is optional if all
+    clients accept the encoding.
+
+    Non secure connections send the file with the Linux sendfile
+    system call. Secure (SharkSSL) connections, and other POSIX
+    systems, read the file into the send buffer. The file is sent
+    using blocking calls; in an #MSEvLoop this stalls all of the
+    loop's connections while a slow client receives the file. Set
+    MSDocRoot#maxSize to limit the stall.
+
+    The response supports ETag revalidation (304) and Range requests
+    (206). The path is not URL decoded, and paths with a segment
+    starting with '.', such as "/../x" or "/.htpasswd", are not found.
+
+    <b>Example code:</b>
+    \code
+    static MSDocFile files[32];
+    static MSDocRoot docRoot;
+    MSDocRoot_constructor(&docRoot, "/usr/share/www", files, 32);
+    wph.fetchPage = msDocRootFetchPage;
+    wph.fetchPageHndl = &docRoot;
+    \endcode
+@{
+*/
+
+/** Maximum request path length including the .br/.gz suffix. Longer
+    paths are not found.
+*/
+#ifndef MSDOC_MAX_PATH
+#define MSDOC_MAX_PATH 128
+#endif
+
+/** A cached file */
+typedef struct {
+   /* Private members */
+   char path[MSDOC_MAX_PATH]; /* Request path + suffix, empty if free */
+   char etag[32];
+   int fd; /* -1: not found */
+   U32 size;
+   U32 mtime;
+   U32 ino;
+   U32 checked; /* baGetUnixTime() when last stat'ed */
+   U32 lastUse; /* LRU replacement */
+} MSDocFile;
+
+/** The document root */
+typedef struct {
+   /** In param: the Cache-Control response header value. The
+       constructor sets "no-cache", which makes the browser revalidate
+       the files using the ETag. Set to NULL to not send the header.
+   */
+   const char* cacheControl;
+   /** In param: the number of seconds a cached stat result is used.
+       The constructor sets 1. Set to zero to check the file for each
+       request.
+   */
+   U16 statTmo;
+   /** In param: files larger than maxSize bytes are not found. The
+       constructor sets zero, no limit. Set a limit, such as 256
+       Kbytes, when the document root is used by an #MSEvLoop.
+   */
+   U32 maxSize;
+
+   /* Private members */
+   const char* root;
+   MSDocFile* files;
+   U32 useCounter;
+   U16 filesLen;
+} MSDocRoot;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Create a document root.
+    \param o the MSDocRoot instance.
+    \param root the directory, without a trailing slash.
+    \param files an array of 'filesLen' cache entries. Each entry
+    keeps a file descriptor open, and a missing file also uses an
+    entry, thus a small cache performs well.
+    \param filesLen the number of entries in 'files'.
+ */
+void MSDocRoot_constructor(MSDocRoot* o, const char* root,
+                           MSDocFile* files, U16 filesLen);
+
+/** Close the cached files. */
+void MSDocRoot_destructor(MSDocRoot* o);
+
+/** A #MSFetchPage callback serving the files in the #MSDocRoot
+    'hndl'. A path ending with '/' serves the directory's index.html.
+ */
+int msDocRootFetchPage(void* hndl, MST* mst, U8* path);
+
+#ifdef __cplusplus
+}
+#endif
+
+/** @} */ /* end group MSDocRoot */
+
+/** @} */ /* end group MSLib */
+
+#endif
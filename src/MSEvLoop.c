@@ -0,0 +1,677 @@
+/**
+ *     ____             _________                __                _
+ *    / __ \___  ____ _/ /_  __(_)___ ___  ___  / /   ____  ____ _(_)____
+ *   / /_/ / _ \/ __ `/ / / / / / __ `__ \/ _ \/ /   / __ \/ __ `/ / ___/
+ *  / _, _/  __/ /_/ / / / / / / / / / / /  __/ /___/ /_/ / /_/ / / /__
+ * /_/ |_|\___/\__,_/_/ /_/ /_/_/ /_/ /_/\___/_____/\____/\__, /_/\___/
+ *                                                       /____/
+ *
+ *                 SharkSSL Embedded SSL/TLS Stack
+ ****************************************************************************
+ *   PROGRAM MODULE
+ *
+ *   $Id$
+ *
+ *   COPYRIGHT:  Real Time Logic LLC, 2013 - 2020
+ *
+ *   This software is copyrighted by and is the sole property of Real
+ *   Time Logic LLC.  All rights, title, ownership, or other interests in
+ *   the software remain the property of Real Time Logic LLC.  This
+ *   software may only be used in accordance with the terms and
+ *   conditions stipulated in the corresponding license agreement under
+ *   which the software has been supplied.  Any unauthorized use,
+ *   duplication, transmission, distribution, or disclosure of this
+ *   software is expressly forbidden.
+ *
+ *   This Copyright notice may not be removed or modified without prior
+ *   written consent of Real Time Logic LLC.
+ *
+ *   Real Time Logic LLC. reserves the right to modify this software
+ *   without notice.
+ *
+ *               http://sharkssl.com
+ ****************************************************************************
+*/
+
+#ifdef __linux__
+
+#include "MSEvLoop.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stddef.h>
+#include <time.h>
+
+/* The BSD porting layer stores the file descriptor in SOCKET:hndl */
+#define MSEvLoop_fd(sock) (sock)->hndl
+
+#if MSEVLOOP_WHEEL_LEVELS < 1 || MSEVLOOP_WHEEL_LEVELS > 5
+#error MSEVLOOP_WHEEL_LEVELS must be 1 to 5
+#endif
+#define WHEEL_BITS 6
+#define WHEEL_MASK 63
+/* Max ticks covered by the wheel */
+#define WHEEL_RANGE ((U32)1 << (WHEEL_BITS*MSEVLOOP_WHEEL_LEVELS))
+
+
+/* Monotonic time in ticks */
+static U32
+MSEvLoop_ticks(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (U32)(((unsigned long long)ts.tv_sec*1000 + ts.tv_nsec/1000000) /
+                MSEVLOOP_TICK);
+}
+
+
+/* Insert the timer in the slot for t->expires. A timer expiring within
+ * 64 ticks is in level 0, which is processed one slot per tick; the
+ * timers in a higher level slot are moved to the lower levels when
+ * the level below wraps around (MSEvLoop_runTimers).
+ */
+static void
+MSEvLoop_addTimer(MSEvLoop* o, MSTimer* t)
+{
+   MSTimer** slot;
+   U32 delta = t->expires - o->tick;
+   if((S32)delta < 0) /* Already expired: run at the next tick */
+      slot = &o->wheel[0][o->tick & WHEEL_MASK];
+   else
+   {
+      int level=0;
+      if(delta >= WHEEL_RANGE)
+         t->expires = o->tick + WHEEL_RANGE - 1;
+      while(level < MSEVLOOP_WHEEL_LEVELS-1 &&
+            delta >= ((U32)1 << (WHEEL_BITS*(level+1))))
+      {
+         level++;
+      }
+      slot = &o->wheel[level][(t->expires >> (WHEEL_BITS*level))&WHEEL_MASK];
+   }
+   if( (t->next = *slot) != 0 )
+      t->next->prev = &t->next;
+   *slot=t;
+   t->prev=slot;
+}
+
+
+static void
+MSEvLoop_unlinkTimer(MSTimer* t)
+{
+   if( (*t->prev = t->next) != 0 )
+      t->next->prev = t->prev;
+   t->prev=0;
+}
+
+
+void
+MSEvLoop_startTimer(MSEvLoop* o, MSTimer* t, U32 ms)
+{
+   U32 now=MSEvLoop_ticks();
+   if(MSTimer_isActive(t))
+      MSEvLoop_unlinkTimer(t);
+   else if(o->timerCount++ == 0)
+      o->tick=now; /* Wheel empty: skip the idle ticks */
+   t->expires = now + (ms + MSEVLOOP_TICK - 1) / MSEVLOOP_TICK;
+   MSEvLoop_addTimer(o, t);
+}
+
+
+void
+MSEvLoop_stopTimer(MSEvLoop* o, MSTimer* t)
+{
+   if(MSTimer_isActive(t))
+   {
+      MSEvLoop_unlinkTimer(t);
+      o->timerCount--;
+   }
+}
+
+
+/* Process the ticks up to now and run the expired timers */
+static void
+MSEvLoop_runTimers(MSEvLoop* o)
+{
+   U32 now=MSEvLoop_ticks();
+   if(!o->timerCount)
+   {
+      o->tick=now;
+      return;
+   }
+   while((S32)(now - o->tick) >= 0)
+   {
+      MSTimer* t;
+      MSTimer** slot;
+      U32 ix = o->tick & WHEEL_MASK;
+      int level;
+      /* Cascade: level N-1 wrapped, move the timers in level N's
+       * current slot down.
+       */
+      for(level=1 ; !ix && level < MSEVLOOP_WHEEL_LEVELS ; level++)
+      {
+         ix = (o->tick >> (WHEEL_BITS*level)) & WHEEL_MASK;
+         slot = &o->wheel[level][ix];
+         t = *slot;
+         *slot=0;
+         while(t)
+         {
+            MSTimer* next=t->next;
+            MSEvLoop_addTimer(o, t);
+            t=next;
+         }
+      }
+      slot = &o->wheel[0][o->tick & WHEEL_MASK];
+      o->tick++; /* Timers started by the callbacks expire at the next tick */
+      while( (t = *slot) != 0 )
+      {
+         MSEvLoop_unlinkTimer(t);
+         o->timerCount--;
+         t->callback(o, t);
+      }
+   }
+}
+
+
+/* Returns the time in milliseconds until the next timer expires, or
+ * INFINITE_TMO if no timer is running.
+ */
+static U32
+MSEvLoop_nextTimer(MSEvLoop* o)
+{
+   int level,i;
+   S32 delta;
+   U32 expires=0;
+   BaBool found=FALSE;
+   if(!o->timerCount)
+      return INFINITE_TMO;
+   /* The first non empty slot in each level holds the level's
+    * earliest timer, but a higher level may expire first. The current
+    * slot in a level above 0 holds timers for the next lap only once
+    * cascaded, thus it is then searched last.
+    */
+   for(level=0 ; level < MSEVLOOP_WHEEL_LEVELS ; level++)
+   {
+      U32 ix = (o->tick >> (WHEEL_BITS*level)) & WHEEL_MASK;
+      BaBool cascaded = (o->tick & (((U32)1 << (WHEEL_BITS*level))-1)) != 0;
+      for(i = cascaded ? 1 : 0 ; i <= 64 ; i++)
+      {
+         MSTimer* t = o->wheel[level][(ix+i) & WHEEL_MASK];
+         if(t)
+         {
+            for( ; t ; t=t->next)
+            {
+               if(!found || (S32)(t->expires - expires) < 0)
+                  expires=t->expires;
+               found=TRUE;
+            }
+            break;
+         }
+      }
+   }
+   delta = (S32)(expires - MSEvLoop_ticks());
+   return delta > 0 ? (U32)delta*MSEVLOOP_TICK : 0;
+}
+
+
+static int
+MSEvLoop_ctl(MSEvLoop* o, int op, MSCon* con, int fd)
+{
+   struct epoll_event ev;
+   memset(&ev, 0, sizeof(ev));
+   ev.events = con && con->pollOut ? EPOLLIN|EPOLLOUT : EPOLLIN;
+   ev.data.ptr = con; /* NULL for the listen socket */
+   return epoll_ctl(o->epfd, op, fd, &ev);
+}
+
+
+int
+MSEvLoop_constructor(MSEvLoop* o, SOCKET* listenSock,
+                     void* slab, int maxCons,
+                     U16 recBufSize, U16 sendBufSize)
+{
+   int i;
+   memset(o, 0, sizeof(MSEvLoop));
+   o->listenSock=listenSock;
+   o->slab=(U8*)slab;
+   o->slotSize=(int)MSEvLoop_slotSize(recBufSize, sendBufSize);
+   o->maxCons=maxCons;
+   /* Link the slots in index order */
+   for(i=maxCons-1 ; i >= 0 ; i--)
+   {
+      MSCon* con = MSEvLoop_getCon(o, i);
+      memset(con, 0, sizeof(MSCon));
+      con->nextFree=o->freeList;
+      o->freeList=con;
+   }
+   o->recBufSize=recBufSize;
+   o->sendBufSize=sendBufSize;
+   o->tick=MSEvLoop_ticks();
+   o->evfd=-1;
+   if( (o->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 )
+      return -1;
+   /* Non blocking: MSEvLoop_sockAccept returns if the client is gone */
+   i=fcntl(MSEvLoop_fd(listenSock), F_GETFL);
+   if(i < 0 || fcntl(MSEvLoop_fd(listenSock), F_SETFL, i|O_NONBLOCK) ||
+      MSEvLoop_ctl(o, EPOLL_CTL_ADD, 0, MSEvLoop_fd(listenSock)) ||
+      (o->evfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0)
+   {
+      MSEvLoop_destructor(o);
+      return -1;
+   }
+   else
+   {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.ptr = o; /* Not a MSCon */
+      if(epoll_ctl(o->epfd, EPOLL_CTL_ADD, o->evfd, &ev))
+      {
+         MSEvLoop_destructor(o);
+         return -1;
+      }
+   }
+   return 0;
+}
+
+
+void
+MSEvLoop_notify(MSEvLoop* o, U32 events)
+{
+   static const unsigned long long one=1;
+   __atomic_fetch_or(&o->notifyEvents, events, __ATOMIC_SEQ_CST);
+   /* EAGAIN: the counter is saturated and the loop is awake anyway */
+   if(write(o->evfd, &one, sizeof(one)) < 0)
+      return;
+}
+
+
+/* Reset the eventfd and call onNotify */
+static void
+MSEvLoop_notified(MSEvLoop* o)
+{
+   unsigned long long cnt;
+   U32 events;
+   if(read(o->evfd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+      return;
+   events = __atomic_exchange_n(&o->notifyEvents, 0, __ATOMIC_SEQ_CST);
+   if(events && o->onNotify)
+      o->onNotify(o, events);
+}
+
+
+void
+MSEvLoop_setTxQueue(MSEvLoop* o, U8* buf, int size,
+                    int highWater, int lowWater)
+{
+   o->txqBuf=buf;
+   o->txqSize=size;
+   o->highWater=highWater;
+   o->lowWater=lowWater;
+}
+
+
+/* MSTxQ callback: data queued, wait for the socket to become writable */
+static void
+MSEvLoop_txqPending(MSTxQ* q, void* arg)
+{
+   MSEvLoop* o = (MSEvLoop*)arg;
+   MSCon* con = (MSCon*)((U8*)q - offsetof(MSCon, txq));
+   if(!con->pollOut)
+   {
+      con->pollOut=TRUE;
+      MSEvLoop_ctl(o, EPOLL_CTL_MOD, con, MSEvLoop_fd(&con->sock));
+   }
+}
+
+
+static void
+MSEvLoop_release(MSEvLoop* o, MSCon* con, int status)
+{
+   /* Send the queued data the socket takes without blocking and drop
+      the rest: the peer may be too slow or dead.
+   */
+   if(se_sockValid(&con->sock))
+      MST_flush(&con->ms.mst);
+   MSEvLoop_stopTimer(o, &con->timer);
+   if(se_sockValid(&con->sock))
+      MSEvLoop_ctl(o, EPOLL_CTL_DEL, con, MSEvLoop_fd(&con->sock));
+   if(con->state == MSConState_WebSocket && o->onClose)
+      o->onClose(o, con, status);
+   se_close(&con->sock);
+   MS_destructor(&con->ms);
+#ifdef MS_SEC
+   if(con->ms.mst.isSecure)
+      SharkSsl_terminateCon(o->sharkSsl, con->ms.mst.u.sc);
+#endif
+   con->state=MSConState_Free;
+   con->nextFree=o->freeList;
+   o->freeList=con;
+   o->conCount--;
+}
+
+
+void
+MSEvLoop_close(MSEvLoop* o, MSCon* con, int statusCode)
+{
+   if(con->state == MSConState_Free)
+      return;
+   if(con->state == MSConState_WebSocket && statusCode)
+      statusCode=MS_close(&con->ms, statusCode);
+   MSEvLoop_release(o, con, statusCode);
+}
+
+
+/* Half close the connection after the last HTTP response and wait
+ * for the client to close it. The connection is released by
+ * MSEvLoop_readable when the client closes, or by MSEvLoop_conTimeout
+ * when the deadline expires.
+ */
+static void
+MSEvLoop_linger(MSEvLoop* o, MSCon* con, int status)
+{
+   if(MST_shutdown(&con->ms.mst))
+   {
+      MSEvLoop_release(o, con, status);
+      return;
+   }
+   con->state=MSConState_Linger;
+   MSEvLoop_startTimer(o, &con->timer, MSEVLOOP_LINGER_TMO);
+}
+
+
+/* MSTimer callback for MSCon:timer */
+static void
+MSEvLoop_conTimeout(MSEvLoop* o, MSTimer* t)
+{
+   MSCon* con = (MSCon*)((U8*)t - offsetof(MSCon, timer));
+   if(con->state == MSConState_WebSocket)
+   {  /* Ping interval */
+      if((S32)(con->lastRec - con->pingSent) < 0)
+      {  /* Nothing received since the previous ping */
+         MSEvLoop_release(o, con, MS_ERR_READ_TMO);
+         return;
+      }
+      con->pingSent=o->tick;
+      MS_prepSend(&con->ms, FALSE, 0);
+      if(MS_send(&con->ms, WSOP_Ping, 0) < 0)
+         MSEvLoop_release(o, con, MS_ERR_WRITE);
+      else
+         MSEvLoop_startTimer(o, t, (U32)o->pingInterval*1000);
+   }
+   else /* Request, keep-alive, or linger deadline */
+      MSEvLoop_release(o, con, MS_ERR_READ_TMO);
+}
+
+
+void
+MSEvLoop_destructor(MSEvLoop* o)
+{
+   int i;
+   for(i=0 ; i < o->maxCons ; i++)
+      MSEvLoop_close(o, MSEvLoop_getCon(o, i), 1001); /* 1001: going away */
+   if(o->epfd >= 0)
+      close(o->epfd);
+   if(o->evfd >= 0)
+      close(o->evfd);
+   o->epfd=o->evfd=-1;
+}
+
+
+int
+MSEvLoop_bind(SOCKET* sock, U16 port)
+{
+   struct sockaddr_in addr;
+   int enable=1;
+   int fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, IPPROTO_TCP);
+   if(fd < 0)
+      return -1;
+   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+   if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)))
+   {
+      close(fd);
+      return -1;
+   }
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   addr.sin_addr.s_addr = htonl(INADDR_ANY);
+   if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)))
+   {
+      int err=errno;
+      close(fd);
+      return err == EADDRINUSE ? -3 : -2;
+   }
+   if(listen(fd, SOMAXCONN))
+   {
+      close(fd);
+      return -2;
+   }
+   MSEvLoop_fd(sock)=fd;
+   return 0;
+}
+
+
+/* Accept a connection on the listen socket reported readable by epoll.
+ * se_accept is not used since select() cannot wait for a socket
+ * descriptor >= FD_SETSIZE. Returns 1 when a connection was accepted,
+ * 0 if none is pending, or -1 if the listen socket failed.
+ */
+static int
+MSEvLoop_sockAccept(MSEvLoop* o, SOCKET* sock)
+{
+   int fd;
+   while( (fd=accept(MSEvLoop_fd(o->listenSock), 0, 0)) < 0 )
+   {
+      if(errno == EINTR) continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK ||
+         errno == ECONNABORTED ? 0 : -1;
+   }
+   MSEvLoop_fd(sock)=fd;
+   return 1;
+}
+
+
+/* Accept one connection and bind it to the first slot in the free
+ * list. Returns 1 when a connection was accepted, 0 if the accept
+ * call had nothing to do, and a negative value if the listen socket
+ * failed.
+ */
+static int
+MSEvLoop_accept(MSEvLoop* o)
+{
+   int rc;
+   MSCon* con=o->freeList;
+   if(!con)
+   {  /* Accept and drop: the listen socket is level triggered */
+      SOCKET sock;
+      SOCKET_constructor(&sock, 0);
+      if( (rc=MSEvLoop_sockAccept(o, &sock)) == 1 )
+      {
+         xprintf(("Max connections (%d) reached\n", o->maxCons));
+         se_close(&sock);
+         return 0;
+      }
+      return rc;
+   }
+   o->freeList=con->nextFree;
+   memset(con, 0, sizeof(MSCon));
+   SOCKET_constructor(&con->sock, 0);
+   if( (rc=MSEvLoop_sockAccept(o, &con->sock)) != 1 )
+      goto L_free;
+   MS_constructor(&con->ms);
+#ifdef MS_SEC
+   if(o->sharkSsl)
+   {
+      SharkSslCon* scon = SharkSsl_createCon(o->sharkSsl);
+      if(!scon)
+      {
+         se_close(&con->sock);
+         rc=0;
+         goto L_free;
+      }
+      MS_setSharkCon(&con->ms, scon, &con->sock);
+   }
+   else
+#endif
+   {  /* The buffers follow the MSCon object in the slot */
+      U8* buf = (U8*)con + MSEVLOOP_ALIGN(sizeof(MSCon));
+      MS_setSocket(&con->ms,&con->sock,buf,o->recBufSize,
+                   buf+o->recBufSize,o->sendBufSize);
+   }
+   if(o->txqBuf)
+   {
+      MSTxQ_constructor(&con->txq,
+                        o->txqBuf + MSEvLoop_conIndex(o, con)*o->txqSize,
+                        o->txqSize, o->highWater, o->lowWater);
+      con->txq.onPending=MSEvLoop_txqPending;
+      con->txq.onPendingArg=o;
+      MS_setTxQueue(&con->ms, &con->txq);
+   }
+   con->wph=o->wph;
+   con->state=MSConState_Http;
+   o->conCount++;
+   MSTimer_constructor(&con->timer, MSEvLoop_conTimeout);
+   MSEvLoop_startTimer(o, &con->timer, MSEVLOOP_REQ_TMO);
+   if(MSEvLoop_ctl(o, EPOLL_CTL_ADD, con, MSEvLoop_fd(&con->sock)))
+   {
+      MSEvLoop_release(o, con, MS_ERR_ALLOC);
+      return 0;
+   }
+   return 1;
+
+  L_free:
+   con->nextFree=o->freeList;
+   o->freeList=con;
+   return rc;
+}
+
+
+static void
+MSEvLoop_readable(MSEvLoop* o, MSCon* con)
+{
+   int rc;
+   U8* data;
+   if(con->state == MSConState_Linger)
+   {
+      if(MST_linger(&con->ms.mst, 0))
+         MSEvLoop_release(o, con, MS_ERR_NOT_WEBSOCKET); /* Client closed */
+      return;
+   }
+   if(con->state == MSConState_Http)
+   {
+      /* Manage HTTP GET or upgrade WebSocket request */
+      if( (rc=MS_webServerFeed(&con->ms, &con->wph)) == MS_NEED_MORE )
+         return; /* Incomplete request header */
+      if(rc == MS_KEEP_ALIVE)
+      {  /* Response sent: wait for the next request */
+         MSEvLoop_startTimer(o,&con->timer,(U32)con->wph.keepAliveTmo*1000);
+         return;
+      }
+      if(rc == MS_ERR_NOT_WEBSOCKET || rc == MS_ERR_AUTHENTICATION)
+      {
+         MSEvLoop_linger(o, con, rc); /* HTTP response sent */
+         return;
+      }
+      if(rc)
+      {
+         MSEvLoop_release(o, con, rc);
+         return;
+      }
+      con->state=MSConState_WebSocket;
+      con->pingSent=o->tick;
+      if(o->pingInterval)
+         MSEvLoop_startTimer(o, &con->timer, (U32)o->pingInterval*1000);
+      else
+         MSEvLoop_stopTimer(o, &con->timer);
+      if(o->onOpen && o->onOpen(o, con))
+      {
+         MSEvLoop_close(o, con, 1011); /* 1011: unexpected condition */
+         return;
+      }
+   }
+   /* Consume all buffered frames: data may be left in the receive
+    * buffer (or in SharkSSL) after the socket becomes non readable.
+    */
+   con->lastRec=o->tick;
+   for(;;)
+   {
+      if( (rc=MS_read(&con->ms, &data, 0)) < 0 )
+      {
+         MSEvLoop_release(o, con, rc);
+         return;
+      }
+      if(con->ms.rs.isTimeout)
+         break;
+      if(o->onData && o->onData(o, con, data, rc))
+      {
+         MSEvLoop_close(o, con, 1011);
+         return;
+      }
+   }
+}
+
+
+static void
+MSEvLoop_writable(MSEvLoop* o, MSCon* con)
+{
+   int rc=MST_flush(&con->ms.mst);
+   if(rc < 0)
+   {
+      MSEvLoop_release(o, con, rc);
+      return;
+   }
+   if(rc == 0)
+   {
+      con->pollOut=FALSE;
+      MSEvLoop_ctl(o, EPOLL_CTL_MOD, con, MSEvLoop_fd(&con->sock));
+   }
+   if(MSTxQ_writable(&con->txq) &&
+      con->state == MSConState_WebSocket && o->onWritable)
+   {
+      o->onWritable(o, con);
+   }
+}
+
+
+int
+MSEvLoop_run(MSEvLoop* o, U32 timeout)
+{
+   struct epoll_event ev[MSEVLOOP_MAX_EVENTS];
+   int i,n,rc;
+   int accepted=0;
+   U32 next=MSEvLoop_nextTimer(o);
+   if(next < timeout)
+      timeout=next; /* Sleep until the next deadline */
+   n = epoll_wait(o->epfd, ev, MSEVLOOP_MAX_EVENTS,
+                  timeout == INFINITE_TMO ? -1 : (int)timeout);
+   if(n < 0)
+      return errno == EINTR ? 0 : -1;
+   for(i=0 ; i < n ; i++)
+   {
+      MSCon* con = (MSCon*)ev[i].data.ptr;
+      if(ev[i].data.ptr == (void*)o)
+         MSEvLoop_notified(o);
+      else if(!con)
+      {
+         if( (rc=MSEvLoop_accept(o)) < 0 )
+            return rc;
+         accepted += rc;
+      }
+      else if(con->state != MSConState_Free) /* Not closed by prev. event */
+      {
+         if(ev[i].events & EPOLLOUT)
+            MSEvLoop_writable(o, con);
+         if(con->state != MSConState_Free && (ev[i].events & ~EPOLLOUT))
+            MSEvLoop_readable(o, con);
+      }
+   }
+   MSEvLoop_runTimers(o);
+   return accepted;
+}
+
+#endif /* __linux__ */
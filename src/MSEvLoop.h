@@ -0,0 +1,446 @@
+/*
+ *     ____             _________                __                _
+ *    / __ \___  ____ _/ /_  __(_)___ ___  ___  / /   ____  ____ _(_)____
+ *   / /_/ / _ \/ __ `/ / / / / / __ `__ \/ _ \/ /   / __ \/ __ `/ / ___/
+ *  / _, _/  __/ /_/ / / / / / / / / / / /  __/ /___/ /_/ / /_/ / / /__
+ * /_/ |_|\___/\__,_/_/ /_/ /_/_/ /_/ /_/\___/_____/\____/\__, /_/\___/
+ *                                                       /____/
+ *
+ *                 SharkSSL Embedded SSL/TLS Stack
+ ****************************************************************************
+ *			      HEADER
+ *
+ *   $Id$
+ *
+ *   COPYRIGHT:  Real Time Logic LLC, 2013 - 2020
+ *
+ *   This software is copyrighted by and is the sole property of Real
+ *   Time Logic LLC.  All rights, title, ownership, or other interests in
+ *   the software remain the property of Real Time Logic LLC.  This
+ *   software may only be used in accordance with the terms and
+ *   conditions stipulated in the corresponding license agreement under
+ *   which the software has been supplied.  Any unauthorized use,
+ *   duplication, transmission, distribution, or disclosure of this
+ *   software is expressly forbidden.
+ *
+ *   This Copyright notice may not be removed or modified without prior
+ *   written consent of Real Time Logic LLC.
+ *
+ *   Real Time Logic LLC. reserves the right to modify this software
+ *   without notice.
+ *
+ *               http://sharkssl.com
+ ****************************************************************************
+ *
+ *
+ *  Minnow Server: multi-connection event loop (Linux epoll)
+ */
+
+#ifndef _MSEvLoop_h
+#define _MSEvLoop_h
+
+#include "MSLib.h"
+
+/** @addtogroup MSLib
+@{
+*/
+
+/** @defgroup MSEvLoop Minnow Server Event Loop
+    @ingroup MSLib
+
+    \brief Serve many HTTP(S) and WebSocket connections from one thread.
+
+    The standard Minnow Server design runs one connection to
+    completion before accepting the next. The event loop instead owns
+    a fixed array of #MSCon connection objects, waits for socket
+    readiness using epoll, and dispatches incoming data to each
+    connection. The #MS_read and #MS_send semantics are unchanged; the
+    loop simply calls #MS_read with a zero timeout when a socket is
+    readable, and the application sends data using the connection's
+    #MS instance.
+
+    Connection deadlines are kept in a hierarchical timer wheel and
+    the loop sleeps until the next deadline or socket event. A new
+    connection must send the HTTP request within #MSEVLOOP_REQ_TMO
+    milliseconds. HTTP persistent connections are closed by the loop
+    when WssProtocolHandshake#keepAliveTmo seconds elapse without a
+    new request. A connection is half closed after the last HTTP
+    response and kept in the loop until the client closes it, or for
+    at most #MSEVLOOP_LINGER_TMO milliseconds (see #MST_shutdown).
+    WebSocket connections are pinged every MSEvLoop#pingInterval
+    seconds. The application can use the same wheel for its own
+    deadlines, see #MSTimer.
+
+    The HTTP response is sent by WssProtocolHandshake#fetchPage in
+    the loop's thread using blocking socket calls, and the loop waits
+    until the client has received all but the last socket buffer of
+    the response. Keep the responses small; set MSDocRoot#maxSize
+    when serving a document root.
+
+    Device drivers, interrupt handlers, and other threads wake the
+    loop using #MSEvLoop_notify, and the loop calls
+    MSEvLoop#onNotify. Device events are then pushed to the browsers
+    without polling.
+
+    An MSEvLoop instance is not shared between threads, but one
+    process can run N event loops, each in its own thread and with its
+    own connections, buffers, and listen socket. Open the listen
+    sockets using #MSEvLoop_bind, and the kernel distributes the new
+    connections among the N loops.
+
+    The event loop requires Linux and the BSD socket porting layer.
+@{
+*/
+
+/** Maximum number of socket events processed per #MSEvLoop_run
+    wait cycle.
+*/
+#ifndef MSEVLOOP_MAX_EVENTS
+#define MSEVLOOP_MAX_EVENTS 32
+#endif
+
+/** Maximum time in milliseconds a half closed HTTP connection waits
+    for the client to close the connection.
+*/
+#ifndef MSEVLOOP_LINGER_TMO
+#define MSEVLOOP_LINGER_TMO 2000
+#endif
+
+/** Maximum time in milliseconds from accepting a connection to
+    receiving the complete HTTP request header.
+*/
+#ifndef MSEVLOOP_REQ_TMO
+#define MSEVLOOP_REQ_TMO 10000
+#endif
+
+/** The timer wheel resolution in milliseconds. */
+#ifndef MSEVLOOP_TICK
+#define MSEVLOOP_TICK 10
+#endif
+
+/** The timer wheel has MSEVLOOP_WHEEL_LEVELS levels, each with 64
+    slots. Level N covers 64^(N+1) ticks: four levels with a 10 ms
+    tick cover 46 hours. Longer timers expire at the end of the range.
+*/
+#ifndef MSEVLOOP_WHEEL_LEVELS
+#define MSEVLOOP_WHEEL_LEVELS 4
+#endif
+
+/** Connection states */
+typedef enum {
+   MSConState_Free=0,  /**< Slot not in use */
+   MSConState_Http,    /**< Waiting for the HTTP request */
+   MSConState_WebSocket, /**< Upgraded to a WebSocket connection */
+   MSConState_Linger   /**< Response sent, waiting for the client to close */
+} MSConState;
+
+struct MSEvLoop;
+struct MSCon;
+struct MSTimer;
+
+/** Called when an #MSTimer expires. The timer is stopped and can be
+    restarted by the callback.
+ */
+typedef void (*MSTimerCB)(struct MSEvLoop* loop, struct MSTimer* timer);
+
+/** A timer in the event loop's timer wheel. Starting, stopping, and
+    expiring a timer are constant time operations, thus the loop can
+    manage one or more timers per connection. Embed the timer in the
+    application object and use offsetof in the callback to find the
+    object.
+ */
+typedef struct MSTimer
+{
+   /* Private members */
+   struct MSTimer* next;
+   struct MSTimer** prev; /* NULL when the timer is not running */
+   MSTimerCB callback;
+   U32 expires; /* Tick */
+} MSTimer;
+
+/** Create a timer.
+    \param o the MSTimer instance.
+    \param cb the function called when the timer expires.
+ */
+#define MSTimer_constructor(o, cb) ((o)->prev=0, (o)->callback=cb)
+
+/** Returns TRUE if the timer is running. */
+#define MSTimer_isActive(o) ((o)->prev != 0)
+
+/** Called when an HTTP(S) request is upgraded to a WebSocket
+    connection. Return a non zero value to close the connection.
+ */
+typedef int (*MSConOpen)(struct MSEvLoop* loop, struct MSCon* con);
+
+/** Called for each chunk returned by #MS_read. The message type,
+    #WSOP_Text or #WSOP_Binary, is in WssReadState#opCode, also for
+    the chunks in continuation frames. The WssReadState#msgState flags
+    #WSMSG_BEGIN and #WSMSG_END mark the first and the last chunk in a
+    message, including fragmented and compressed (#MSDeflate)
+    messages. Return a non zero value to close the connection.
+ */
+typedef int (*MSConData)(struct MSEvLoop* loop, struct MSCon* con,
+                         U8* data, int len);
+
+/** Called just before a WebSocket connection is closed and the
+    #MSCon slot is released. 'status' is the value returned by #MS_read
+    or the status code passed into #MSEvLoop_close.
+ */
+typedef void (*MSConClose)(struct MSEvLoop* loop, struct MSCon* con,
+                           int status);
+
+
+/** Called by #MSEvLoop_run after #MSEvLoop_notify. 'events' is the
+    bitwise OR of the values passed to #MSEvLoop_notify since the
+    previous call.
+ */
+typedef void (*MSEvNotify)(struct MSEvLoop* loop, U32 events);
+
+
+/** Called when the connection's transmit queue, full when
+    #MS_sendNB returned #MS_WOULD_BLOCK, has drained to the low
+    watermark. See #MSEvLoop_setTxQueue.
+ */
+typedef void (*MSConWritable)(struct MSEvLoop* loop, struct MSCon* con);
+
+
+/** A connection managed by the event loop. The event loop carves
+    the MSCon objects and their buffers out of the slab passed to
+    #MSEvLoop_constructor.
+ */
+typedef struct MSCon
+{
+   /** The Minnow Server instance for this connection. Use it with
+       #MS_prepSend, #MS_send, #MS_write, etc.
+   */
+   MS ms;
+   /** Per connection copy of MSEvLoop#wph */
+   WssProtocolHandshake wph;
+   /** The transmit queue, if enabled by #MSEvLoop_setTxQueue */
+   MSTxQ txq;
+   SOCKET sock;
+   /* The request, keep-alive, linger, or ping deadline */
+   MSTimer timer;
+   U32 lastRec; /* MSEvLoop:tick when data was last received */
+   U32 pingSent; /* MSEvLoop:tick when the last ping was sent */
+   struct MSCon* nextFree; /* Free list link when not in use */
+   U8 state; /* MSConState */
+   BaBool pollOut; /* Waiting for the socket to become writable */
+} MSCon;
+
+
+/** Aligns the connection slots in the slab */
+typedef union {
+   void* p;
+   long l;
+   double d;
+} MSSlabAlign;
+
+/** Round 'n' up to a multiple of sizeof(MSSlabAlign) */
+#define MSEVLOOP_ALIGN(n) \
+   (((n)+sizeof(MSSlabAlign)-1)/sizeof(MSSlabAlign)*sizeof(MSSlabAlign))
+
+/** The size of one connection slot in the slab: the #MSCon object
+    followed by the receive and send buffers.
+ */
+#define MSEvLoop_slotSize(recBufSize, sendBufSize) \
+   (MSEVLOOP_ALIGN(sizeof(MSCon)) + MSEVLOOP_ALIGN((recBufSize)+(sendBufSize)))
+
+/** Declare a slab, named 'name', for 'maxCons' connections. Example:
+    \code
+    static MSEVLOOP_SLAB(slab, 64, 1500, 1500);
+    \endcode
+ */
+#define MSEVLOOP_SLAB(name, maxCons, recBufSize, sendBufSize) \
+   MSSlabAlign name[(maxCons)*MSEvLoop_slotSize(recBufSize, sendBufSize)/ \
+                    sizeof(MSSlabAlign)]
+
+
+/** The event loop. Set the public In params before calling
+    #MSEvLoop_run.
+ */
+typedef struct MSEvLoop
+{
+   /** In param: the handshake configuration (fetchPage, credentials,
+       etc.) copied to each new connection.
+   */
+   WssProtocolHandshake wph;
+   /** In param: WebSocket connection established */
+   MSConOpen onOpen;
+   /** In param: WebSocket data received */
+   MSConData onData;
+   /** In param: WebSocket connection closing */
+   MSConClose onClose;
+   /** In param: WebSocket transmit queue writable */
+   MSConWritable onWritable;
+   /** In param: #MSEvLoop_notify called */
+   MSEvNotify onNotify;
+   /** In param: send a WebSocket ping every pingInterval seconds.
+       Zero disables ping. The pings keep NAT and firewall mappings
+       open. A connection that receives no data, such as the pong,
+       within pingInterval seconds after a ping is released with
+       #MS_ERR_READ_TMO, thus a dead peer is detected within two
+       intervals.
+   */
+   U16 pingInterval;
+
+   /* Private members */
+   SOCKET* listenSock;
+   U8* slab;
+   MSCon* freeList; /* The free slots, most recently released first */
+   U8* txqBuf;
+   int txqSize;
+   int highWater;
+   int lowWater;
+#ifdef MS_SEC
+   SharkSsl* sharkSsl;
+#endif
+   MSTimer* wheel[MSEVLOOP_WHEEL_LEVELS][64];
+   U32 tick; /* Wheel time: the next tick to process */
+   int timerCount; /* Running timers */
+   int maxCons;
+   int slotSize;
+   int conCount;
+   int epfd;
+   int evfd; /* eventfd used by MSEvLoop_notify */
+   U32 notifyEvents;
+   U16 recBufSize;
+   U16 sendBufSize;
+} MSEvLoop;
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Create an event loop. All connection memory is in one slab
+    allocated by the application, and accepting a connection takes a
+    slot from a free list. The event loop does not allocate memory,
+    except for the SharkSslCon objects created by SharkSSL in secure
+    mode.
+    \param o the MSEvLoop instance.
+    \param listenSock a server socket opened with se_bind or
+    #MSEvLoop_bind. The constructor makes the socket non blocking.
+    \param slab 'maxCons' connection slots, declared using
+    #MSEVLOOP_SLAB or allocated as 'maxCons' times
+    #MSEvLoop_slotSize bytes aligned for #MSSlabAlign.
+    \param maxCons the maximum number of concurrent connections.
+    \param recBufSize the per connection receive buffer size.
+    \param sendBufSize the per connection send buffer size. The
+    receive and send buffers are the #MSTBuf buffers used in non
+    secure mode. Set both to zero when all connections use SharkSSL.
+    \return zero on success or a negative value if epoll cannot be
+    initialized.
+ */
+int MSEvLoop_constructor(MSEvLoop* o, SOCKET* listenSock,
+                         void* slab, int maxCons,
+                         U16 recBufSize, U16 sendBufSize);
+
+/** Close all connections and release the epoll instance. The listen
+    socket is not closed.
+ */
+void MSEvLoop_destructor(MSEvLoop* o);
+
+#ifdef MS_SEC
+/** Run all connections in secure (TLS) mode. A SharkSslCon is
+    created for each accepted connection.
+ */
+#define MSEvLoop_setSharkSsl(o, ssl) (o)->sharkSsl=ssl
+#endif
+
+/** Enable non blocking sends by giving each connection a transmit
+    queue. Data the socket cannot accept is then queued and sent when
+    the socket becomes writable, so one slow client does not block the
+    other connections. Use #MS_sendNB for data that can be dropped or
+    coalesced when the queue is full; the onWritable callback is
+    called when the queue has drained to 'lowWater'. Secure
+    connections do not use the queue, and #MS_sendNB returns
+    #MS_ERR_TXQ for them.
+    \param o the MSEvLoop instance.
+    \param buf 'maxCons' times 'size' bytes.
+    \param size the per connection queue size.
+    \param highWater see #MSTxQ_constructor.
+    \param lowWater see #MSTxQ_constructor.
+ */
+void MSEvLoop_setTxQueue(MSEvLoop* o, U8* buf, int size,
+                         int highWater, int lowWater);
+
+/** Wait for socket events and dispatch them.
+    \param o the MSEvLoop instance.
+    \param timeout maximum time to wait in milliseconds. The timeout
+    can be set to #INFINITE_TMO. The wait time is limited by the next
+    timer deadline; expired timers are run before the function
+    returns.
+    \return the number of connections accepted, zero on timeout, or a
+    negative value if the listen socket failed.
+ */
+int MSEvLoop_run(MSEvLoop* o, U32 timeout);
+
+/** Close a connection. A WebSocket close frame with 'statusCode' is
+    sent to the peer if the connection is a WebSocket connection and
+    'statusCode' is not zero. The function does not block: queued data
+    the socket does not accept, and the close frame if the transmit
+    queue is full, are dropped.
+ */
+void MSEvLoop_close(MSEvLoop* o, MSCon* con, int statusCode);
+
+/** Returns the index of 'con' in the slab passed into
+    #MSEvLoop_constructor. Use the index to associate application data
+    with a connection.
+ */
+#define MSEvLoop_conIndex(o, con) \
+   ((int)(((U8*)(con)-(o)->slab)/(o)->slotSize))
+
+/** Returns the connection with index 'ix', where 0 <= ix < maxCons.
+    The connection is not in use if its state is MSConState_Free.
+ */
+#define MSEvLoop_getCon(o, ix) ((MSCon*)((o)->slab + (ix)*(o)->slotSize))
+
+/** Returns the number of connections currently in use.
+ */
+#define MSEvLoop_getConCount(o) (o)->conCount
+
+/** Start or restart a timer.
+    \param o the MSEvLoop instance.
+    \param t a timer created with #MSTimer_constructor.
+    \param ms expire after 'ms' milliseconds, rounded up to the
+    #MSEVLOOP_TICK resolution.
+ */
+void MSEvLoop_startTimer(MSEvLoop* o, MSTimer* t, U32 ms);
+
+/** Stop a timer. Stopping a timer that is not running has no effect.
+ */
+void MSEvLoop_stopTimer(MSEvLoop* o, MSTimer* t);
+
+/** Wake the event loop and make it call MSEvLoop#onNotify with
+    'events'. The function can be called from any thread and from
+    signal handlers; events notified before the callback runs are
+    combined into one call.
+    \param o the MSEvLoop instance.
+    \param events application defined event bits.
+ */
+void MSEvLoop_notify(MSEvLoop* o, U32 events);
+
+/** Open a server socket that shares the port with other server
+    sockets, one for each event loop thread. Same as se_bind, except
+    that the socket is created with SO_REUSEPORT. The kernel then
+    hashes new connections across the listen sockets bound to the
+    port, and no accept lock or hand-off between threads is needed.
+    \param sock the listen socket, constructed with
+    SOCKET_constructor.
+    \param port the port number.
+    \return zero on success, -3 if the port is in use by a socket
+    not created with SO_REUSEPORT, or another negative value if the
+    socket cannot be created.
+ */
+int MSEvLoop_bind(SOCKET* sock, U16 port);
+
+#ifdef __cplusplus
+}
+#endif
+
+/** @} */ /* end group MSEvLoop */
+
+/** @} */ /* end group MSLib */
+
+#endif
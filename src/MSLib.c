@@ -35,11 +35,59 @@
 
 #include "MSLib.h"
 #include <ctype.h>
+#ifdef MS_DEFLATE
+#include <stdlib.h>
+#endif
+
+/* Payload unmasking kernel selected at compile time. Define
+   MS_NO_SIMD to use the portable word at a time version only.
+*/
+#ifndef MS_NO_SIMD
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MS_UNMASK_AVX2
+#define MS_UNMASK_ALIGN 32
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MS_UNMASK_SSE2
+#define MS_UNMASK_ALIGN 16
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MS_UNMASK_NEON
+#define MS_UNMASK_ALIGN 16
+#endif
+#endif
+#ifndef MS_UNMASK_ALIGN
+#define MS_UNMASK_ALIGN sizeof(size_t)
+#endif
+
+/* MST_writev: scatter/gather send for the BSD socket porting layer
+   (SOCKET:hndl) on POSIX systems. Define MS_NO_WRITEV to copy the
+   data through the send buffer on all platforms.
+*/
+#if !defined(MS_NO_WRITEV) && (defined(__linux__) || defined(__APPLE__))
+#define MS_WRITEV
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
 
 /* Default end of HTTP respons */
 static const U8 httpEOR[]={
    "\r\nConnection: Close\r\nServer: SharkSSL WebSocket Server\r\n\r\n"};
 
+/* End of HTTP response for persistent connections */
+static const U8 httpEORKeepAlive[]={
+   "\r\nConnection: keep-alive\r\nServer: SharkSSL WebSocket Server\r\n\r\n"};
+
+/* MST:keepAlive flags */
+#define MST_KA_REQ  1 /* The client requested a persistent connection */
+#define MST_KA_RESP 2 /* Response sent with Connection: keep-alive */
+
 
 /************************* Helper functions ******************************/
 
@@ -118,8 +166,10 @@ msstrstrn(U8* str, int slen, const U8* substr)
       {
          if (*b == 0)
             return str;
-         if (tolower(*a++) != tolower(*b++))
+         if (tolower(*a) != tolower(*b))
             break;
+         a++;
+         b++;
       }
       if (*b == 0)
          return str;
@@ -135,13 +185,13 @@ msi2a(U8* dest, int* dlen, U32 n)
    U8* ptr = dest;
    int l = *dlen;
    if(!dest) return 0;
-   while(n && l)
+   do
    {
+      if(l <= 0) return 0;
       *ptr++ = '0' + n % 10;
       n /= 10;
       l--;
-   }
-   if(l >= 0)
+   } while(n);
    {
       U8 tmp;
       U8* head=dest;
@@ -155,40 +205,31 @@ msi2a(U8* dest, int* dlen, U32 n)
       }
       return end;
    }
-   return 0;
 }
 
 
 
-U8*
-msRespCT(U8* dest, int* dlen, int contentLen, const U8* extHeader)
+static U8*
+msRespCTEnd(U8* dest, int* dlen, int contentLen, const U8* extHeader,
+            const U8* eor)
 {
    static const U8  httpRespCL[] = {"HTTP/1.0 200 OK\r\nContent-Length: "};
    dest=msCpAndInc(dest,dlen,httpRespCL,sizeof(httpRespCL)-1);
    dest=msi2a(dest,dlen,contentLen);
    if(extHeader)
       dest = msCpAndInc(dest,dlen,extHeader, 0);
-   return msCpAndInc(dest,dlen,httpEOR,sizeof(httpEOR)-1);
+   return msCpAndInc(dest,dlen,eor,0);
 }
 
 
-
-static U8*
-getKeyVal(U8* key)
+U8*
+msRespCT(U8* dest, int* dlen, int contentLen, const U8* extHeader)
 {
-   if(key)
-   {
-      U8* val = key;
-      while(*val && *val != ':') val++;
-      *val++=0;
-      while(*val && *val == ' ') val++;
-      if(*val)
-         return val;
-   }
-   return 0; /* Not found */
+   return msRespCTEnd(dest,dlen,contentLen,extHeader,httpEOR);
 }
 
 
+
 static int
 wssCheckCredentials(WssProtocolHandshake* wph, U8* auth)
 {
@@ -210,20 +251,316 @@ wssCheckCredentials(WssProtocolHandshake* wph, U8* auth)
    return 0;
 }
 
+/* RFC6455 5.3: orig-octet-i = masked-octet-i XOR (mask[i MOD 4]),
+ * where 'ix' is the payload index for data[0]. Bytes are XORed one at
+ * a time until 'data' is aligned, then a (SIMD) word at a time using a
+ * mask rotated such that mask byte zero applies to the aligned data.
+ */
+static void
+msUnmask(U8* data, int len, const U8* mask, int ix)
+{
+   U8 m[4];
+   U32 m32;
+   size_t mw;
+   while(len && ((size_t)data & (MS_UNMASK_ALIGN-1)))
+   {
+      *data++ ^= mask[ix++ & 3];
+      len--;
+   }
+   m[0]=mask[ix&3];
+   m[1]=mask[(ix+1)&3];
+   m[2]=mask[(ix+2)&3];
+   m[3]=mask[(ix+3)&3];
+   memcpy(&m32, m, 4);
+#if defined(MS_UNMASK_AVX2)
+   {
+      __m256i vm = _mm256_set1_epi32((int)m32);
+      for( ; len >= 32 ; len-=32, data+=32)
+      {
+         __m256i* p = (__m256i*)data;
+         _mm256_store_si256(p, _mm256_xor_si256(_mm256_load_si256(p), vm));
+      }
+   }
+#endif
+#if defined(MS_UNMASK_AVX2) || defined(MS_UNMASK_SSE2)
+   {
+      __m128i vm = _mm_set1_epi32((int)m32);
+      for( ; len >= 16 ; len-=16, data+=16)
+      {
+         __m128i* p = (__m128i*)data;
+         _mm_store_si128(p, _mm_xor_si128(_mm_load_si128(p), vm));
+      }
+   }
+#elif defined(MS_UNMASK_NEON)
+   {
+      uint8x16_t vm = vreinterpretq_u8_u32(vdupq_n_u32(m32));
+      for( ; len >= 16 ; len-=16, data+=16)
+         vst1q_u8(data, veorq_u8(vld1q_u8(data), vm));
+   }
+#endif
+   mw=m32;
+   if(sizeof(size_t) == 8)
+      mw |= (mw << 16) << 16;
+   for( ; len >= (int)sizeof(size_t) ; len-=sizeof(size_t),data+=sizeof(size_t))
+   {
+      size_t w;
+      memcpy(&w, data, sizeof(size_t));
+      w ^= mw;
+      memcpy(data, &w, sizeof(size_t));
+   }
+   for(ix=0 ; ix < len ; ix++)
+      data[ix] ^= m[ix&3];
+}
+
 /************************ End helper functions ****************************/
 
+
+void
+MSTxQ_constructor(MSTxQ* o, U8* buf, int size, int highWater, int lowWater)
+{
+   memset(o, 0, sizeof(MSTxQ));
+   o->buf=buf;
+   o->size=size;
+   o->highWater=highWater;
+   o->lowWater=lowWater;
+}
+
+
+#ifdef MS_WRITEV
+/* Set 'v' to the queued data. Returns the number of elements used:
+   0, 1, or 2 if the data wraps around the end of the ring buffer.
+*/
+static int
+MSTxQ_getIov(MSTxQ* o, struct iovec* v)
+{
+   int first = o->size - o->start;
+   if(o->len == 0)
+      return 0;
+   v[0].iov_base=o->buf+o->start;
+   if(o->len <= first)
+   {
+      v[0].iov_len=o->len;
+      return 1;
+   }
+   v[0].iov_len=first;
+   v[1].iov_base=o->buf;
+   v[1].iov_len=o->len-first;
+   return 2;
+}
+
+
+static void
+MSTxQ_consume(MSTxQ* o, int len)
+{
+   o->len -= len;
+   o->start = o->len ? (o->start+len) % o->size : 0;
+}
+
+
+/* Copy the data in 'msg' to the queue. The caller checks the size. */
+static void
+MSTxQ_push(MSTxQ* o, struct msghdr* msg)
+{
+   int i;
+   for(i=0 ; i < (int)msg->msg_iovlen ; i++)
+   {
+      const U8* ptr=(const U8*)msg->msg_iov[i].iov_base;
+      int len=(int)msg->msg_iov[i].iov_len;
+      while(len)
+      {
+         int end=(o->start+o->len) % o->size;
+         int chunk = o->size - end;
+         if(chunk > len) chunk=len;
+         memcpy(o->buf+end, ptr, chunk);
+         o->len+=chunk;
+         ptr+=chunk;
+         len-=chunk;
+      }
+   }
+}
+
+
+/* Send the data in 'msg'. The function returns 0 when all data is
+   sent, and -1 on socket error. The socket is in blocking mode, and
+   a non blocking send (flags=MSG_DONTWAIT) returns 1 if the socket
+   buffer is full; msg is then set to the data not sent.
+*/
+static int
+MST_sendmsg(int fd, struct msghdr* msg, int flags)
+{
+   while(msg->msg_iovlen)
+   {
+      ssize_t sent = sendmsg(fd, msg, flags | MSG_NOSIGNAL);
+      if(sent < 0)
+      {
+         if(errno == EINTR) continue;
+         if(errno == EAGAIN || errno == EWOULDBLOCK)
+            return (flags & MSG_DONTWAIT) ? 1 : -1;
+         return -1;
+      }
+      /* Partial write: skip the sent data */
+      while(msg->msg_iovlen && (size_t)sent >= msg->msg_iov->iov_len)
+      {
+         sent -= msg->msg_iov->iov_len;
+         msg->msg_iov++;
+         msg->msg_iovlen--;
+      }
+      if(msg->msg_iovlen)
+      {
+         msg->msg_iov->iov_base = (U8*)msg->msg_iov->iov_base + sent;
+         msg->msg_iov->iov_len -= sent;
+      }
+   }
+   return 0;
+}
+
+
+int
+MST_drain(MST* o)
+{
+   struct iovec v[2];
+   struct msghdr msg;
+   if(!o->txq || !o->txq->len)
+      return 0;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov=v;
+   msg.msg_iovlen=MSTxQ_getIov(o->txq, v);
+   o->txq->len=o->txq->start=0;
+   return MST_sendmsg(o->sock->hndl, &msg, 0) ? MS_ERR_WRITE : 0;
+}
+
+
+int
+MST_flush(MST* o)
+{
+   struct iovec v[2];
+   struct msghdr msg;
+   int i;
+   int left=0;
+   if(!o->txq || !o->txq->len)
+      return 0;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov=v;
+   msg.msg_iovlen=MSTxQ_getIov(o->txq, v);
+   if(MST_sendmsg(o->sock->hndl, &msg, MSG_DONTWAIT) < 0)
+      return MS_ERR_WRITE;
+   for(i=0 ; i < (int)msg.msg_iovlen ; i++)
+      left += (int)msg.msg_iov[i].iov_len;
+   MSTxQ_consume(o->txq, o->txq->len - left);
+   return o->txq->len;
+}
+
+
+/* Send 'total' bytes in 'v'. The data is sent without blocking and
+   the data the socket cannot accept is queued if the MST has a
+   transmit queue and the data fits in the queue.
+*/
+static int
+MST_sendv(MST* o, struct iovec* v, int cnt, int total)
+{
+   struct msghdr msg;
+   MSTxQ* q=o->txq;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov=v;
+   msg.msg_iovlen=cnt;
+   if(q)
+   {
+      int i;
+      int left=0;
+      if(q->len == 0)
+      {  /* Nothing queued: try sending directly */
+         int rc = MST_sendmsg(o->sock->hndl, &msg, MSG_DONTWAIT);
+         if(rc <= 0)
+            return rc ? MS_ERR_WRITE : total;
+      }
+      for(i=0 ; i < (int)msg.msg_iovlen ; i++)
+         left += (int)msg.msg_iov[i].iov_len;
+      if(left <= q->size - q->len)
+      {
+         BaBool wasEmpty = q->len == 0;
+         MSTxQ_push(q, &msg);
+         if(wasEmpty && q->onPending)
+            q->onPending(q, q->onPendingArg);
+         return total;
+      }
+      /* Does not fit: block until the queue and the data are sent.
+         MS_sendNB and MS_broadcast check the free space first and
+         never get here; MS_send and MS_write block.
+       */
+      if(MST_drain(o))
+         return MS_ERR_WRITE;
+   }
+   return MST_sendmsg(o->sock->hndl, &msg, 0) ? MS_ERR_WRITE : total;
+}
+#else
+int
+MST_drain(MST* o)
+{
+   (void)o;
+   return 0;
+}
+
+int
+MST_flush(MST* o)
+{
+   (void)o;
+   return 0;
+}
+#endif
+
+
+/* Non secure socket write */
+static int
+MST_sockWrite(struct MST* o,U8* buf, int len)
+{
+#ifdef MS_WRITEV
+   if(o->txq)
+   {
+      struct iovec v;
+      v.iov_base=buf;
+      v.iov_len=(size_t)len;
+      return MST_sendv(o, &v, 1, len);
+   }
+#endif
+   return se_send(o->sock, buf, len);
+}
+
+
+/* Non secure socket read. Returns zero on timeout. A zero timeout,
+ * used by MSEvLoop when epoll reports the socket readable, reads
+ * without calling se_recv since select() cannot wait for a socket
+ * descriptor >= FD_SETSIZE.
+ */
+static int
+MST_sockRead(struct MST* o,U8* buf, int len, U32 timeout)
+{
+#ifdef MS_WRITEV
+   if(!timeout)
+   {
+      ssize_t rc;
+      while( (rc=recv(o->sock->hndl, buf, (size_t)len, MSG_DONTWAIT)) < 0 )
+      {
+         if(errno == EINTR) continue;
+         return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+      }
+      return rc ? (int)rc : -1; /* Zero: closed by peer */
+   }
+#endif
+   return se_recv(o->sock, buf, len, timeout);
+}
+
 #ifdef MS_SEC
 static int
 MST_nonSecRead(struct MST* o,U8 **buf,U32 timeout)
 {
    *buf = o->u.b.recBuf;
-   return se_recv(o->sock, *buf, o->u.b.recBufSize, timeout);
+   return MST_sockRead(o, *buf, o->u.b.recBufSize, timeout);
 }
 
 static int
 MST_nonSecWrite(struct MST* o,U8* buf, int len)
 {
-   return se_send(o->sock, buf ? buf : o->u.b.sendBuf, len);
+   return MST_sockWrite(o, buf ? buf : o->u.b.sendBuf, len);
 }
 
 U8* MST_getSendBufPtr(MST* o)
@@ -243,162 +580,1248 @@ U8* MST_getSendBufPtr(MST* o)
    return o->b.sendBuf;
 }
 
-U16 MST_getSendBufSize(MST* o)
+U16 MST_getSendBufSize(MST* o)
+{
+   return o->b.sendBufSize;
+}
+#endif
+
+int
+MST_shutdown(MST* o)
+{
+   if(MST_drain(o))
+      return MS_ERR_WRITE;
+#ifdef MS_WRITEV
+   if(shutdown(o->sock->hndl, SHUT_WR))
+      return MS_ERR_WRITE;
+#endif
+   return 0;
+}
+
+
+int
+MST_linger(MST* o, U32 timeout)
+{
+   int i,rc;
+   /* The send buffer is free after the response: use it for
+    * discarding the data, including TLS records in secure mode.
+    */
+   U8* buf=MST_getSendBufPtr(o);
+   U16 size=MST_getSendBufSize(o);
+   for(i=0 ; i < 8 ; i++) /* Limit the time spent on a chatty client */
+   {
+      if( (rc=MST_sockRead(o, buf, size, timeout)) <= 0 )
+         return rc < 0 ? 1 : 0;
+   }
+   return 0;
+}
+
+
+int
+MST_read(struct MST* o,U8 **buf,U32 timeout)
+{
+#ifdef MS_SEC
+   return  o->isSecure ?
+      seSec_read(o->u.sc,o->sock,buf,timeout) : MST_nonSecRead(o,buf,timeout);
+#else
+   *buf = o->b.recBuf;
+   return MST_sockRead(o, *buf, o->b.recBufSize, timeout);
+#endif
+}
+
+int
+MST_write(struct MST* o,U8* buf, int len)
+{
+#ifdef MS_SEC
+   return  o->isSecure ?
+      seSec_write(o->u.sc,o->sock,buf,len) : MST_nonSecWrite(o,buf,len);
+#else
+   return MST_sockWrite(o, buf ? buf : o->b.sendBuf, len);
+#endif
+}
+
+
+/* Gather the data into the send buffer and send it in buffer sized
+ * chunks. Used in secure mode, where the SharkSSL zero copy API
+ * encrypts the data in place, and on platforms without writev.
+ */
+static int
+MST_copyWritev(MST* o, const MSIoVec* iov, int iovcnt)
+{
+   int i,chunk;
+   int n=0,total=0;
+   U8* buf=MST_getSendBufPtr(o);
+   int size=MST_getSendBufSize(o);
+   for(i=0 ; i < iovcnt ; i++)
+   {
+      const U8* ptr=(const U8*)iov[i].data;
+      int len=iov[i].len;
+      while(len)
+      {
+         chunk = len < size-n ? len : size-n;
+         if(ptr != buf+n) /* Not data staged in the send buffer */
+            memcpy(buf+n, ptr, chunk);
+         n+=chunk;
+         ptr+=chunk;
+         len-=chunk;
+         total+=chunk;
+         if(n == size)
+         {
+            if(MST_write(o, 0, n) < 0)
+               return MS_ERR_WRITE;
+            n=0;
+            buf=MST_getSendBufPtr(o);
+         }
+      }
+   }
+   if(n && MST_write(o, 0, n) < 0)
+      return MS_ERR_WRITE;
+   return total;
+}
+
+
+int
+MST_writev(MST* o, const MSIoVec* iov, int iovcnt)
+{
+#ifdef MS_WRITEV
+   struct iovec v[MST_MAX_IOV];
+   int i;
+   int total=0;
+   if(o->isSecure || iovcnt > MST_MAX_IOV)
+      return MST_copyWritev(o, iov, iovcnt);
+   for(i=0 ; i < iovcnt ; i++)
+   {
+      v[i].iov_base=(void*)iov[i].data;
+      v[i].iov_len=(size_t)iov[i].len;
+      total+=iov[i].len;
+   }
+   return MST_sendv(o, v, iovcnt, total);
+#else
+   return MST_copyWritev(o, iov, iovcnt);
+#endif
+}
+
+
+int
+MST_writeRef(MST* o, int hlen, const void* data, int len)
+{
+   MSIoVec iov[2];
+   iov[0].data=MST_getSendBufPtr(o);
+   iov[0].len=hlen;
+   iov[1].data=data;
+   iov[1].len=len;
+   return MST_writev(o, iov, 2);
+}
+
+
+/* Returns the end of the HTTP response header. The response keeps the
+ * connection open if the client requested a persistent connection.
+ */
+static const U8*
+MST_respEnd(MST* o)
+{
+   if(o->keepAlive & MST_KA_REQ)
+   {
+      o->keepAlive |= MST_KA_RESP;
+      return httpEORKeepAlive;
+   }
+   return httpEOR;
+}
+
+
+U8*
+MST_respCT(MST* o, int* dlen, int contentLen, const U8* extHeader)
+{
+   *dlen = MST_getSendBufSize(o);
+   return msRespCTEnd(MST_getSendBufPtr(o), dlen, contentLen, extHeader,
+                      MST_respEnd(o));
+}
+
+
+U8*
+MS_respCT(MS* o, int* dlen, int contentLen, const U8* extHeader)
+{
+   return MST_respCT(&o->mst, dlen, contentLen, extHeader);
+}
+
+
+/****************************** Route table ********************************/
+
+U32
+msRouteHash(const U8* path, int len, U32 seed)
+{
+   U32 h=seed;
+   while(len--)
+   {
+      h ^= *path++;
+      h *= 16777619U; /* FNV-1a 32 bit prime */
+   }
+   return h;
+}
+
+
+void
+MSRouteTable_constructor(MSRouteTable* o, const MSAsset** slotArray,
+                         U16 tabSize, U32 tabSeed)
+{
+   int i;
+   baAssert(tabSize && !(tabSize & (tabSize-1)));
+   o->slots=slotArray;
+   o->size=tabSize;
+   o->seed=tabSeed;
+   o->len=0;
+   for(i=0 ; i < tabSize ; i++)
+   {
+      if(slotArray[i])
+         o->len++;
+   }
+}
+
+
+/* Returns the slot for 'path' or the empty slot where 'path' can be
+ * added. The table always has at least one empty slot.
+ */
+static int
+MSRouteTable_slot(MSRouteTable* o, const U8* path, int len)
+{
+   int mask=o->size-1;
+   int ix=(int)(msRouteHash(path, len, o->seed) & (U32)mask);
+   const MSAsset* a;
+   while( (a=o->slots[ix]) != 0 )
+   {
+      if(!strncmp(a->path, (const char*)path, len) && !a->path[len])
+         break;
+      ix = (ix+1) & mask; /* Linear probing */
+   }
+   return ix;
+}
+
+
+int
+MS_addRoute(MSRouteTable* o, const MSAsset* asset)
+{
+   int ix=MSRouteTable_slot(
+      o, (const U8*)asset->path, (int)strlen(asset->path));
+   if(!o->slots[ix])
+   {
+      if(o->len+1 >= o->size)
+         return MS_ERR_ALLOC;
+      o->len++;
+   }
+   o->slots[ix]=asset;
+   return 0;
+}
+
+
+const MSAsset*
+MSRouteTable_find(MSRouteTable* o, const U8* path)
+{
+   int len=0;
+   while(path[len] && path[len] != '?') len++;
+   return o->slots[MSRouteTable_slot(o, path, len)];
+}
+
+
+/* Returns TRUE if the If-None-Match header 'inm' matches 'etag' using
+ * the weak comparison (RFC 7232 3.2).
+ */
+static BaBool
+msEtagMatch(const U8* inm, const char* etag)
+{
+   int len=(int)strlen(etag);
+   while(*inm)
+   {
+      while(*inm == ' ' || *inm == '\t' || *inm == ',') inm++;
+      if(*inm == '*')
+         return TRUE;
+      if(inm[0] == 'W' && inm[1] == '/')
+         inm+=2;
+      if(!strncmp((const char*)inm, etag, len) &&
+         (!inm[len] || inm[len] == ',' || inm[len] == ' '))
+      {
+         return TRUE;
+      }
+      while(*inm && *inm != ',') inm++;
+   }
+   return FALSE;
+}
+
+
+/* Add header 'key' with value 'val' to the response */
+static U8*
+msAddHeader(U8* dest, int* dlen, const char* key, const char* val)
+{
+   dest=msCpAndInc(dest,dlen,(const U8*)"\r\n",2);
+   dest=msCpAndInc(dest,dlen,(const U8*)key,0);
+   dest=msCpAndInc(dest,dlen,(const U8*)": ",2);
+   return msCpAndInc(dest,dlen,(const U8*)val,0);
+}
+
+
+/* Returns the response status for asset 'a': 304, 416, 206, or 200,
+ * and the part of the asset to send.
+ */
+static int
+msAssetStatus(MST* o, const MSAsset* a, U32* offset, U32* len)
+{
+   const U8* inm;
+   int rc;
+   *offset=0;
+   *len=0;
+   if(a->etag && (inm=MST_getHeader(o,"If-None-Match")) != 0 &&
+      msEtagMatch(inm, a->etag))
+   {
+      return 304;
+   }
+   /* Range offsets apply to the stored, possibly compressed, data */
+   if( (rc=MST_getRange(o, a->etag, a->len, offset, len)) < 0 )
+      return 416;
+   if(rc)
+      return 206;
+   *len=a->len;
+   return 200;
+}
+
+
+/* Format the response header for asset 'a' in the send buffer */
+static int
+msAssetHeader(MST* o, const MSAsset* a, int status, U32 offset, U32 len,
+              const U8* extHeader)
+{
+   U8* sbuf=MST_getSendBufPtr(o);
+   U8* ptr;
+   int slen=MST_getSendBufSize(o);
+   if(status == 304)
+   {
+      ptr=msCpAndInc(sbuf,&slen,(const U8*)"HTTP/1.0 304 Not Modified",25);
+      ptr=msAddHeader(ptr,&slen,"ETag",a->etag);
+   }
+   else if(status == 416)
+   {
+      ptr=msCpAndInc(sbuf,&slen,(const U8*)
+                     "HTTP/1.0 416 Range Not Satisfiable\r\n"
+                     "Content-Length: 0\r\nContent-Range: bytes */",0);
+      ptr=msi2a(ptr,&slen,a->len);
+   }
+   else
+   {
+      if(status == 206)
+      {
+         ptr=msCpAndInc(sbuf,&slen,(const U8*)
+                        "HTTP/1.0 206 Partial Content\r\nContent-Length: ",0);
+         ptr=msi2a(ptr,&slen,len);
+         ptr=msCpAndInc(ptr,&slen,(const U8*)"\r\nContent-Range: bytes ",0);
+         ptr=msi2a(ptr,&slen,offset);
+         ptr=msCpAndInc(ptr,&slen,(const U8*)"-",1);
+         ptr=msi2a(ptr,&slen,offset+len-1);
+         ptr=msCpAndInc(ptr,&slen,(const U8*)"/",1);
+         ptr=msi2a(ptr,&slen,a->len);
+      }
+      else
+      {
+         ptr=msCpAndInc(sbuf,&slen,
+                        (const U8*)"HTTP/1.0 200 OK\r\nContent-Length: ",33);
+         ptr=msi2a(ptr,&slen,len);
+      }
+      if(a->contentType)
+         ptr=msAddHeader(ptr,&slen,"Content-Type",a->contentType);
+      if(a->encoding)
+         ptr=msAddHeader(ptr,&slen,"Content-Encoding",a->encoding);
+      if(a->etag)
+         ptr=msAddHeader(ptr,&slen,"ETag",a->etag);
+   }
+   if(a->cacheControl && status != 416)
+      ptr=msAddHeader(ptr,&slen,"Cache-Control",a->cacheControl);
+   if(status == 200 || status == 206)
+      ptr=msAddHeader(ptr,&slen,"Accept-Ranges","bytes");
+   if(extHeader)
+      ptr=msCpAndInc(ptr,&slen,extHeader,0);
+   if( (ptr=msCpAndInc(ptr,&slen,MST_respEnd(o),0)) == 0 )
+      return MS_ERR_ALLOC;
+   return (int)(ptr-sbuf);
+}
+
+
+int
+MST_respAsset(MST* o, const MSAsset* a, const U8* extHeader,
+              U32* offset, U32* len)
+{
+   int status=msAssetStatus(o, a, offset, len);
+   return msAssetHeader(o, a, status, *offset, *len, extHeader);
+}
+
+
+#ifdef MS_DEFLATE
+static voidpf msZalloc(voidpf opaque, uInt items, uInt size);
+static void msZfree(voidpf opaque, voidpf address);
+
+/* Send gzip asset 'a' decompressed: the header in the send buffer
+ * followed by 'len' bytes starting at 'offset' in the decompressed
+ * data. The data is decompressed into the send buffer.
+ */
+static int
+msAssetInflate(MST* mst, const MSAsset* a, int hlen, U32 offset, U32 len)
+{
+   z_stream z;
+   U8* buf=MST_getSendBufPtr(mst);
+   int n=hlen;
+   int rc=Z_OK;
+   memset(&z, 0, sizeof(z));
+   z.zalloc=msZalloc;
+   z.zfree=msZfree;
+   if(inflateInit2(&z, MS_GZIP_WINDOW_BITS+16) != Z_OK)
+      return MS_ERR_ALLOC;
+   z.next_in=(Bytef*)a->data;
+   z.avail_in=a->len;
+   while(len && rc == Z_OK)
+   {
+      U32 out;
+      int size;
+      if(n == MST_getSendBufSize(mst))
+      {
+         if(MST_write(mst, 0, n) < 0)
+            break;
+         n=0;
+         buf=MST_getSendBufPtr(mst);
+      }
+      size=MST_getSendBufSize(mst)-n;
+      z.next_out=buf+n;
+      z.avail_out=(uInt)size;
+      rc=inflate(&z, Z_NO_FLUSH);
+      if(rc != Z_OK && rc != Z_STREAM_END)
+         break;
+      out=(U32)size-z.avail_out;
+      if(offset)
+      {  /* Range request: discard the data before the range */
+         U32 skip = offset < out ? offset : out;
+         memmove(buf+n, buf+n+skip, out-skip);
+         offset-=skip;
+         out-=skip;
+      }
+      if(out > len)
+         out=len;
+      n+=(int)out;
+      len-=out;
+   }
+   inflateEnd(&z);
+   if(len)
+      return MS_ERR_WRITE; /* Socket error or corrupt asset */
+   return n && MST_write(mst, 0, n) < 0 ? MS_ERR_WRITE : 1;
+}
+
+
+/* Send the uncompressed gzip asset 'a' to a client not accepting gzip.
+ * The uncompressed size is in the gzip trailer and the ETag is the
+ * asset's ETag with the suffix "-id".
+ */
+static int
+msRouteSendIdentity(MST* mst, const MSAsset* a)
+{
+   MSAsset id;
+   char etag[48];
+   int hlen,status;
+   U32 offset,len;
+   const U8* t=a->data+a->len-4;
+   id=*a;
+   id.encoding=0;
+   id.resp=0;
+   id.len=(U32)t[0] | (U32)t[1] << 8 | (U32)t[2] << 16 | (U32)t[3] << 24;
+   if(a->etag)
+   {
+      int elen=(int)strlen(a->etag);
+      if(elen < 2 || elen > (int)sizeof(etag)-4)
+         id.etag=0;
+      else
+      {
+         memcpy(etag, a->etag, elen-1);
+         strcpy(etag+elen-1, "-id\"");
+         id.etag=etag;
+      }
+   }
+   status=msAssetStatus(mst, &id, &offset, &len);
+   hlen=msAssetHeader(mst, &id, status, offset, len,
+                      (const U8*)"\r\nVary: Accept-Encoding");
+   if(hlen < 0)
+      return hlen;
+   if(!len)
+      return MST_write(mst, 0, hlen) < 0 ? MS_ERR_WRITE : 1;
+   return msAssetInflate(mst, a, hlen, offset, len);
+}
+#endif
+
+
+int
+msRouteFetchPage(void* hndl, MST* mst, U8* path)
+{
+   int hlen,status;
+   U32 offset,len;
+   const MSAsset* a=MSRouteTable_find((MSRouteTable*)hndl, path);
+   if(!a)
+      return 0; /* Not found */
+   if(a->encoding)
+   {  /* Content-Encoding negotiation */
+      if(a->alt && a->alt->encoding &&
+         MST_acceptEncoding(mst, a->alt->encoding))
+      {
+         a=a->alt;
+      }
+#ifdef MS_DEFLATE
+      else if(!MST_acceptEncoding(mst, a->encoding) &&
+              !strcmp(a->encoding, "gzip") && a->len >= 18 &&
+              a->data[0] == 0x1F && a->data[1] == 0x8B)
+      {
+         return msRouteSendIdentity(mst, a);
+      }
+#endif
+   }
+   status=msAssetStatus(mst, a, &offset, &len);
+   if(status == 200 && a->resp &&
+      a->data == a->resp + a->hdrLen + sizeof(httpEORKeepAlive) - 1)
+   {  /* Pre-built response */
+      MSIoVec iov[3];
+      int n;
+      const U8* eor=MST_respEnd(mst);
+      iov[0].data=a->resp;
+      if(eor == httpEORKeepAlive)
+      {  /* Header and content as one chunk */
+         iov[0].len=(int)(a->data + a->len - a->resp);
+         n=1;
+      }
+      else
+      {  /* Replace the persistent connection headers */
+         iov[0].len=a->hdrLen;
+         iov[1].data=eor;
+         iov[1].len=sizeof(httpEOR) - 1;
+         iov[2].data=a->data;
+         iov[2].len=(int)a->len;
+         n=3;
+      }
+      return MST_writev(mst, iov, n) < 0 ? MS_ERR_WRITE : 1;
+   }
+   hlen=msAssetHeader(mst, a, status, offset, len, a->encoding ?
+                      (const U8*)"\r\nVary: Accept-Encoding" : 0);
+   if(hlen < 0)
+      return hlen;
+   /* Send the header in the send buffer and the asset in flash */
+   return MST_writeRef(mst, hlen, a->data+offset, (int)len) < 0 ?
+      MS_ERR_WRITE : 1;
+}
+
+/**************************** End route table ******************************/
+
+
+#ifdef MS_SEC
+static int
+MS_sslHandshake(MS* o)
+{
+   int rc;
+   if( (rc = seSec_handshake(o->mst.u.sc, o->mst.sock, 3000, 0)) <= 0 )
+   {
+      xprintf(("SSL handshake failed %d\n", rc));
+      return MS_ERR_SSL_HANDSHAKE;
+   }
+   return 0;
+}
+#endif
+
+
+/* Set the (server to client i.e. unmasked) frame header for a 'len'
+ * long payload. Returns the header size: 2, 4, or 10 bytes.
+ */
+static int
+MS_setFrameHeader(U8* buf, U8 opCode, int len)
+{
+   buf[0] = opCode;
+   if(len < 126)
+   {
+      buf[1] = (U8)len;
+      return 2;
+   }
+   if(len <= 0xFFFF)
+   {
+      buf[1] = 126;
+      buf[2] = (U8)((unsigned)len >> 8); /* high */
+      buf[3] = (U8)len; /* low */
+      return 4;
+   }
+   buf[1] = 127; /* RFC6455 5.2: 64 bit length, but 'len' is max 2^31-1 */
+   buf[2] = buf[3] = buf[4] = buf[5] = 0;
+   buf[6] = (U8)((unsigned)len >> 24);
+   buf[7] = (U8)((unsigned)len >> 16);
+   buf[8] = (U8)((unsigned)len >> 8);
+   buf[9] = (U8)len;
+   return 10;
+}
+
+
+#ifdef MS_DEFLATE
+/************************* permessage-deflate ******************************/
+
+#define MS_RSV1 0x40 /* RFC7692 6: Set in first frame of compressed msg */
+
+static voidpf
+msZalloc(voidpf opaque, uInt items, uInt size)
+{
+   (void)opaque;
+   return MS_DEFLATE_ALLOC(items*size);
+}
+
+static void
+msZfree(voidpf opaque, voidpf address)
+{
+   (void)opaque;
+   MS_DEFLATE_FREE(address);
+}
+
+
+void
+MS_destructor(MS* o)
+{
+   MSDeflate* d=&o->pmd;
+   if(d->active)
+   {
+      inflateEnd(&d->zin);
+      deflateEnd(&d->zout);
+      MS_DEFLATE_FREE(d->inBuf);
+      d->active=FALSE;
+   }
+}
+
+
+static int
+msPmdInit(MS* o, int serverBits, int clientBits, int flags)
+{
+   MSDeflate* d=&o->pmd;
+   int sendBufSize=MST_getSendBufSize(&o->mst);
+   /* The compressed data from one MS_send call must fit in outBuf
+      since the input is in the send buffer (Ref-ob).
+    */
+   int outBufSize = sendBufSize + sendBufSize/8 + 64;
+   U8* buf = (U8*)MS_DEFLATE_ALLOC(MS_INFLATE_BUF_SIZE + outBufSize);
+   if(!buf)
+      return -1;
+   memset(d, 0, sizeof(MSDeflate));
+   d->zin.zalloc=d->zout.zalloc=msZalloc;
+   d->zin.zfree=d->zout.zfree=msZfree;
+   /* Negative window bits: raw deflate data without zlib header */
+   if(inflateInit2(&d->zin, -clientBits) != Z_OK)
+   {
+      MS_DEFLATE_FREE(buf);
+      return -1;
+   }
+   if(deflateInit2(&d->zout, MS_DEFLATE_LEVEL, Z_DEFLATED, -serverBits,
+                   MS_DEFLATE_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+   {
+      inflateEnd(&d->zin);
+      MS_DEFLATE_FREE(buf);
+      return -1;
+   }
+   d->inBuf=buf;
+   d->outBuf=buf+MS_INFLATE_BUF_SIZE;
+   d->outBufSize=outBufSize;
+   d->flags=(U8)flags;
+   d->active=TRUE;
+   return 0;
+}
+
+
+/* Extract the token at 'ptr' from the Sec-WebSocket-Extensions header.
+ * Returns a pointer to the delimiter (';', ',', '=', or end of string).
+ */
+static const U8*
+msPmdToken(const U8* ptr, const U8** tok, int* len)
+{
+   while(*ptr == ' ' || *ptr == '\t') ptr++;
+   *tok=ptr;
+   while(*ptr && *ptr != ';' && *ptr != ',' && *ptr != '=' &&
+         *ptr != ' ' && *ptr != '\t')
+   {
+      ptr++;
+   }
+   *len=(int)(ptr - *tok);
+   while(*ptr == ' ' || *ptr == '\t') ptr++;
+   return ptr;
+}
+
+
+/* Returns the window bits value, 8 to 15, or 0 if not valid */
+static int
+msPmdBits(const U8* val, int len)
+{
+   if(len > 2 && val[0] == '"' && val[len-1] == '"')
+   {
+      val++;
+      len-=2;
+   }
+   if(len == 1 && val[0] >= '8' && val[0] <= '9')
+      return val[0]-'0';
+   if(len == 2 && val[0] == '1' && val[1] >= '0' && val[1] <= '5')
+      return 10+val[1]-'0';
+   return 0;
+}
+
+#define msPmdIs(tok, len, name) \
+   (len == sizeof(name)-1 && !memcmp(tok, name, sizeof(name)-1))
+
+
+/* Accept the first permessage-deflate offer in the client's
+ * Sec-WebSocket-Extensions header 'ext' we can support, initialize
+ * the compressor, and add the response header to 'dest'. Returns
+ * 'dest' if no offer is accepted and NULL if 'dest' is too small.
+ */
+static U8*
+msPmdNegotiate(MS* o, WssProtocolHandshake* wph, const U8* ext,
+               U8* dest, int* dlen)
+{
+   const U8* ptr=ext;
+   while(*ptr)
+   {
+      const U8* tok;
+      int len,bits;
+      int serverBits = wph->deflateWindowBits < 9 ? 9 :
+         (wph->deflateWindowBits > 15 ? 15 : wph->deflateWindowBits);
+      int clientBits = wph->inflateWindowBits >= 8 &&
+         wph->inflateWindowBits < 15 ? wph->inflateWindowBits : 15;
+      int flags = wph->noContextTakeover;
+      BaBool clientBitsOffered=FALSE;
+      BaBool ok;
+      ptr=msPmdToken(ptr, &tok, &len);
+      ok = msPmdIs(tok, len, "permessage-deflate");
+      while(*ptr == ';') /* Extension parameters */
+      {
+         const U8* val=0;
+         int vlen=0;
+         ptr=msPmdToken(ptr+1, &tok, &len);
+         if(*ptr == '=')
+            ptr=msPmdToken(ptr+1, &val, &vlen);
+         if(msPmdIs(tok, len, "server_no_context_takeover"))
+            flags |= MS_PMD_SERVER_NCT;
+         else if(msPmdIs(tok, len, "client_no_context_takeover"))
+            ; /* A hint; we reset only if requested in the response */
+         else if(msPmdIs(tok, len, "server_max_window_bits"))
+         {  /* zlib does not support an 8 bit window when compressing */
+            if( (bits=msPmdBits(val, vlen)) < 9 )
+               ok=FALSE;
+            else if(bits < serverBits)
+               serverBits=bits;
+         }
+         else if(msPmdIs(tok, len, "client_max_window_bits"))
+         {
+            clientBitsOffered=TRUE;
+            if(val)
+            {
+               if( (bits=msPmdBits(val, vlen)) == 0 )
+                  ok=FALSE;
+               else if(bits < clientBits)
+                  clientBits=bits;
+            }
+         }
+         else
+            ok=FALSE;
+      }
+      /* We cannot limit the client's window if it did not offer it */
+      if(ok && (clientBitsOffered || clientBits == 15))
+      {
+         if(msPmdInit(o, serverBits, clientBits, flags))
+            return dest; /* Not enough memory: no compression */
+         dest=msCpAndInc(dest, dlen, (const U8*)
+                         "\r\nSec-WebSocket-Extensions: permessage-deflate",
+                         46);
+         if(flags & MS_PMD_SERVER_NCT)
+            dest=msCpAndInc(dest, dlen,
+                            (const U8*)"; server_no_context_takeover", 28);
+         if(flags & MS_PMD_CLIENT_NCT)
+            dest=msCpAndInc(dest, dlen,
+                            (const U8*)"; client_no_context_takeover", 28);
+         if(serverBits < 15)
+         {
+            dest=msCpAndInc(dest, dlen,
+                            (const U8*)"; server_max_window_bits=", 25);
+            dest=msi2a(dest, dlen, (U32)serverBits);
+         }
+         if(clientBits < 15)
+         {
+            dest=msCpAndInc(dest, dlen,
+                            (const U8*)"; client_max_window_bits=", 25);
+            dest=msi2a(dest, dlen, (U32)clientBits);
+         }
+         return dest;
+      }
+      while(*ptr && *ptr != ',') ptr++; /* Next offer */
+      if(*ptr) ptr++;
+   }
+   return dest;
+}
+
+
+/* Returns TRUE if the data frame should be compressed */
+static BaBool
+MS_pmdCompress(MS* o, U8 opCode, int len)
+{
+   MSDeflate* d=&o->pmd;
+   if( ! d->active || (opCode & 0x08) ) /* Control frames not compressed */
+      return FALSE;
+   if(d->sending) /* Fragmented compressed message */
+      return TRUE;
+   /* First frame: always compress fragmented messages */
+   if( ! (opCode & WSOP_FIN) || len >= MS_DEFLATE_MIN_LEN )
+   {
+      d->sendOp = opCode & 0x0F;
+      return TRUE;
+   }
+   return FALSE;
+}
+
+
+/* Returns the opcode for the next compressed frame */
+static U8
+MS_pmdOpCode(MSDeflate* d, BaBool fin)
+{
+   U8 op = d->sending ? WSOP_Continue : (U8)(d->sendOp | MS_RSV1);
+   d->sending = fin ? FALSE : TRUE;
+   return fin ? (U8)(op | WSOP_FIN) : op;
+}
+
+
+/* Compress 'len' bytes and send the data. The compressor is flushed
+ * (Z_SYNC_FLUSH) on each call, thus the frame sent includes all data.
+ * More than one frame is sent if the data does not fit in outBuf, which
+ * can only happen when called by MS_write (Ref-ob). The flush marker
+ * 00 00 FF FF is removed from the frame ending the message
+ * (RFC7692 7.2.1).
+ */
+static int
+MS_deflateSend(MS* o, U8 opCode, const U8* data, int len)
+{
+   MSDeflate* d=&o->pmd;
+   BaBool fin = (opCode & WSOP_FIN) ? TRUE : FALSE;
+   int n=0; /* Bytes in outBuf */
+   U8 hdr[10];
+   MSIoVec iov[2];
+   iov[0].data=hdr;
+   iov[1].data=d->outBuf;
+   d->zout.next_in=(Bytef*)data;
+   d->zout.avail_in=(uInt)len;
+   for(;;)
+   {
+      d->zout.next_out=d->outBuf+n;
+      d->zout.avail_out=(uInt)(d->outBufSize-n);
+      deflate(&d->zout, Z_SYNC_FLUSH); /* Z_OK or Z_BUF_ERROR */
+      n = d->outBufSize - (int)d->zout.avail_out;
+      if(d->zout.avail_out)
+         break; /* All data flushed */
+      /* Full: keep the last 4 bytes, which may be the flush marker */
+      iov[0].len=MS_setFrameHeader(hdr, MS_pmdOpCode(d, FALSE), n-4);
+      iov[1].len=n-4;
+      if(MST_writev(&o->mst, iov, 2) < 0)
+         return MS_ERR_WRITE;
+      memcpy(d->outBuf, d->outBuf+n-4, 4);
+      n=4;
+   }
+   if(fin)
+      n-=4;
+   iov[0].len=MS_setFrameHeader(hdr, MS_pmdOpCode(d, fin), n);
+   iov[1].len=n;
+   if(MST_writev(&o->mst, iov, 2) < 0)
+      return MS_ERR_WRITE;
+   if(fin && (d->flags & MS_PMD_SERVER_NCT))
+      deflateReset(&d->zout);
+   return len;
+}
+
+/*********************** End permessage-deflate ****************************/
+#endif
+
+
+/* Request headers used by the web server. The value is the header's
+ * slot in msHttpHdrTab and in WssProtocolHandshake:hIndex. The slot
+ * is (length + lower case first character) & 15, a perfect hash for
+ * the names in the table.
+ */
+#define MSH_ACCEPT_ENCODING 0
+#define MSH_IF_RANGE 1
+#define MSH_SEC_WEBSOCKET_KEY 4
+#define MSH_ORIGIN 5
+#define MSH_IF_NONE_MATCH 6
+#define MSH_RANGE 7
+#define MSH_SEC_WEBSOCKET_EXTENSIONS 11
+#define MSH_CONNECTION 13
+#define MSH_AUTHORIZATION 14
+#define MSH_USER_AGENT 15
+
+#define msHttpHdrHash(key, len) (((len) + tolower(*(key))) & 15)
+
+static const char* const msHttpHdrTab[16]={
+   "accept-encoding", "if-range", 0, 0,
+   "sec-websocket-key", "origin", "if-none-match", "range",
+   0, 0, 0, "sec-websocket-extensions",
+   0, "connection", "authorization", "user-agent"
+};
+
+/* Returns the value of request header 'slot' (MSH_XXX) or NULL */
+#define msHttpHdrVal(wph, slot) \
+   ((wph)->hIndex[slot] ? (wph)->hVals[(wph)->hIndex[slot]-1] : 0)
+
+
+/* Returns the slot (MSH_XXX) for header 'key' or -1 if not used */
+static int
+msHttpHdrLookup(const U8* key, int len)
+{
+   int slot=msHttpHdrHash(key, len);
+   const U8* name=(const U8*)msHttpHdrTab[slot];
+   if(!name)
+      return -1;
+   while(len && *name && tolower(*key) == *name)
+   {
+      key++;
+      name++;
+      len--;
+   }
+   return len || *name ? -1 : slot;
+}
+
+
+const U8*
+MST_getHeader(MST* o, const char* name)
+{
+   WssProtocolHandshake* wph=o->wph;
+   int i,slot;
+   int len=(int)strlen(name);
+   if(!wph)
+      return 0;
+   if( (slot=msHttpHdrLookup((const U8*)name, len)) >= 0 )
+      return msHttpHdrVal(wph, slot);
+   for(i=0 ; i < wph->hIx ; i++)
+   {
+      const U8* key=wph->hKeys[i];
+      const U8* n=(const U8*)name;
+      while(*n && tolower(*key) == tolower(*n))
+      {
+         key++;
+         n++;
+      }
+      if(!*n && !*key)
+         return wph->hVals[i];
+   }
+   return 0;
+}
+
+
+/* Parse a decimal number. Returns the number, saturated at 0xFFFFFFFF,
+ * or sets '*ptr' to NULL if 'str' does not start with a digit.
+ */
+static U32
+msRangeNum(const U8** ptr)
 {
-   return o->b.sendBufSize;
+   const U8* str=*ptr;
+   U32 n=0;
+   if(*str < '0' || *str > '9')
+   {
+      *ptr=0;
+      return 0;
+   }
+   while(*str >= '0' && *str <= '9')
+   {
+      U32 d = (U32)(*str++ - '0');
+      n = n > (0xFFFFFFFF - d) / 10 ? 0xFFFFFFFF : n*10 + d;
+   }
+   *ptr=str;
+   return n;
 }
-#endif
+
 
 int
-MST_read(struct MST* o,U8 **buf,U32 timeout)
+MST_getRange(MST* o, const char* etag, U32 size, U32* offset, U32* len)
 {
-#ifdef MS_SEC
-   return  o->isSecure ?
-      seSec_read(o->u.sc,o->sock,buf,timeout) : MST_nonSecRead(o,buf,timeout);
-#else
-   *buf = o->b.recBuf;
-   return se_recv(o->sock, *buf, o->b.recBufSize, timeout);
-#endif
+   const U8* ptr;
+   const U8* ifRange;
+   U32 first,last;
+   if( (ptr=MST_getHeader(o, "Range")) == 0 ||
+       strncmp((const char*)ptr, "bytes=", 6) )
+      return 0;
+   /* RFC 7233 3.2: send the full resource if the resource changed */
+   if( (ifRange=MST_getHeader(o, "If-Range")) != 0 &&
+       (!etag || strcmp((const char*)ifRange, etag)) )
+   {
+      return 0;
+   }
+   ptr+=6;
+   while(*ptr == ' ') ptr++;
+   if(*ptr == '-')
+   {  /* Suffix range: the last N bytes */
+      ptr++;
+      if( (last=msRangeNum(&ptr)) == 0 )
+         return ptr ? -1 : 0;
+      first = last >= size ? 0 : size-last;
+      last=size-1;
+   }
+   else
+   {
+      const U8* end;
+      first=msRangeNum(&ptr);
+      if(!ptr || *ptr++ != '-')
+         return 0;
+      end=ptr;
+      last=msRangeNum(&end);
+      if(!end)
+         last=size-1; /* "first-": to the end */
+      else if(last < first)
+         return 0; /* Invalid: ignore */
+      else
+      {
+         ptr=end;
+         if(last >= size)
+            last=size-1;
+      }
+   }
+   while(*ptr == ' ') ptr++;
+   if(*ptr)
+      return 0; /* Multiple ranges are not supported: send all */
+   if(first >= size)
+      return -1;
+   *offset=first;
+   *len=last-first+1;
+   return 1;
 }
 
-int
-MST_write(struct MST* o,U8* buf, int len)
+
+BaBool
+MST_acceptEncoding(MST* o, const char* encoding)
 {
-#ifdef MS_SEC
-   return  o->isSecure ?
-      seSec_write(o->u.sc,o->sock,buf,len) : MST_nonSecWrite(o,buf,len);
-#else
-   return se_send(o->sock, buf ? buf : o->b.sendBuf, len);
-#endif
+   const U8* ptr=MST_getHeader(o, "Accept-Encoding");
+   int len=(int)strlen(encoding);
+   int star=0; /* 1: "*" accepts encodings not listed */
+   if(!ptr)
+      return FALSE;
+   while(*ptr)
+   {
+      const U8* tok;
+      int i,tlen;
+      BaBool q0;
+      while(*ptr == ' ' || *ptr == '\t' || *ptr == ',') ptr++;
+      tok=ptr;
+      while(*ptr && *ptr != ',' && *ptr != ';' && *ptr != ' ' && *ptr != '\t')
+         ptr++;
+      tlen=(int)(ptr-tok);
+      /* Parameters: "q=0" (RFC 7231 5.3.1) rejects the encoding */
+      for(q0=FALSE ; *ptr && *ptr != ',' ; ptr++)
+      {
+         if((*ptr == 'q' || *ptr == 'Q') && ptr[1] == '=' && ptr[2] == '0')
+         {
+            const U8* v=ptr+3;
+            while(*v == '0' || *v == '.') v++;
+            q0 = !*v || *v == ',' || *v == ' ' || *v == ';';
+         }
+      }
+      if(tlen == 1 && *tok == '*')
+         star = q0 ? 0 : 1;
+      else if(tlen == len)
+      {
+         for(i=0 ; i < len && tolower(tok[i]) == tolower(encoding[i]) ; i++)
+            ;
+         if(i == len)
+            return !q0;
+      }
+   }
+   return star;
 }
 
 
-U8*
-MS_respCT(MS* o, int* dlen, int contentLen, const U8* extHeader)
+/* Prepare the tokenizer for a new request header */
+static void
+msHttpReqReset(WssProtocolHandshake* wph)
 {
-   *dlen = MST_getSendBufSize(&o->mst);
-   return msRespCT(MST_getSendBufPtr(&o->mst), dlen, contentLen, extHeader);
+   wph->request=0;
+   wph->origin=0;
+   wph->hKeys[0]=wph->hVals[0]=0;
+   wph->hIx=0;
+   wph->lineStart=0;
+   wph->scanned=0;
+   memset(wph->hIndex, 0, sizeof(wph->hIndex));
 }
 
 
-int
-MS_webServer(MS* o, WssProtocolHandshake* wph)
+/* Move the pointers set by the tokenizer when the header is copied
+ * from buffer 'from' to buffer 'to'.
+ */
+static void
+msHttpReqRebase(WssProtocolHandshake* wph, U8* from, U8* to)
 {
-   static const U8 httpEndMarker[]={"\r\n\r\n"};
-
-   int i,rc;
-   int sblen=0;
-   U8* end;
-   U8* rbuf;
-   U8* sbuf=0;
-   U8* ptr=0;
-   int hIx=0; /* HTTP header index */
-   int delayOnSend=FALSE;
+   int i;
+   if(wph->request)
+      wph->request = to + (wph->request - from);
+   for(i=0 ; i < wph->hIx ; i++)
+   {
+      wph->hKeys[i] = to + (wph->hKeys[i] - from);
+      if(wph->hVals[i])
+         wph->hVals[i] = to + (wph->hVals[i] - from);
+   }
+}
 
-   /* Extracted HTTP header values */
-   U8* key=0;
-   U8* auth=0;
-   wph->request=0;
 
-#ifdef MS_SEC
-   if(o->mst.isSecure)
+/* Single pass HTTP request header tokenizer. Scans the 'len' bytes in
+ * 'buf', the header received so far, from where the previous call
+ * stopped. Each complete line is split in place into the request line
+ * or a key/value pair, and known headers are recorded in
+ * WssProtocolHandshake:hIndex. Returns the header size when the empty
+ * line ending the header is found, zero if more data is needed, or an
+ * error code.
+ */
+static int
+msHttpReqTokenize(WssProtocolHandshake* wph, U8* buf, int len)
+{
+   U8* ptr=buf+wph->scanned;
+   U8* end=buf+len;
+   U8* nl;
+   while( (nl=(U8*)memchr(ptr, '\n', end-ptr)) != 0 )
    {
-      if( (rc = seSec_handshake(o->mst.u.sc, o->mst.sock, 3000, 0)) <= 0 )
+      U8* line=buf+wph->lineStart;
+      U8* eol = nl > line && nl[-1] == '\r' ? nl-1 : nl;
+      ptr=nl+1;
+      wph->lineStart=(int)(ptr-buf);
+      if(eol == line)
+      {
+         if(wph->request) /* End of header */
+         {
+            if(wph->hIx < MAX_HTTP_H_SIZE)
+               wph->hKeys[wph->hIx]=wph->hVals[wph->hIx]=0;
+            wph->scanned=wph->lineStart;
+            return wph->lineStart;
+         }
+         continue; /* RFC 7230 3.5: ignore empty lines before request */
+      }
+      *eol=0;
+      if(wph->request)
       {
-         xprintf(("SSL handshake failed %d\n", rc));
-         return MS_ERR_SSL_HANDSHAKE;
+         U8* val=(U8*)memchr(line, ':', eol-line);
+         int slot;
+         if(!val)
+            return MS_ERR_INVALID_HTTP;
+         if(wph->hIx == MAX_HTTP_H_SIZE)
+            return MS_ERR_HTTP_HEADER_OVERFLOW;
+         if( (slot=msHttpHdrLookup(line, (int)(val-line))) >= 0 &&
+             !wph->hIndex[slot] )
+         {
+            wph->hIndex[slot]=(U8)(wph->hIx+1);
+         }
+         *val++=0;
+         while(*val == ' ' || *val == '\t') val++;
+         wph->hKeys[wph->hIx]=line;
+         wph->hVals[wph->hIx]= *val ? val : 0;
+         wph->hIx++;
       }
+      else
+         wph->request=line;
    }
-#endif
+   wph->scanned=len;
+   return 0;
+}
+
 
+/* Read the HTTP request header. Returns zero when the complete header
+ * is in *rbuf and has been tokenized. A timeout of zero makes the
+ * function return MS_NEED_MORE when no more data is available. The
+ * header is saved in the send buffer and WssProtocolHandshake:reqLen
+ * is the size saved so far if the header is split into multiple
+ * chunks. WssProtocolHandshake:pipelined is set if data follows the
+ * header.
+ */
+static int
+MS_readHttpReq(MS* o, WssProtocolHandshake* wph, U32 timeout, U8** rbuf)
+{
+   int rc,sblen;
+   U8* sbuf;
    for(;;)
    {
-      if( (rc = MST_read(&o->mst,&rbuf,100)) <= 0 )
+      if( (rc = MST_read(&o->mst,rbuf,timeout)) <= 0 )
       {
-         xprintf(("HTTP request header error: %s.\n",
-                  rc == 0 ? "timeout" : "connection closed"));
+         if(rc == 0 && timeout == 0)
+            return MS_NEED_MORE;
+         if( ! (o->mst.keepAlive & MST_KA_RESP) ) /* If not idle */
+            xprintf(("HTTP request header error: %s.\n",
+                     rc == 0 ? "timeout" : "connection closed"));
          return rc == 0 ? MS_ERR_READ_TMO :  MS_ERR_READ;
       }
-      end=msstrstrn(rbuf, rc, httpEndMarker);
-      if(end && !ptr) /*Most browsers send the complete header in first frame*/
-         break; 
-      /* We use the SharkSSL send buffer for temp storage */
-      if(!ptr)
-         sbuf = ptr = MS_prepSend(o, FALSE, &sblen);
-      if(sblen < rc)
+      /*Most browsers send the complete header in first frame*/
+      if(!wph->reqLen)
       {
-         xprintf(("HTTP request header too big\n"));
-         return MS_ERR_HTTP_HEADER_OVERFLOW;
+         msHttpReqReset(wph);
+         if( (sblen=msHttpReqTokenize(wph, *rbuf, rc)) != 0 )
+         {
+            if(sblen < 0)
+               break;
+            wph->pipelined = sblen != rc;
+            return 0;
+         }
       }
-      memcpy(ptr,rbuf,rc);
-      ptr+=rc;
-      sblen-=rc;
-      if((end=msstrstrn(sbuf, ptr-sbuf, httpEndMarker)) != 0)
+      /* We use the SharkSSL send buffer for temp storage */
+      sbuf = MS_prepSend(o, FALSE, &sblen);
+      if(sblen - wph->reqLen < rc)
       {
-         sblen=end-sbuf;
-         memcpy(rbuf,sbuf,sblen);
-         end=rbuf+sblen;
+         sblen=MS_ERR_HTTP_HEADER_OVERFLOW;
          break;
       }
-   }
-   end+=(sizeof(httpEndMarker)-1);
-   for(ptr = rbuf ; ptr < end;)
-   {
-      U8* next;
-      next = msstrstrn(ptr, end-ptr, (U8*)"\r\n");
-      if(next)
+      if(wph->reqLen)
+         memcpy(sbuf+wph->reqLen,*rbuf,rc);
+      else
       {
-         *next = 0;
-         if(wph->request)
-         {
-            wph->hKeys[hIx]=ptr;
-            wph->hVals[hIx]=getKeyVal(ptr);
-            hIx++;
-            if(hIx == MAX_HTTP_H_SIZE)
-               return MS_ERR_HTTP_HEADER_OVERFLOW;
-         }
-         else
-            wph->request=ptr;
-         ptr = next + 2;
+         memcpy(sbuf,*rbuf,rc);
+         msHttpReqRebase(wph, *rbuf, sbuf);
       }
-      else break;
-   }
-   if(!wph->request)
-   {
-      xprintf(("Cannot validate HTTP request header\n"));
-      return MS_ERR_INVALID_HTTP;
-   }
-   for(i = 0; i < hIx; i++)
-   {
-      ptr = wph->hKeys[i];
-      switch(*ptr)
+      wph->reqLen+=rc;
+      if( (sblen=msHttpReqTokenize(wph, sbuf, wph->reqLen)) != 0 )
       {
-         case 'A':
-         case 'a':
-            if(!auth && msstrstrn(ptr,100,(U8*)"Authorization"))
-               auth = wph->hVals[i];
+         if(sblen < 0)
             break;
+         memcpy(*rbuf,sbuf,sblen);
+         msHttpReqRebase(wph, sbuf, *rbuf);
+         wph->pipelined = wph->reqLen != sblen;
+         wph->reqLen=0;
+         return 0;
+      }
+   }
+   wph->reqLen=0;
+   xprintf(("%s\n", sblen == MS_ERR_HTTP_HEADER_OVERFLOW ?
+            "HTTP request header too big" :
+            "Cannot validate HTTP request header"));
+   return sblen;
+}
 
-         case 'O':
-         case 'o':
-            if(!wph->origin && msstrstrn(ptr,100,(U8*)"Origin"))
-               wph->origin = wph->hVals[i];
-            break;
 
-         case 's':
-         case 'S':
-            if(!key && msstrstrn(ptr,100,(U8*)"sec-WebSocket-Key"))
-               key=wph->hVals[i];
-            break;
+/* Send the response for the HTTP request header tokenized by
+ * MS_readHttpReq. Returns MS_KEEP_ALIVE if the response was sent and
+ * the connection is persistent.
+ */
+static int
+MS_manageHttpReq(MS* o, WssProtocolHandshake* wph)
+{
+   int rc;
+   int sblen=0;
+   U8* sbuf=0;
+   U8* ptr=0;
+   U8* end;
 
-         case 'u':
-         case 'U':
-            if(msstrstrn(ptr,100,(U8*)"User-Agent") &&
-               msstrstrn(wph->hVals[i],200,(U8*)"Safari"))
-            {
-               delayOnSend=TRUE;
-            }
-      }
+   /* Extracted HTTP header values */
+   U8* key=msHttpHdrVal(wph, MSH_SEC_WEBSOCKET_KEY);
+   U8* auth=msHttpHdrVal(wph, MSH_AUTHORIZATION);
+   U8* conn=msHttpHdrVal(wph, MSH_CONNECTION);
+#ifdef MS_DEFLATE
+   U8* ext=msHttpHdrVal(wph, MSH_SEC_WEBSOCKET_EXTENSIONS);
+   MS_destructor(o); /* Release previous connection's state, if any */
+#endif
+   wph->origin=msHttpHdrVal(wph, MSH_ORIGIN);
+   o->mst.keepAlive=0;
+
+   /* RFC 7230 6.3: HTTP/1.1 connections are persistent unless the
+    * client sends "Connection: close". Pipelined requests are not
+    * supported.
+    */
+   if(wph->keepAliveTmo && !key && !wph->pipelined &&
+      (conn ? msstrstrn(conn,100,(U8*)"keep-alive") != 0 :
+       msstrstrn(wph->request,strlen((char*)wph->request),
+                 (U8*)"HTTP/1.1") != 0))
+   {
+      o->mst.keepAlive=MST_KA_REQ;
    }
    sblen=MST_getSendBufSize(&o->mst);
    sbuf=MST_getSendBufPtr(&o->mst); /* Using zero copy SharkSSL API */
@@ -413,7 +1836,7 @@ MS_webServer(MS* o, WssProtocolHandshake* wph)
       ptr=msCpAndInc(sbuf,&sblen,rsp,sizeof(rsp)-1);
       ptr=msCpAndInc(ptr,&sblen,realm,strlen((char*)realm));
       ptr=msCpAndInc(ptr,&sblen,(const U8*)"\"",1);
-      ptr=msCpAndInc(ptr,&sblen,httpEOR,sizeof(httpEOR)-1);
+      ptr=msCpAndInc(ptr,&sblen,MST_respEnd(&o->mst),0);
       if((ptr=msCpAndInc(ptr,&sblen,ecode,21)) != 0)
       {
          rc=MS_ERR_AUTHENTICATION;
@@ -437,6 +1860,10 @@ MS_webServer(MS* o, WssProtocolHandshake* wph)
       SharkSslSha1Ctx_finish(&ctx,digest);
       ptr=msCpAndInc(sbuf,&sblen,wsUpgrade,sizeof(wsUpgrade)-1);
       ptr=msB64Encode(ptr, &sblen, digest, 20);
+#ifdef MS_DEFLATE
+      if(ptr && ext && wph->deflateWindowBits)
+         ptr=msPmdNegotiate(o, wph, ext, ptr, &sblen);
+#endif
       if((ptr=msCpAndInc(ptr,&sblen,(U8*)"\r\n\r\n", 4)) != 0)
          rc=0; /* OK */
       else
@@ -456,12 +1883,14 @@ MS_webServer(MS* o, WssProtocolHandshake* wph)
          if(*end && wph->fetchPage)
          {
             *end=0;
+            o->mst.wph=wph; /* For MST_getHeader */
             found = wph->fetchPage(wph->fetchPageHndl,&o->mst,ptr);
+            o->mst.wph=0;
             if(found) /* found or err */
             {
                ptr=0; /* HTTP response sent */
-               if(delayOnSend)
-                  MST_read(&o->mst,&rbuf,300);
+               if(found < 0)
+                  o->mst.keepAlive=0;
             }
          }
       }
@@ -472,7 +1901,7 @@ MS_webServer(MS* o, WssProtocolHandshake* wph)
             "HTTP/1.0 404 Not Found\r\n"
             "Content-Length: 18"};
          ptr=msCpAndInc(sbuf,&sblen,rsp,sizeof(rsp)-1);
-         ptr=msCpAndInc(ptr,&sblen,httpEOR,sizeof(httpEOR)-1);
+         ptr=msCpAndInc(ptr,&sblen,MST_respEnd(&o->mst),0);
          if((ptr=msCpAndInc(ptr,&sblen,ecode,18)) == 0)
             rc = MS_ERR_ALLOC;
       }
@@ -483,6 +1912,67 @@ MS_webServer(MS* o, WssProtocolHandshake* wph)
       if(MST_write(&o->mst, 0, ptr-sbuf) < 0)
          rc = MS_ERR_WRITE;
    }
+   if((o->mst.keepAlive & MST_KA_RESP) &&
+      (rc == MS_ERR_NOT_WEBSOCKET || rc == MS_ERR_AUTHENTICATION))
+   {
+      return MS_KEEP_ALIVE;
+   }
+   return rc;
+}
+
+int
+MS_webServer(MS* o, WssProtocolHandshake* wph)
+{
+   int rc;
+   U8* rbuf;
+   wph->reqLen=0;
+   o->mst.keepAlive=0;
+#ifdef MS_SEC
+   if(o->mst.isSecure && (rc=MS_sslHandshake(o)) != 0)
+      return rc;
+#endif
+   if( (rc=MS_readHttpReq(o, wph, 100, &rbuf)) != 0 )
+      return rc;
+   while( (rc=MS_manageHttpReq(o, wph)) == MS_KEEP_ALIVE )
+   {  /* Wait for the next request on the persistent connection */
+      if(MS_readHttpReq(o, wph, (U32)wph->keepAliveTmo*1000, &rbuf))
+         return MS_ERR_NOT_WEBSOCKET; /* Idle timeout or closed by peer */
+   }
+   if((rc == MS_ERR_NOT_WEBSOCKET || rc == MS_ERR_AUTHENTICATION) &&
+      !MST_shutdown(&o->mst))
+   {  /* Response sent. Closing the socket with unread data sends a
+       * reset: if the client sent more data, discard it and let the
+       * client close first. Otherwise, close without waiting.
+       */
+      if(MST_sockRead(&o->mst, MST_getSendBufPtr(&o->mst),
+                      MST_getSendBufSize(&o->mst), 0) > 0)
+      {
+         MST_linger(&o->mst, MS_LINGER_TMO);
+      }
+   }
+   return rc;
+}
+
+
+int
+MS_webServerFeed(MS* o, WssProtocolHandshake* wph)
+{
+   int rc;
+   U8* rbuf;
+   if( ! wph->started )
+   {
+      wph->started=TRUE;
+      wph->reqLen=0;
+      o->mst.keepAlive=0;
+#ifdef MS_SEC
+      if(o->mst.isSecure && (rc=MS_sslHandshake(o)) != 0)
+         return rc;
+#endif
+   }
+   if( (rc=MS_readHttpReq(o, wph, 0, &rbuf)) != 0 )
+      return rc;
+   if( (rc=MS_manageHttpReq(o, wph)) != MS_KEEP_ALIVE )
+      wph->started=FALSE; /* Prepare for next connection */
    return rc;
 }
 
@@ -505,6 +1995,17 @@ MS_prepSend(MS* o, int extSize, int* maxSize)
 
 
 
+/* Track fragmented messages for MS_broadcast. Control frames may be
+ * sent between the fragments.
+ */
+static void
+MS_setFragmented(MS* o, U8 opCode)
+{
+   if( ! (opCode & 0x08) )
+      o->fragmented = (opCode & WSOP_FIN) ? FALSE : TRUE;
+}
+
+
 int
 MS_send(MS* o, U8 opCode, int len)
 {
@@ -522,49 +2023,170 @@ MS_send(MS* o, U8 opCode, int len)
       if(len > 125) return MS_ERR_BUF_OVERFLOW;
       buf[1] = (U8)len;
    }
+   MS_setFragmented(o, opCode);
+#ifdef MS_DEFLATE
+   if(MS_pmdCompress(o, opCode, len))
+      return MS_deflateSend(o, opCode, buf + (buf[1] == 126 ? 4 : 2), len);
+#endif
    /* We must set length to zero when using the zero copy SharkSSL API */
    return MST_write(&o->mst, 0, len + (buf[1] == 126 ? 4 : 2));
 }
 
 
+/* Returns zero if the transmit queue can take a 'frameLen' long frame,
+ * which MST_sendv then sends or queues without blocking. Returns
+ * MS_WOULD_BLOCK and sets the blocked state if the queue is full, and
+ * MS_ERR_TXQ if the frame can never be sent without blocking.
+ */
+static int
+MS_txqFull(MS* o, int frameLen)
+{
+   MSTxQ* q=o->mst.txq;
+   if(!q)
+      return 0;
+   if(o->mst.isSecure || frameLen > q->size)
+      return MS_ERR_TXQ;
+   if(q->len >= q->highWater || q->size - q->len < frameLen)
+   {
+      q->blocked=TRUE;
+      return MS_WOULD_BLOCK;
+   }
+   return 0;
+}
+
+
+int
+MS_sendNB(MS* o, U8 opCode, int len)
+{
+   int rc;
+   /* The header is 2 or 4 bytes since the payload is in the send buffer */
+   int frameLen = len + (len < 126 ? 2 : 4);
+#ifdef MS_DEFLATE
+   if(o->pmd.active)
+      frameLen += len/8 + 64; /* Worst case expansion, see Ref-ob */
+#endif
+   if( (rc=MS_txqFull(o, frameLen)) != 0 )
+      return rc;
+   rc=MS_send(o, opCode, len);
+   return rc < 0 ? rc : 0;
+}
+
+
 int
 MS_write(MS *o, U8 opCode, const void* data, int len)
 {
    int rc;
-   U8* ptr = (U8*)data;
-   for(;;)
+   U8 hdr[10];
+   MSIoVec iov[2];
+   MS_setFragmented(o, opCode);
+#ifdef MS_DEFLATE
+   if(MS_pmdCompress(o, opCode, len))
    {
-      int chunk;
-      U8* buf;
-      /*Note: rc is SharkSSL maxLen i.e. buffer size and this cannot be < 125*/
-      buf = MS_prepSend(o, len > 125, &rc);
-      chunk = len < rc ? len : rc;
-      memcpy(buf,ptr,chunk);
-      len -= chunk;
-      if( (rc=MS_send(o,opCode,chunk)) < 0 )
-         return rc;
-      if(len == 0) break;
-      ptr += chunk;
+      rc=MS_deflateSend(o, opCode, (const U8*)data, len);
+      return rc < 0 ? rc : 0;
    }
+#endif
+   /* One frame: the header and the caller's data are sent in one
+    * system call in non secure mode, and streamed through the send
+    * buffer in secure mode.
+    */
+   iov[0].data=hdr;
+   iov[0].len=MS_setFrameHeader(hdr, opCode, len);
+   iov[1].data=data;
+   iov[1].len=len;
+   rc=MST_writev(&o->mst, iov, 2);
+   return rc < 0 ? rc : 0;
+}
+
+
+int
+MSGroup_add(MSGroup* o, MS* ms)
+{
+   if(o->len == o->size)
+      return -1;
+   o->list[o->len++]=ms;
    return 0;
 }
 
 
+void
+MSGroup_remove(MSGroup* o, MS* ms)
+{
+   int i;
+   for(i=0 ; i < o->len ; i++)
+   {
+      if(o->list[i] == ms)
+      {  /* Order not maintained: move the last member */
+         o->list[i]=o->list[--o->len];
+         return;
+      }
+   }
+}
+
+
+int
+MS_broadcast(MSGroup* o, U8 opCode, const void* data, int len)
+{
+   int i;
+   int sent=0;
+   U8 hdr[10];
+   MSIoVec iov[2];
+   iov[0].data=hdr;
+   iov[0].len=MS_setFrameHeader(hdr, opCode, len);
+   iov[1].data=data;
+   iov[1].len=len;
+   for(i=0 ; i < o->len ; i++)
+   {
+      MS* ms=o->list[i];
+      int rc;
+      if(ms->fragmented)
+         continue;
+      if( (rc=MS_txqFull(ms, iov[0].len+len)) == 0 &&
+          (rc=MST_writev(&ms->mst, iov, 2)) >= 0 )
+      {
+         sent++;
+      }
+      else if(rc < 0 && o->onError)
+         o->onError(o, ms, rc);
+   }
+   return sent;
+}
+
+
+int
+MS_writeRef(MS *o, U8 opCode, const void* data, int len)
+{
+   int rc;
+   MS_setFragmented(o, opCode);
+   rc=MST_writeRef(&o->mst,
+                       MS_setFrameHeader(MST_getSendBufPtr(&o->mst),opCode,len),
+                       data, len);
+   return rc < 0 ? rc : 0;
+}
+
+
 int
 MS_close(MS *o, int statusCode)
 {
    if(se_sockValid(o->mst.sock))
    {
-      if(statusCode)
+      /* The close frame is dropped if the transmit queue cannot take
+         it, since MS_send would then block.
+      */
+      if(o->mst.isSecure || MS_txqFull(o, 4) == 0)
       {
-         U8* ctrlBuf=MS_prepSend(o, FALSE, 0);
-         /* 2 byte status code RFC6455 5.5.1 */
-         ctrlBuf[0] = (U8)((unsigned)statusCode >> 8); /* high */
-         ctrlBuf[1] = (U8)statusCode; /* low */
-         MS_send(o,WSOP_Close,2);
+         if(statusCode)
+         {
+            U8* ctrlBuf=MS_prepSend(o, FALSE, 0);
+            /* 2 byte status code RFC6455 5.5.1 */
+            ctrlBuf[0] = (U8)((unsigned)statusCode >> 8); /* high */
+            ctrlBuf[1] = (U8)statusCode; /* low */
+            MS_send(o,WSOP_Close,2);
+         }
+         else
+            MS_send(o,WSOP_Close,2);
       }
-      else
-         MS_send(o,WSOP_Close,2);
+      MST_flush(&o->mst); /* Queued data: sent without blocking */
    }
    se_close(o->mst.sock);
    return statusCode < 0 ? statusCode : -statusCode;
@@ -575,7 +2197,7 @@ static int
 MS_rawRead(MS* o, U8 **buf, U32 timeout)
 {
    U8* ptr;
-   int i,len,maxlen;
+   int len,maxlen;
    int newFrame=FALSE;
    o->rs.isTimeout=0;
    if(o->rs.overflowPtr) /* Previous frame: Consumed more than frame length */
@@ -603,7 +2225,8 @@ MS_rawRead(MS* o, U8 **buf, U32 timeout)
    }
    /*Do we have a complete frame header? Loop: cp header and decrement 'len' */
    while( o->rs.frameHeaderIx < 6 ||
-          (o->rs.frameHeaderIx < 8 && (o->rs.frameHeader[1] & 0x7F) > 125) )
+          (o->rs.frameHeaderIx < 8 && (o->rs.frameHeader[1] & 0x7F) > 125) ||
+          (o->rs.frameHeaderIx < 14 && (o->rs.frameHeader[1] & 0x7F) == 127) )
    {
       if(len == 0) /* If we need more data */
          goto L_readMore; /* Read from socket */
@@ -611,6 +2234,7 @@ MS_rawRead(MS* o, U8 **buf, U32 timeout)
       o->rs.frameHeader[o->rs.frameHeaderIx++] = *ptr++;
       len--;
    }
+   o->rs.newFrame=newFrame;
    if(newFrame) /* Start of new frame */
    {
       if( ! (o->rs.frameHeader[1] & 0x80) )
@@ -621,27 +2245,33 @@ MS_rawRead(MS* o, U8 **buf, U32 timeout)
          o->rs.frameLen = o->rs.frameHeader[1] & 0x7F;
          o->rs.maskPtr = o->rs.frameHeader+2;
       }
-      else
+      else if(o->rs.frameHeaderIx == 8)
       {
-         baAssert(o->rs.frameHeaderIx == 8);
-         /* We only accept 16 bit extended frames */
-         if((o->rs.frameHeader[1] & 0x7F) > 126)
-            return MS_close(o, 1009);
          o->rs.frameLen = (int)(((U16)o->rs.frameHeader[2]) << 8);
          o->rs.frameLen |= o->rs.frameHeader[3];
          o->rs.maskPtr = o->rs.frameHeader+4;
       }
+      else
+      {
+         U8* lenPtr = o->rs.frameHeader+2; /* 64 bit length, network order */
+         baAssert(o->rs.frameHeaderIx == 14);
+         /* frameLen is an int: we accept frames up to 2^31-1 */
+         if(lenPtr[0] || lenPtr[1] || lenPtr[2] || lenPtr[3] || lenPtr[4]&0x80)
+            return MS_close(o, 1009);
+         o->rs.frameLen = (int)(((U32)lenPtr[4] << 24) |
+                                ((U32)lenPtr[5] << 16) |
+                                ((U32)lenPtr[6] << 8) | lenPtr[7]);
+         o->rs.maskPtr = o->rs.frameHeader+10;
+      }
    }
    *buf = ptr; /* Adjust payload for consumed header (rec or overflow data) */
    /* payload data is masked: RFC6455 5.3.  Client-to-Server Masking */
    maxlen = o->rs.bytesRead+len;
    if(maxlen > o->rs.frameLen)
       maxlen = o->rs.frameLen;
-   for(i=o->rs.bytesRead ; i < maxlen; i++,ptr++)
-   {
-      /* orig-octet-i = masked-octet-i XOR (maskPtr[i MOD 4]) */
-      *ptr ^= o->rs.maskPtr[i&3];
-   }
+   maxlen -= o->rs.bytesRead; /* Payload bytes in this chunk */
+   msUnmask(ptr, maxlen, o->rs.maskPtr, o->rs.bytesRead);
+   ptr += maxlen;
    o->rs.bytesRead += len;
    if(o->rs.bytesRead >= o->rs.frameLen)
    {
@@ -659,8 +2289,11 @@ MS_rawRead(MS* o, U8 **buf, U32 timeout)
 }
 
 
-int
-MS_read(MS* o, U8 **buf, U32 timeout)
+/* Read and manage one frame chunk. Control frames are managed here and
+ * data frames are returned to the caller.
+ */
+static int
+MS_readFrame(MS* o, U8 **buf, U32 timeout)
 {
    int len;
    U8* ctrlBuf=0;
@@ -668,12 +2301,44 @@ MS_read(MS* o, U8 **buf, U32 timeout)
    len = MS_rawRead(o, buf, timeout);
    if(len >= 0 && !o->rs.isTimeout)
    {
+      if( ! (o->rs.frameHeader[0] & 0x08) ) /* Data frame */
+      {
+         o->rs.msgState=0;
+         if(o->rs.newFrame)
+         {  /* RFC6455 5.4: Fragmentation */
+            U8 op = o->rs.frameHeader[0] & 0x7F;
+#ifdef MS_DEFLATE
+            if(o->pmd.active && op != (MS_RSV1|WSOP_Continue))
+               op &= ~MS_RSV1;
+#endif
+            switch(op) /* RSV bits must be 0 */
+            {
+               case WSOP_Continue:
+                  if( ! o->rs.fragmented )
+                     return MS_close(o, 1002);
+                  break;
+               case WSOP_Text & 0x7F:
+               case WSOP_Binary & 0x7F:
+                  if(o->rs.fragmented)
+                     return MS_close(o, 1002);
+                  o->rs.opCode = (o->rs.frameHeader[0] & 0x0F) | WSOP_FIN;
+                  o->rs.msgState=WSMSG_BEGIN;
+#ifdef MS_DEFLATE
+                  o->pmd.compressed =
+                     (o->rs.frameHeader[0] & MS_RSV1) ? TRUE : FALSE;
+#endif
+                  break;
+               default:
+                  return MS_close(o, 1002);
+            }
+            o->rs.fragmented = (o->rs.frameHeader[0] & WSOP_FIN) ? FALSE:TRUE;
+         }
+         if( ! o->rs.fragmented && o->rs.bytesRead == o->rs.frameLen )
+            o->rs.msgState |= WSMSG_END;
+         return len;
+      }
       switch(o->rs.frameHeader[0])
       {
-         case WSOP_Text:
-         case WSOP_Binary:
-            break;
-
          /* Control frames below */
 
          case WSOP_Close:
@@ -705,9 +2370,107 @@ MS_read(MS* o, U8 **buf, U32 timeout)
                MS_send(o,WSOP_Pong,o->rs.frameLen);
             goto L_readMore;
 
-         default:  /* Unkown opcode (rsp 1002) or FIN=0 (rsp 1008) */
-            return MS_close(o, 0x80 & o->rs.frameHeader[0] ? 1002 : 1008);
+         default:  /* Unkown opcode or fragmented control frame */
+            return MS_close(o, 1002);
       }
    }
    return len;
 }
+
+
+#ifdef MS_DEFLATE
+/* Set the chunk returned by MS_read to the inflated data in inBuf */
+static int
+MS_pmdChunk(MS* o, U8 **buf, BaBool endOfMsg)
+{
+   MSDeflate* d=&o->pmd;
+   int len=d->inLen;
+   *buf=d->inBuf;
+   d->inLen=0;
+   o->rs.msgState = (U8)((d->beginMsg ? WSMSG_BEGIN : 0) |
+                         (endOfMsg ? WSMSG_END : 0));
+   d->beginMsg=FALSE;
+   return len;
+}
+
+
+/* MS_read when permessage-deflate is active. Compressed messages are
+ * inflated into inBuf and returned in chunks of up to
+ * MS_INFLATE_BUF_SIZE bytes. The last inflated byte is held back when
+ * inBuf is full, making sure the chunk ending a message is not empty.
+ */
+static int
+MS_inflateRead(MS* o, U8 **buf, U32 timeout)
+{
+   static const U8 tail[]={0x00,0x00,0xFF,0xFF}; /* RFC7692 7.2.2 */
+   MSDeflate* d=&o->pmd;
+   int rc;
+   for(;;)
+   {
+      if( ! d->inflating )
+      {
+         rc=MS_readFrame(o, buf, timeout);
+         if(rc < 0 || o->rs.isTimeout || ! d->compressed)
+            return rc;
+         d->zin.next_in=*buf;
+         d->zin.avail_in=(uInt)rc;
+         d->endOfMsg = (o->rs.msgState & WSMSG_END) ? TRUE : FALSE;
+         if(o->rs.msgState & WSMSG_BEGIN)
+            d->beginMsg=TRUE;
+         d->inflating=TRUE;
+      }
+      if(d->hasCarry)
+      {
+         d->inBuf[0]=d->carry;
+         d->inLen=1;
+         d->hasCarry=FALSE;
+      }
+      d->zin.next_out=d->inBuf+d->inLen;
+      d->zin.avail_out=(uInt)(MS_INFLATE_BUF_SIZE-d->inLen);
+      rc=inflate(&d->zin, Z_SYNC_FLUSH);
+      if(rc == Z_STREAM_END)
+      {  /* BFINAL set: ignore the tail and reset at end of message */
+         d->zin.avail_in=0;
+         d->tail=d->streamEnd=TRUE;
+      }
+      else if(rc != Z_OK && rc != Z_BUF_ERROR)
+         return MS_close(o, 1007);
+      d->inLen = MS_INFLATE_BUF_SIZE - (int)d->zin.avail_out;
+      if(d->zin.avail_out == 0)
+      {
+         d->carry=d->inBuf[--d->inLen];
+         d->hasCarry=TRUE;
+         return MS_pmdChunk(o, buf, FALSE);
+      }
+      if( ! d->endOfMsg )
+         d->inflating=FALSE; /* Read next chunk */
+      else if( ! d->tail )
+      {
+         d->zin.next_in=(Bytef*)tail;
+         d->zin.avail_in=sizeof(tail);
+         d->tail=TRUE;
+      }
+      else
+      {
+         d->inflating=d->tail=FALSE;
+         if((d->flags & MS_PMD_CLIENT_NCT) || d->streamEnd)
+         {
+            inflateReset(&d->zin);
+            d->streamEnd=FALSE;
+         }
+         return MS_pmdChunk(o, buf, TRUE);
+      }
+   }
+}
+#endif
+
+
+int
+MS_read(MS* o, U8 **buf, U32 timeout)
+{
+#ifdef MS_DEFLATE
+   if(o->pmd.active)
+      return MS_inflateRead(o, buf, timeout);
+#endif
+   return MS_readFrame(o, buf, timeout);
+}
@@ -40,6 +40,9 @@
 #define _MSLib_h
 
 #include <selib.h>
+#ifdef MS_DEFLATE
+#include <zlib.h>
+#endif
 
 struct MST;
 
@@ -48,9 +51,9 @@ struct MST;
 */
 
 /* RFC6455 Page 29: Opcode:  4 bits.
- * WS Opcodes with FIN=1. We do not manage WS fragments (FIN=0/1)
- * since it's not really used and the complexity is not something you
- * want in a tiny device.
+ * WS Opcodes with FIN=1. Fragmented messages (FIN=0 followed by
+ * continuation frames) are managed by MS_read and sent using
+ * MS_beginMessage, MS_continue, and MS_endMessage.
  */
 #define WSOP_Text   0x81
 #define WSOP_Binary 0x82
@@ -58,6 +61,13 @@ struct MST;
 #define WSOP_Close  0x88
 #define WSOP_Ping   0x89
 #define WSOP_Pong   0x8A
+/* RFC6455 5.4.  Fragmentation */
+#define WSOP_FIN      0x80
+#define WSOP_Continue 0x00
+
+/* WssReadState#msgState flags */
+#define WSMSG_BEGIN 1 /* First chunk in a message */
+#define WSMSG_END   2 /* Last chunk in a message */
 
 
 /** @defgroup MSLibErrCodes Minnow Server Error Codes
@@ -103,6 +113,13 @@ struct MST;
 /** Socket write error */
 #define MS_ERR_WRITE                 -18
 
+/** Returned by #MS_sendNB when a transmit queue is set and the frame
+    cannot be sent without blocking: the frame is larger than the
+    queue, or the connection is secure. Secure connections do not use
+    the queue.
+*/
+#define MS_ERR_TXQ                   -19
+
 /** Encrypted ZIP file not supported by ZipFileSystem */
 #define MS_ERR_ENCRYPTED_ZIP         -30
 
@@ -121,6 +138,22 @@ struct MST;
 
 /** @} */ /* end group MSLibErrCodes */ 
 
+/** Returned by #MS_webServerFeed when the HTTP request header is
+    incomplete. Call the function again when more data is available.
+*/
+#define MS_NEED_MORE                  1
+
+/** Returned by #MS_sendNB when the transmit queue is above its high
+    watermark. The frame is not sent.
+*/
+#define MS_WOULD_BLOCK                2
+
+/** Returned by #MS_webServerFeed when a static content response was
+    sent and the connection is kept open for the next HTTP request.
+    See WssProtocolHandshake#keepAliveTmo.
+*/
+#define MS_KEEP_ALIVE                 3
+
 
 #define MAX_HTTP_H_SIZE 20
 
@@ -138,7 +171,7 @@ typedef int (*MSFetchPage)(void* hndl, struct MST* mst,U8* path);
     WssProtocolHandshake wph={0};
     \endcode
  */
-typedef struct {
+typedef struct WssProtocolHandshake {
    /** In param: Enable HTTP basic authentication by setting
        'b64Credent' to a B64 encoded string of 'username:password'
 
@@ -197,6 +230,53 @@ typedef struct {
    /** All HTTP header values sent by the client. NULL signals end of array.
     */
    U8* hVals[MAX_HTTP_H_SIZE];
+
+   /** In param: enable HTTP persistent connections (keep-alive) by
+       setting the idle timeout in seconds. The connection is then
+       kept open after responding to a static content request, and
+       the next request, such as the WebSocket upgrade request, is
+       sent on the same connection. A secure connection then performs
+       only one SSL handshake. Zero, the default, closes the
+       connection after each response.
+
+       Only responses formatted with #MST_respCT, #MS_respCT, or
+       #MST_respAsset keep the connection open. Note that
+       #MS_webServer blocks until the timeout expires if the client
+       does not send a new request.
+   */
+   U16 keepAliveTmo;
+
+#ifdef MS_DEFLATE
+   /** In param: enable permessage-deflate (RFC 7692) compression by
+       setting the window size in bits, 9 to 15, used when compressing
+       messages sent to the client. Zero disables compression. The
+       value is reduced if the client requests a smaller window.
+       See #MSDeflate for details.
+   */
+   U8 deflateWindowBits;
+
+   /** In param: the window size in bits, 8 to 15, the client may
+       use when compressing messages. Zero is the same as 15. A
+       smaller window reduces the memory required for decompressing
+       data, but offers from clients not supporting
+       'client_max_window_bits' are then declined.
+   */
+   U8 inflateWindowBits;
+
+   /** In param: #MS_PMD_SERVER_NCT and/or #MS_PMD_CLIENT_NCT.
+       Reset the compression context after each message.
+   */
+   U8 noContextTakeover;
+#endif
+
+   /* Private members: request parse state used by MS_webServerFeed */
+   int reqLen; /* Partial request header size saved in the send buffer */
+   int lineStart; /* Tokenizer: offset of the current header line */
+   int scanned; /* Tokenizer: number of bytes scanned */
+   int hIx; /* Tokenizer: number of entries in hKeys and hVals */
+   U8 hIndex[16]; /* Known header's hKeys index + 1, see msHttpHdrTab */
+   BaBool started; /* Set by the first MS_webServerFeed call */
+   BaBool pipelined; /* Data follows the request header */
 } WssProtocolHandshake;
 
 
@@ -210,9 +290,12 @@ typedef struct
    int overflowLen; /* overflowPtr len is used internally in wsRawRead */
    int frameHeaderIx; /* Cursor used when reading frameHeader from socket */
    U8* maskPtr;
-   U8 frameHeader[8]; /*[0] FIN+opcode, [1] Payload len, [2-3] Ext payload len*/
+   /*[0] FIN+opcode, [1] Payload len, [2-3] or [2-9] Ext payload len, mask*/
+   U8 frameHeader[14];
 
-   /** The WebSocket frame length.
+   /** The WebSocket frame length. Frames using the 64 bit extended
+       payload length are accepted up to 2^31-1 bytes; larger frames
+       are rejected with status code 1009.
     */
    int frameLen;
 
@@ -223,6 +306,23 @@ typedef struct
    /** Set when function msRead returns due to a timeout.
    */
    U8 isTimeout;
+
+   /** The message type, #WSOP_Text or #WSOP_Binary, for all chunks
+       in a message, including the chunks in continuation frames.
+   */
+   U8 opCode;
+
+   /** Message state for the chunk returned by #MS_read: #WSMSG_BEGIN
+       is set for the first chunk in a message and #WSMSG_END is set
+       for the last chunk. Both flags are set when the message is one
+       frame that fits in the receive buffer, and none of the flags
+       are set for the chunks in between.
+   */
+   U8 msgState;
+
+   /* Private members */
+   BaBool newFrame; /* Set if MS_rawRead returns the first frame chunk */
+   BaBool fragmented; /* Set if waiting for continuation frames */
 } WssReadState;
 
 
@@ -246,9 +346,12 @@ typedef struct {
  * for reading and writing socket data either in secure mode using
  * SharkSSL or non secure mode.
  */
+struct MSTxQ;
+
 typedef struct MST
 {
    SOCKET* sock;
+   struct MSTxQ* txq; /* Optional transmit queue: see MS_setTxQueue */
 #ifdef MS_SEC
    union {
       SharkSslCon* sc;
@@ -257,7 +360,10 @@ typedef struct MST
 #else
    MSTBuf b;
 #endif
+   /* The request, set while calling MSFetchPage: see MST_getHeader */
+   struct WssProtocolHandshake* wph;
    BaBool isSecure;
+   U8 keepAlive; /* HTTP persistent connection state: see MST_respCT */
 } MST;
 
 /** Get the send buffer pointer.
@@ -285,6 +391,216 @@ int MST_read(MST* o,U8 **buf,U32 timeout);
 */ 
 int MST_write(MST* o,U8* buf, int len);
 
+/** Scatter/gather element used by #MST_writev.
+ */
+typedef struct {
+   const void* data;
+   int len;
+} MSIoVec;
+
+/** Max number of #MSIoVec elements sent in one system call. */
+#ifndef MST_MAX_IOV
+#define MST_MAX_IOV 8
+#endif
+
+/** Write the data in 'iovcnt' #MSIoVec elements. The data is sent
+    without copying in non secure mode on POSIX systems, using one
+    system call for up to #MST_MAX_IOV elements. The data is copied
+    into the send buffer in secure mode since the SharkSSL zero copy
+    API encrypts in place, and on platforms without writev.
+    \param o MST instance
+    \param iov the data to send.
+    \param iovcnt number of elements in 'iov'.
+    \return the number of bytes sent or #MS_ERR_WRITE.
+*/
+int MST_writev(MST* o, const MSIoVec* iov, int iovcnt);
+
+/** Send 'hlen' bytes staged in the send buffer, such as an HTTP
+    response header, followed by caller owned immutable data such as
+    a page stored in flash. The data is sent directly from 'data' in
+    non secure mode and copied into the send buffer in secure mode.
+    \param o MST instance
+    \param hlen number of bytes saved to the return value from
+    MST_getSendBufPtr.
+    \param data the data to send.
+    \param len 'data' length.
+    \return the number of bytes sent or #MS_ERR_WRITE.
+*/
+int MST_writeRef(MST* o, int hlen, const void* data, int len);
+
+/** Time in milliseconds #MS_webServer waits for the client to close
+    the connection after the last HTTP response, when the client sent
+    data not read by the server. See #MST_linger.
+*/
+#ifndef MS_LINGER_TMO
+#define MS_LINGER_TMO 300
+#endif
+
+/** Send the queued data, if any, and shut down the write side of the
+    connection after the last HTTP response. The client receives the
+    complete response followed by FIN. Call #MST_linger before closing
+    the socket: closing a socket with unread data makes the TCP stack
+    send a reset, and a reset arriving before the client has read the
+    response destroys the response (seen with Safari).
+    \param o MST instance
+    \return zero on success or #MS_ERR_WRITE.
+*/
+int MST_shutdown(MST* o);
+
+/** Read and discard data received after #MST_shutdown until the
+    client closes the connection.
+    \param o MST instance
+    \param timeout the time in milliseconds to wait for data. Set to
+    zero in event driven servers and call the function when the socket
+    is readable.
+    \return 1 when the client closed the connection or on error, and
+    zero when no more data is available. The caller closes the socket
+    in both cases, but should wait for the socket to become readable
+    when zero is returned and the linger deadline has not expired.
+*/
+int MST_linger(MST* o, U32 timeout);
+
+/** Format an HTTP 200 OK response with Content Length in the send
+    buffer. Same as #msRespCT, but the response keeps the connection
+    open if the client requested a persistent connection and
+    WssProtocolHandshake#keepAliveTmo is set. Use this function in
+    #MSFetchPage callbacks.
+    \param o MST instance
+    \param dlen set to the send buffer size minus the size of the
+    response header.
+    \param contentLen the size of the static content.
+    \param extHeader optional extra headers formatted as '\\r\\nkey:val'
+    \return a pointer to the end of the response header in the send
+    buffer or NULL if the send buffer is too small.
+*/
+U8* MST_respCT(MST* o, int* dlen, int contentLen, const U8* extHeader);
+
+/** Returns the value of HTTP request header 'name', such as
+    "If-None-Match", or NULL if the client did not send the
+    header. The name is case insensitive. This function can only be
+    used in a #MSFetchPage callback.
+*/
+const U8* MST_getHeader(MST* o, const char* name);
+
+/** Parses the HTTP request's Range header (RFC 7233) for a resource
+    of 'size' bytes. One byte range is supported: "bytes=first-last",
+    "bytes=first-", and "bytes=-suffixLength". The function returns 0,
+    i.e. send the complete resource, for all other ranges, and if the
+    request includes an If-Range header not matching 'etag'. This
+    function can only be used in a #MSFetchPage callback.
+    \param o the MST instance.
+    \param etag the resource's ETag, including the quotes, or NULL.
+    \param size the size of the resource.
+    \param offset Out param: the first byte to send.
+    \param len Out param: the number of bytes to send.
+    \return 1: send 206 Partial Content with 'len' bytes starting at
+    'offset', 0: send 200 OK with the complete resource, -1: send 416
+    Range Not Satisfiable.
+*/
+int MST_getRange(MST* o, const char* etag, U32 size, U32* offset, U32* len);
+
+/** Returns TRUE if the HTTP request's Accept-Encoding header accepts
+    content encoding 'encoding', such as "gzip" or "br". An encoding
+    with q=0 is not accepted. This function can only be used in a
+    #MSFetchPage callback.
+*/
+BaBool MST_acceptEncoding(MST* o, const char* encoding);
+
+
+#ifdef MS_DEFLATE
+/** @defgroup MSDeflate permessage-deflate
+    @ingroup MSLib
+
+    \brief WebSocket compression (RFC 7692).
+
+    Compile the Minnow Server with MS_DEFLATE and link with zlib to
+    enable compression, then set WssProtocolHandshake#deflateWindowBits
+    to negotiate permessage-deflate with clients offering the
+    extension. Messages sent with #MS_send, #MS_write, and the
+    fragment functions are then compressed and messages returned by
+    #MS_read are decompressed; the API is otherwise unchanged.
+    Messages shorter than #MS_DEFLATE_MIN_LEN, frames sent with
+    #MS_writeRef, and #MS_broadcast frames are sent uncompressed.
+
+    Memory per connection: zlib requires (1 << (deflateWindowBits+2))
+    + (1 << (MS_DEFLATE_MEM_LEVEL+9)) bytes for compressing and
+    (1 << inflateWindowBits) + 7 Kbytes for decompressing, plus
+    #MS_INFLATE_BUF_SIZE and the send buffer size for the Minnow
+    Server's own buffers. The memory is allocated using
+    MS_DEFLATE_ALLOC when the extension is negotiated and released by
+    #MS_destructor.
+@{
+*/
+
+/** The buffer size used for returning decompressed data */
+#ifndef MS_INFLATE_BUF_SIZE
+#define MS_INFLATE_BUF_SIZE 1024
+#endif
+
+/** zlib memLevel, 1 to 9. Use 1 on small MCUs. */
+#ifndef MS_DEFLATE_MEM_LEVEL
+#define MS_DEFLATE_MEM_LEVEL 8
+#endif
+
+/** zlib compression level, 1 to 9. */
+#ifndef MS_DEFLATE_LEVEL
+#define MS_DEFLATE_LEVEL 6
+#endif
+
+/** Messages shorter than this value are not compressed */
+#ifndef MS_DEFLATE_MIN_LEN
+#define MS_DEFLATE_MIN_LEN 32
+#endif
+
+/** Allocator used by zlib and for the Minnow Server buffers */
+#ifndef MS_DEFLATE_ALLOC
+#define MS_DEFLATE_ALLOC(size) malloc(size)
+#define MS_DEFLATE_FREE(ptr) free(ptr)
+#endif
+
+/** zlib windowBits used when decompressing a gzip #MSAsset for a client
+    not accepting gzip. The value must not be smaller than the window
+    the asset was compressed with. The decompressor requires
+    (1 << MS_GZIP_WINDOW_BITS) bytes plus about 7 Kbytes while sending
+    the asset.
+    The htmlamalg tool's -w option sets the compression window.
+*/
+#ifndef MS_GZIP_WINDOW_BITS
+#define MS_GZIP_WINDOW_BITS 15
+#endif
+
+/** Reset the compressor after each message sent */
+#define MS_PMD_SERVER_NCT 1
+/** Request that the client resets its compressor after each message */
+#define MS_PMD_CLIENT_NCT 2
+
+/** permessage-deflate state, one per #MS instance */
+typedef struct
+{
+   /* Private members */
+   z_stream zin;
+   z_stream zout;
+   U8* inBuf; /* Inflated data returned by MS_read */
+   U8* outBuf; /* Deflated data */
+   int inLen; /* Bytes in inBuf */
+   int outBufSize;
+   U8 flags; /* MS_PMD_SERVER_NCT | MS_PMD_CLIENT_NCT */
+   U8 sendOp; /* Opcode for the compressed message being sent */
+   U8 carry; /* Last inflated byte, held back when inBuf is full */
+   BaBool active; /* If permessage-deflate was negotiated */
+   BaBool hasCarry;
+   BaBool compressed; /* If receiving a compressed message */
+   BaBool inflating; /* If zin has input or the message tail is pending */
+   BaBool endOfMsg; /* If zin's input ends the message */
+   BaBool tail; /* If the RFC 7692 7.2.2 tail was added */
+   BaBool streamEnd; /* If the client set BFINAL */
+   BaBool beginMsg; /* If next chunk is the first in the message */
+   BaBool sending; /* If sending a fragmented compressed message */
+} MSDeflate;
+
+/** @} */ /* end group MSDeflate */
+#endif
+
 
 /** MS: Minnow Server HTTP(S) and (secure) WebSocket Server
  */
@@ -292,9 +608,48 @@ typedef struct
 {
    WssReadState rs;
    MST mst;
+#ifdef MS_DEFLATE
+   MSDeflate pmd;
+#endif
+   BaBool fragmented; /* Sending a fragmented message: see MS_broadcast */
 } MS;
 
 
+/** A bounded transmit queue used by #MS_sendNB and by event driven
+    servers such as #MSEvLoop. Data the socket cannot accept without
+    blocking is saved in the queue and sent when the socket becomes
+    writable. The queue is used in non secure mode on POSIX systems;
+    secure connections are written synchronously since SharkSSL
+    encrypts the data in place.
+
+    The queue is full when the number of queued bytes reaches the high
+    watermark, or when the frame does not fit in the free space, and
+    #MS_sendNB then returns #MS_WOULD_BLOCK. The application is
+    notified when the queue drains to the low watermark, for example
+    by the #MSEvLoop onWritable callback. The queue must be larger
+    than the largest frame sent with #MS_sendNB.
+ */
+typedef struct MSTxQ
+{
+   /** In param: called when data is added to an empty queue. An
+       event loop uses the callback to start polling the socket for
+       writability.
+   */
+   void (*onPending)(struct MSTxQ* o, void* arg);
+   /** In param: the 'onPending' argument */
+   void* onPendingArg;
+
+   /* Private members */
+   U8* buf;
+   int size;
+   int start; /* Ring buffer offset of the first queued byte */
+   int len; /* Number of queued bytes */
+   int highWater;
+   int lowWater;
+   BaBool blocked; /* Set when MS_sendNB returns MS_WOULD_BLOCK */
+} MSTxQ;
+
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -365,11 +720,177 @@ U8* msRespCT(U8* dest, int* dlen, int contentLen, const U8* extHeader);
 /** @} */ /* end group MsHelperFunc */ 
 
 
+/** @defgroup MSRoute Route Table
+    @ingroup MSLib
+
+    \brief Serve a web application stored as individual assets.
+
+    The route table maps a request path such as "/css/style.css" to
+    an #MSAsset, a file stored in memory, typically in flash. Each
+    asset is sent with its own content type and encoding, thus the
+    browser can cache the files separately.
+
+    The table is an open addressing hash table. A table generated at
+    compile time uses a seed making the hash perfect i.e. each path
+    is found in one probe. Routes can also be added at runtime using
+    #MS_addRoute.
+
+    <b>Example code:</b>
+    \code
+    static const MSAsset cssAsset={"/style.css", cssData, sizeof(cssData),
+                                   "text/css", "gzip"};
+    static const MSAsset* slots[16];
+    static MSRouteTable routes;
+    MSRouteTable_constructor(&routes, slots, 16, 0);
+    MS_addRoute(&routes, &cssAsset);
+    wph.fetchPage = msRouteFetchPage;
+    wph.fetchPageHndl = &routes;
+    \endcode
+@{
+*/
+
+/** An asset served by the route table */
+typedef struct MSAsset {
+   /** The request path, such as "/index.html" */
+   const char* path;
+   /** The asset content */
+   const U8* data;
+   /** The size of 'data' */
+   U32 len;
+   /** The Content-Type, such as "text/html; charset=UTF-8" */
+   const char* contentType;
+   /** The Content-Encoding, such as "gzip", or NULL if not encoded */
+   const char* encoding;
+   /** Optional strong ETag including the quotes, such as
+       "\"9a3f1c20e5d7b684\"", computed from the content when the
+       asset is generated. The server responds with 304 Not Modified
+       if the client's If-None-Match header matches the ETag.
+   */
+   const char* etag;
+   /** Optional Cache-Control value. Use "no-cache" for assets with a
+       fixed path, such as index.html, so the browser revalidates the
+       asset using the ETag, and "max-age=31536000, immutable" for
+       assets with the content hash in the path.
+   */
+   const char* cacheControl;
+   /** Optional pre-built 200 OK response header followed by the
+       content, emitted by the asset generator. The header starts with
+       the status line and ends with the headers for a persistent
+       connection: "\r\nConnection: keep-alive\r\nServer: SharkSSL
+       WebSocket Server\r\n\r\n". The asset's 'data' must point to
+       the content in this blob. The response is then sent with one
+       write, without formatting the header.
+   */
+   const U8* resp;
+   /** The length of the header in 'resp', excluding the "\r\nConnection"
+       header and the headers following it. The server replaces these
+       headers when closing the connection after the response.
+   */
+   U16 hdrLen;
+   /** Optional alternative representation of the asset, such as a
+       brotli encoded variant of a gzip asset. The route table sends
+       the alternative to clients accepting alt->encoding. The
+       alternative is not added to the route table.
+   */
+   const struct MSAsset* alt;
+} MSAsset;
+
+/** The route table */
+typedef struct {
+   /* Private members */
+   const MSAsset** slots; /* 'size' entries: NULL is an empty slot */
+   U32 seed; /* Hash seed, see msRouteHash */
+   U16 size; /* A power of 2 */
+   U16 len; /* Number of routes */
+} MSRouteTable;
+
+/** Create a route table.
+    \param o the MSRouteTable instance.
+    \param slotArray an array of 'tabSize' #MSAsset pointers. The
+    pointers must be NULL or set by a generator using the same 'tabSeed'.
+    \param tabSize the number of slots, a power of 2 larger than the
+    number of routes.
+    \param tabSeed the hash seed.
+*/
+void MSRouteTable_constructor(MSRouteTable* o, const MSAsset** slotArray,
+                              U16 tabSize, U32 tabSeed);
+
+/** Returns the number of routes in the table */
+#define MSRouteTable_getLen(o) (o)->len
+
+/** The hash function used by the route table: 32 bit FNV-1a with
+    'seed' as the offset basis. A table generator must use the same
+    function.
+    \param path the path.
+    \param len the length of 'path'.
+    \param seed the table's seed.
+*/
+U32 msRouteHash(const U8* path, int len, U32 seed);
+
+/** Add a route.
+    \return zero on success or #MS_ERR_ALLOC if the table is full.
+*/
+int MS_addRoute(MSRouteTable* o, const MSAsset* asset);
+
+/** Find the asset for request path 'path'. A query string, if any, is
+    ignored.
+    \return the asset or NULL if not found.
+*/
+const MSAsset* MSRouteTable_find(MSRouteTable* o, const U8* path);
+
+/** A #MSFetchPage callback serving the assets in the route table
+    'hndl'. Set WssProtocolHandshake#fetchPage to this function and
+    WssProtocolHandshake#fetchPageHndl to the #MSRouteTable. Sends
+    304 Not Modified, without the content, if the asset has an ETag
+    matching the request's If-None-Match header and 206 Partial
+    Content for a Range request (see #MST_getRange). Sends the pre-built
+    response MSAsset#resp, if any, without copying it to the send
+    buffer.
+
+    The Content-Encoding is negotiated using the request's
+    Accept-Encoding header: the function sends MSAsset#alt if the
+    client accepts the alternative's encoding, and the asset if the
+    client accepts the asset's encoding. A gzip asset is decompressed
+    while sending it to clients accepting neither, such as curl
+    without the --compressed option, if the server is compiled with
+    MS_DEFLATE (zlib). See #MS_GZIP_WINDOW_BITS.
+*/
+int msRouteFetchPage(void* hndl, struct MST* mst, U8* path);
+
+/** Formats the response header for asset 'a' in the send buffer. The
+    asset's 'data' and 'resp' members are not used, thus a #MSFetchPage
+    callback can use this function for content not stored in memory,
+    such as a file. The function selects the response status as
+    described for #msRouteFetchPage.
+    \param o the MST instance.
+    \param a the asset.
+    \param extHeader optional extra headers formatted as '\\r\\nkey: val'.
+    \param offset Out param: the offset of the content to send.
+    \param len Out param: the number of content bytes to send after
+    the header, zero for 304 and 416.
+    \return the length of the header in the send buffer or
+    #MS_ERR_ALLOC if the send buffer is too small.
+*/
+int MST_respAsset(MST* o, const MSAsset* a, const U8* extHeader,
+                  U32* offset, U32* len);
+
+/** @} */ /* end group MSRoute */
+
+
 /** Minnow Server Constructor
     \param o MS instance
  */
 #define MS_constructor(o) memset(o,0,sizeof(MS))
 
+#ifdef MS_DEFLATE
+/** Release the permessage-deflate resources, if any. Call this
+    function when the connection is closed.
+*/
+void MS_destructor(MS* o);
+#else
+#define MS_destructor(o)
+#endif
+
 /** Set the SharkSSL object and the socket connection after socket
  * select accepts and creates a new server socket. The Minnow server
  * instance will operate in secure (SSL) mode when this function is
@@ -439,6 +960,17 @@ U8* MS_respCT(MS* o, int* dlen, int contentLen, const U8* extHeader);
     <b>Note:</b> WssProtocolHandshake#fetchPage must have been
     initialized for the function to respond to HTTP GET requests.
 
+    The function manages multiple requests on the same connection
+    when WssProtocolHandshake#keepAliveTmo is set, and returns when
+    the connection is upgraded, the client closes the connection, or
+    the idle timeout expires.
+
+    The connection is half closed after the last static content
+    response. If the client sent data not read by the server, the
+    function discards the data and waits up to #MS_LINGER_TMO
+    milliseconds for the client to close the connection (see
+    #MST_linger).
+
     \return Zero on successful WebSocket connection upgrade. Returns
     an error code for all other operations, including fetching static
     content using the callback MSFetchPage -- in this case,
@@ -447,6 +979,23 @@ U8* MS_respCT(MS* o, int* dlen, int contentLen, const U8* extHeader);
  */
 int MS_webServer(MS *o, WssProtocolHandshake* wph);
 
+/** Non blocking version of #MS_webServer designed for event driven
+    servers such as #MSEvLoop and bare metal systems. The function
+    consumes the data currently available on the connection and
+    returns #MS_NEED_MORE if the HTTP request header is incomplete. The
+    parse state is kept in 'wph', thus a slow client cannot block the
+    caller. Call the function again when the socket is readable.
+
+    <b>Note:</b> the initial SSL handshake in secure mode is performed
+    by the first call and blocks until completed.
+
+    \return #MS_NEED_MORE, #MS_KEEP_ALIVE when a static content
+    response was sent and the connection should be kept open for
+    WssProtocolHandshake#keepAliveTmo seconds, or the values returned
+    by #MS_webServer.
+ */
+int MS_webServerFeed(MS *o, WssProtocolHandshake* wph);
+
 /** Prepare sending a WebSocket frame using one of MS_sendBin or
     MS_sendText. This function returns a pointer to the SharkSSL send
     buffer, offset to the start of the WebSocket's payload
@@ -468,6 +1017,126 @@ U8* MS_prepSend(MS* o, int extSize, int* maxSize);
 
 int MS_send(MS* o, U8 opCode, int len);
 
+/** Non blocking version of #MS_send. The frame is sent or saved in
+    the transmit queue set with #MS_setTxQueue, and the function
+    returns #MS_WOULD_BLOCK without sending the frame if the queue is
+    full. The application can then drop or coalesce stale data, such
+    as a periodic sensor reading, and send the latest value when the
+    queue drains. The function never blocks when a queue is set: it
+    returns #MS_ERR_TXQ for a frame larger than the queue and for a
+    secure connection. This function is the same as #MS_send if no
+    transmit queue is set.
+
+    \return Zero on success, #MS_WOULD_BLOCK, or an \link
+    MSLibErrCodes Error Code \endlink on error.
+*/
+int MS_sendNB(MS* o, U8 opCode, int len);
+
+/** Create a transmit queue.
+    \param o the MSTxQ instance.
+    \param buf the queue buffer.
+    \param size 'buf' size.
+    \param highWater the queue is full when the number of queued
+    bytes reaches this value.
+    \param lowWater the queue is writable again when the number of
+    queued bytes drops to this value.
+*/
+void MSTxQ_constructor(MSTxQ* o, U8* buf, int size,
+                       int highWater, int lowWater);
+
+/** Returns the number of bytes in the transmit queue. */
+#define MSTxQ_getLen(o) (o)->len
+
+/** Returns TRUE if #MS_sendNB returned #MS_WOULD_BLOCK and the queue
+    has not yet drained to the low watermark. */
+#define MSTxQ_isBlocked(o) (o)->blocked
+
+/** Returns TRUE and clears the blocked state if the queue was
+    blocked and has drained to the low watermark. */
+#define MSTxQ_writable(o) \
+   ((o)->blocked && (o)->len <= (o)->lowWater ? (o)->blocked=FALSE,TRUE : FALSE)
+
+/** Set the transmit queue used by #MS_sendNB. All frames sent by
+    #MS_send, #MS_write, etc. are then sent without blocking as long
+    as the data fits in the queue, and the data in the queue is
+    always sent before new data. Set 'q' to NULL to remove the queue;
+    the queue must then be empty.
+*/
+#define MS_setTxQueue(o, q) (o)->mst.txq=q
+
+/** Send queued data without blocking. Call this function when the
+    socket is writable.
+    \return the number of bytes left in the queue or #MS_ERR_WRITE.
+*/
+int MST_flush(MST* o);
+
+/** Send all queued data, blocking until sent.
+    \return zero on success or #MS_ERR_WRITE.
+*/
+int MST_drain(MST* o);
+
+/** A group of connections used by #MS_broadcast. The application
+    provides the array used for storing the members.
+ */
+typedef struct MSGroup
+{
+   /** In param: called by #MS_broadcast for each member the frame
+       could not be sent to, with the error code: a socket error or
+       #MS_ERR_TXQ. The callback must not remove members from the
+       group; record the error and close the connection after
+       #MS_broadcast returns. The constructor sets NULL.
+   */
+   void (*onError)(struct MSGroup* o, MS* ms, int status);
+   /** In param: the 'onError' argument */
+   void* onErrorArg;
+
+   /* Private members */
+   MS** list;
+   int len;
+   int size;
+} MSGroup;
+
+/** Create a group.
+    \param o the MSGroup instance.
+    \param list an array of 'size' MS pointers.
+    \param size the maximum number of members.
+*/
+#define MSGroup_constructor(o, _list, _size) \
+   (o)->list=_list,(o)->len=0,(o)->size=_size,(o)->onError=0
+
+/** Add a WebSocket connection to the group.
+    \return zero on success or -1 if the group is full.
+*/
+int MSGroup_add(MSGroup* o, MS* ms);
+
+/** Remove a connection from the group. Remove the connection before
+    it is closed.
+*/
+void MSGroup_remove(MSGroup* o, MS* ms);
+
+/** Returns the number of connections in the group. */
+#define MSGroup_getLen(o) (o)->len
+
+/** Send the same WebSocket frame to all connections in a group. The
+    frame header is built once and the payload is sent from 'data'
+    without copying on non secure connections; secure connections
+    encrypt the frame individually. A connection with a full transmit
+    queue (see #MS_sendNB) is skipped and set in the blocked state, so
+    a slow client does not delay the others and is notified when its
+    queue drains. A connection the frame cannot be written to is
+    reported to MSGroup#onError. A connection in the middle of sending
+    a fragmented message (#MS_beginMessage to #MS_endMessage) is
+    skipped, since a frame sent between the fragments would corrupt
+    the message.
+
+    \param o the group.
+    \param opCode the WebSocket opcode, #WSOP_Text or #WSOP_Binary.
+    \param data the payload.
+    \param len payload length.
+    \return the number of connections the frame was sent to.
+*/
+int MS_broadcast(MSGroup* o, U8 opCode, const void* data, int len);
+
 
 /** Send a WebSocket binary frame using the SharkSSL zero copy API.
 
@@ -499,6 +1168,33 @@ int MS_send(MS* o, U8 opCode, int len);
 #define MS_sendText(o, len) MS_send(o, WSOP_Text, len)
 
 
+/** Send the first frame in a fragmented message using the SharkSSL
+    zero copy API. Use fragments when producing a message that is
+    larger than the send buffer, such as a large JSON document
+    encoded directly into the buffer returned by #MS_prepSend: send
+    the buffer with MS_beginMessage when full, continue with
+    #MS_continue, and complete the message with #MS_endMessage. The
+    frame length rules are the same as for #MS_send. Call #MS_prepSend
+    again before copying the data for each fragment: the send buffer,
+    including the frame header, is encrypted in place in secure mode.
+
+    \param o Minnow Server instance.
+    \param opCode #WSOP_Text or #WSOP_Binary.
+    \param len the length of the data copied into the pointer
+    returned by #MS_prepSend.
+*/
+#define MS_beginMessage(o, opCode, len) \
+   MS_send(o, (U8)((opCode) & ~WSOP_FIN), len)
+
+/** Send a continuation frame in a message started with #MS_beginMessage.
+ */
+#define MS_continue(o, len) MS_send(o, WSOP_Continue, len)
+
+/** Send the last frame in a message started with #MS_beginMessage.
+ */
+#define MS_endMessage(o, len) MS_send(o, WSOP_FIN|WSOP_Continue, len)
+
+
 /** Function used by the two inline functions (macros) #MS_writeBin and
     #MS_writeText.
 
@@ -514,9 +1210,10 @@ int MS_send(MS* o, U8 opCode, int len);
  */
 int MS_write(MS *o, U8 opCode,const void* data,int len);
 
-/** Sends data as WebSocket text frame(s). The data will be sent as
-    multiple frames if len is longer than the SharkSSL send buffer
-    size.
+/** Sends data as one WebSocket binary frame. The frame is streamed
+    through the SharkSSL send buffer in chunks if len is longer than
+    the buffer, using the 16 or 64 bit extended payload length as
+    needed.
     \param o Minnow Server instance.
     \param data the data to send.
     \param len data length.
@@ -528,9 +1225,10 @@ int MS_write(MS *o, U8 opCode,const void* data,int len);
  */
 #define MS_writeBin(o,data,len) MS_write(o,WSOP_Binary,data,len)
 
-/** Send data as WebSocket binary frame(s). The data will be sent as
-    multiple frames if len is longer than the SharkSSL send buffer
-    size.
+/** Sends data as one WebSocket text frame. The frame is streamed
+    through the SharkSSL send buffer in chunks if len is longer than
+    the buffer, using the 16 or 64 bit extended payload length as
+    needed.
     \param o Minnow Server instance.
     \param data the data to send.
     \param len data length.
@@ -542,7 +1240,28 @@ int MS_write(MS *o, U8 opCode,const void* data,int len);
  */
 #define MS_writeText(o,data,len) MS_write(o,WSOP_Text,data,len)
 
+/** Sends constant data, such as a pre-rendered JSON snapshot in
+    flash, as one WebSocket frame. Only the frame header is saved to
+    the send buffer; the payload is sent from 'data' without copying
+    in non secure mode. Do not use this function with data saved to
+    the send buffer.
+
+    \param o Minnow Server instance.
+    \param opCode the WebSocket opcode, #WSOP_Text or #WSOP_Binary.
+    \param data the data to send.
+    \param len data length.
+
+    \return Zero on success or an \link MSLibErrCodes Error Code
+    \endlink on error.
+
+    \sa MST_writeRef
+ */
+int MS_writeRef(MS *o, U8 opCode, const void* data, int len);
+
 /** Sends a WebSocket close frame command to the peer and close the socket.
+    The function does not block on a transmit queue (#MS_setTxQueue):
+    the queued data is sent as far as the socket accepts it without
+    blocking, and the close frame is dropped if the queue is full.
 
     \param o Minnow Server instance.
 
@@ -569,6 +1288,12 @@ int MS_close(MS *o, int statusCode);
     consumed thus far is returned in WssReadState#bytesRead. The
     complete frame is consumed when frameLen == bytesRead.
 
+    A message may also be split into several frames by the peer
+    (fragmentation). Use WssReadState#opCode for the message type and
+    the WssReadState#msgState flags #WSMSG_BEGIN and #WSMSG_END to
+    find the message boundaries. Control frames sent in between the
+    fragments are managed by this function.
+
     \param o Minnow Server instance.
     \param buf is a pointer set to the SharkSSL receive buffer, offset
     to the start of the WebSocket payload data.
@@ -0,0 +1,93 @@
+/**
+ *     ____             _________                __                _
+ *    / __ \___  ____ _/ /_  __(_)___ ___  ___  / /   ____  ____ _(_)____
+ *   / /_/ / _ \/ __ `/ / / / / / __ `__ \/ _ \/ /   / __ \/ __ `/ / ___/
+ *  / _, _/  __/ /_/ / / / / / / / / / / /  __/ /___/ /_/ / /_/ / / /__
+ * /_/ |_|\___/\__,_/_/ /_/ /_/_/ /_/ /_/\___/_____/\____/\__, /_/\___/
+ *                                                       /____/
+ *
+ *                 SharkSSL Embedded SSL/TLS Stack
+ ****************************************************************************
+ *   PROGRAM MODULE
+ *
+ *   $Id$
+ *
+ *   COPYRIGHT:  Real Time Logic LLC, 2013 - 2020
+ *
+ *   This software is copyrighted by and is the sole property of Real
+ *   Time Logic LLC.  All rights, title, ownership, or other interests in
+ *   the software remain the property of Real Time Logic LLC.  This
+ *   software may only be used in accordance with the terms and
+ *   conditions stipulated in the corresponding license agreement under
+ *   which the software has been supplied.  Any unauthorized use,
+ *   duplication, transmission, distribution, or disclosure of this
+ *   software is expressly forbidden.
+ *
+ *   This Copyright notice may not be removed or modified without prior
+ *   written consent of Real Time Logic LLC.
+ *
+ *   Real Time Logic LLC. reserves the right to modify this software
+ *   without notice.
+ *
+ *               http://sharkssl.com
+ ****************************************************************************
+*/
+
+#include "MSRing.h"
+
+
+int
+MSRing_constructor(MSRing* o, void* buf, U32 elemSize, U32 size)
+{
+   memset(o, 0, sizeof(MSRing));
+   if(!size || (size & (size-1)))
+      return MS_ERR_ALLOC;
+   o->buf=(U8*)buf;
+   o->mask=size-1;
+   o->elemSize=elemSize;
+   return 0;
+}
+
+
+BaBool
+MSRing_push(MSRing* o, const void* elem)
+{
+   U32 tail=o->tail;
+   if(tail - o->headCache > o->mask)
+   {  /* Looks full: read the consumer's index */
+      o->headCache=MSRING_LOAD_ACQUIRE(&o->head);
+      if(tail - o->headCache > o->mask)
+         return FALSE;
+   }
+   memcpy(o->buf + (tail & o->mask)*o->elemSize, elem, o->elemSize);
+   MSRING_STORE_RELEASE(&o->tail, tail+1);
+   return TRUE;
+}
+
+
+U32
+MSRing_pop(MSRing* o, void* elems, U32 max)
+{
+   U32 n,first;
+   U32 head=o->head;
+   if(o->tailCache == head)
+   {  /* Looks empty: read the producer's index */
+      o->tailCache=MSRING_LOAD_ACQUIRE(&o->tail);
+      if(o->tailCache == head)
+         return 0;
+   }
+   n = o->tailCache - head;
+   if(n > max)
+      n=max;
+   /* Copy in at most two parts: to the end of the buffer and from
+    * the start.
+    */
+   first = o->mask+1 - (head & o->mask);
+   if(first > n)
+      first=n;
+   memcpy(elems, o->buf + (head & o->mask)*o->elemSize, first*o->elemSize);
+   if(n > first)
+      memcpy((U8*)elems + first*o->elemSize, o->buf, (n-first)*o->elemSize);
+   MSRING_STORE_RELEASE(&o->head, head+n);
+   return n;
+}
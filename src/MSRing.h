@@ -0,0 +1,158 @@
+/*
+ *     ____             _________                __                _
+ *    / __ \___  ____ _/ /_  __(_)___ ___  ___  / /   ____  ____ _(_)____
+ *   / /_/ / _ \/ __ `/ / / / / / __ `__ \/ _ \/ /   / __ \/ __ `/ / ___/
+ *  / _, _/  __/ /_/ / / / / / / / / / / /  __/ /___/ /_/ / /_/ / / /__
+ * /_/ |_|\___/\__,_/_/ /_/ /_/_/ /_/ /_/\___/_____/\____/\__, /_/\___/
+ *                                                       /____/
+ *
+ *                 SharkSSL Embedded SSL/TLS Stack
+ ****************************************************************************
+ *			      HEADER
+ *
+ *   $Id$
+ *
+ *   COPYRIGHT:  Real Time Logic LLC, 2013 - 2020
+ *
+ *   This software is copyrighted by and is the sole property of Real
+ *   Time Logic LLC.  All rights, title, ownership, or other interests in
+ *   the software remain the property of Real Time Logic LLC.  This
+ *   software may only be used in accordance with the terms and
+ *   conditions stipulated in the corresponding license agreement under
+ *   which the software has been supplied.  Any unauthorized use,
+ *   duplication, transmission, distribution, or disclosure of this
+ *   software is expressly forbidden.
+ *
+ *   This Copyright notice may not be removed or modified without prior
+ *   written consent of Real Time Logic LLC.
+ *
+ *   Real Time Logic LLC. reserves the right to modify this software
+ *   without notice.
+ *
+ *               http://sharkssl.com
+ ****************************************************************************
+ *
+ *
+ *  Minnow Server: lock-free single producer single consumer ring buffer
+ */
+
+#ifndef _MSRing_h
+#define _MSRing_h
+
+#include "MSLib.h"
+
+/** @addtogroup MSLib
+@{
+*/
+
+/** @defgroup MSRing Lock-free Ring Buffer
+    @ingroup MSLib
+
+    \brief Pass events from a producer thread to the server thread.
+
+    A single producer single consumer (SPSC) queue of fixed size
+    elements, such as sensor samples pushed by a sampling thread or
+    interrupt handler and drained in batches by the #MSEvLoop thread.
+    Push and pop are wait free and do not allocate memory; the
+    application provides the element buffer. One thread may call
+    #MSRing_push and one other thread may call #MSRing_pop.
+
+    The producer and consumer indexes are kept on separate cache
+    lines, and each side keeps a cached copy of the other side's index
+    so the shared cache line is only read when the ring looks full
+    (producer) or empty (consumer).
+
+    The ring uses the GCC/Clang __atomic builtins. Define
+    #MSRING_LOAD_ACQUIRE and #MSRING_STORE_RELEASE for other
+    compilers.
+
+    <b>Example code:</b>
+    \code
+    static SensorEvent evBuf[256];
+    static MSRing ring;
+    MSRing_constructor(&ring, evBuf, sizeof(SensorEvent), 256);
+
+    // Sampling thread
+    if(MSRing_push(&ring, &ev)) MSEvLoop_notify(&loop, 1);
+
+    // MSEvLoop#onNotify
+    while( (n=MSRing_pop(&ring, events, 32)) != 0 ) { ... }
+    \endcode
+@{
+*/
+
+/** The CPU cache line size. */
+#ifndef MSRING_CACHE_LINE
+#define MSRING_CACHE_LINE 64
+#endif
+
+#ifndef MSRING_LOAD_ACQUIRE
+/** Load an index written by the other thread */
+#define MSRING_LOAD_ACQUIRE(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+/** Publish an index to the other thread */
+#define MSRING_STORE_RELEASE(ptr, val) \
+   __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#endif
+
+/** The ring buffer. The indexes are free running and wrap at 2^32. */
+typedef struct
+{
+   /* Private members */
+   /* Read only after construction */
+   U8* buf;
+   U32 mask; /* size - 1 */
+   U32 elemSize;
+   U8 pad0[MSRING_CACHE_LINE - sizeof(U8*) - 2*sizeof(U32)];
+   /* Written by the consumer */
+   U32 head;
+   U32 tailCache; /* Consumer's copy of tail */
+   U8 pad1[MSRING_CACHE_LINE - 2*sizeof(U32)];
+   /* Written by the producer */
+   U32 tail;
+   U32 headCache; /* Producer's copy of head */
+   U8 pad2[MSRING_CACHE_LINE - 2*sizeof(U32)];
+} MSRing;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Create a ring buffer.
+    \param o the MSRing instance. Align the instance to
+    #MSRING_CACHE_LINE for best performance.
+    \param buf 'size' times 'elemSize' bytes.
+    \param elemSize the element size.
+    \param size the number of elements, a power of two.
+    \return zero on success or #MS_ERR_ALLOC if 'size' is not a power
+    of two.
+ */
+int MSRing_constructor(MSRing* o, void* buf, U32 elemSize, U32 size);
+
+/** Producer: copy one element into the ring.
+    \return TRUE on success or FALSE if the ring is full and the
+    element was dropped.
+ */
+BaBool MSRing_push(MSRing* o, const void* elem);
+
+/** Consumer: copy up to 'max' elements into 'elems' and remove them
+    from the ring.
+    \return the number of elements copied, zero if the ring is empty.
+ */
+U32 MSRing_pop(MSRing* o, void* elems, U32 max);
+
+/** Returns the number of elements in the ring. The value is only
+    exact when called by the producer or consumer while the other side
+    is idle.
+ */
+#define MSRing_getLen(o) \
+   (MSRING_LOAD_ACQUIRE(&(o)->tail) - MSRING_LOAD_ACQUIRE(&(o)->head))
+
+#ifdef __cplusplus
+}
+#endif
+
+/** @} */ /* end group MSRing */
+
+/** @} */ /* end group MSLib */
+
+#endif